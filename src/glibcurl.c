@@ -38,9 +38,9 @@
 #ifdef G_OS_WIN32
 /*______________________________________________________________________*/
 
-/* Timeout for the fds passed to glib's poll() call, in millisecs.
-   curl_multi_fdset(3) says we should call curl_multi_perform() at regular
-   intervals. */
+/* Upper bound for the select() timeout, in millisecs. The actual timeout
+   comes from curl_multi_timeout(3); the bound only makes selectThread pick
+   up fds of handles added while it is blocked. */
 #define GLIBCURL_TIMEOUT 500
 
 /* A structure which "derives" (in glib speak) from GSource */
@@ -161,6 +161,8 @@ CURLMcode glibcurl_remove(CURL *easy_handle) {
 void glibcurl_start() {
   D((stderr, "glibcurl_start\n"));
   curlSrc->callPerform = TRUE;
+  /* Don't wait for some unrelated event to run prepare() */
+  g_main_context_wakeup(NULL);
 }
 /*______________________________________________________________________*/
 
@@ -172,6 +174,7 @@ void glibcurl_set_callback(GlibcurlCallback function, void* data) {
 
 static gpointer selectThread(gpointer data) {
   int fdCount;
+  long timeoutMs;
   struct timeval timeout;
   assert(data == 0); /* Just to get rid of unused param warning */
 
@@ -189,8 +192,13 @@ static gpointer selectThread(gpointer data) {
     /* What fds does libcurl want us to poll? */
     curl_multi_fdset(curlSrc->multiHandle, &curlSrc->fdRead,
                      &curlSrc->fdWrite, &curlSrc->fdExc, &curlSrc->fdMax);
-    timeout.tv_sec = GLIBCURL_TIMEOUT / 1000;
-    timeout.tv_usec = (GLIBCURL_TIMEOUT % 1000) * 1000;
+    /* How long may we wait before libcurl needs to act on its own? */
+    timeoutMs = -1;
+    curl_multi_timeout(curlSrc->multiHandle, &timeoutMs);
+    if (timeoutMs < 0 || timeoutMs > GLIBCURL_TIMEOUT)
+      timeoutMs = GLIBCURL_TIMEOUT;
+    timeout.tv_sec = timeoutMs / 1000;
+    timeout.tv_usec = (timeoutMs % 1000) * 1000;
     fdCount = select(curlSrc->fdMax + 1, &curlSrc->fdRead, &curlSrc->fdWrite,
                      &curlSrc->fdExc, &timeout);
     D((stderr, "selectThread: select() fdCount=%d\n", fdCount));
@@ -240,7 +248,7 @@ gboolean prepare(GSource* source, gint* timeout) {
 
   /* Always dispatch if callPerform, i.e. 1st download just starting. */
   D((stderr, "prepare: trying lock 2\n"));
-  /* Problem: We can block up to GLIBCURL_TIMEOUT msecs here, until the
+  /* Problem: We can block up to the select() timeout here, until the
      select() call returns. However, under Win32 this does not appear to be a
      problem (don't know why) - it _does_ tend to block the GTK thread under
      Linux. */
@@ -291,256 +299,246 @@ gboolean dispatch(GSource* source, GSourceFunc callback,
 void finalize(GSource* source) {
   assert(source == &curlSrc->source);
 }
+/*______________________________________________________________________*/
+
+unsigned int glibcurl_get_n_sockets() {
+  return 0;
+}
+/*______________________________________________________________________*/
+
+void glibcurl_raise_fd_limit() {
+}
 /*======================================================================*/
 
 #else /* !G_OS_WIN32 */
 
-/* Number of highest allowed fd */
-#define GLIBCURL_FDMAX 127
-
-/* Timeout for the fds passed to glib's poll() call, in millisecs.
-   curl_multi_fdset(3) says we should call curl_multi_perform() at regular
-   intervals. */
-#define GLIBCURL_TIMEOUT 1000
+#include <sys/resource.h>
 
 /* GIOCondition event masks */
 #define GLIBCURL_READ  (G_IO_IN | G_IO_PRI | G_IO_ERR | G_IO_HUP)
 #define GLIBCURL_WRITE (G_IO_OUT | G_IO_ERR | G_IO_HUP)
-#define GLIBCURL_EXC   (G_IO_ERR | G_IO_HUP)
-
-/** A structure which "derives" (in glib speak) from GSource */
-typedef struct CurlGSource_ {
-  GSource source; /* First: The type we're deriving from */
 
+/** A socket libcurl asked us to watch. Attached to the socket with
+    curl_multi_assign(), and kept in a hash table for bookkeeping, so there
+    is no upper limit on fd numbers. */
+typedef struct CurlSocket_ {
+  curl_socket_t fd;
+  GIOChannel* channel;
+  guint watchId; /* Source of g_io_add_watch(), 0 if none */
+  int action; /* Last CURL_POLL_* value requested by libcurl */
+} CurlSocket;
+
+/** Global state. libcurl tells us which sockets to watch and when to call
+    it on timeout; we never scan all fds or all transfers. */
+typedef struct CurlState_ {
   CURLM* multiHandle;
+  GHashTable* sockets; /* fd => CurlSocket, grows as needed */
+  guint timerId; /* Source of pending timeout, 0 if none */
+  int running; /* Number of running easy handles */
+  GlibcurlCallback callback;
+  void* callbackData;
+} CurlState;
+
+/* Global state: Our CurlState object */
+static CurlState* curlState = 0;
+
+static int socketCallback(CURL* easy, curl_socket_t fd, int action,
+                          void* userp, void* socketp);
+static int timerCallback(CURLM* multi, long timeoutMs, void* userp);
+/*______________________________________________________________________*/
 
-  /* Previously seen FDs, for comparing with libcurl's current fd_sets */
-  GPollFD lastPollFd[GLIBCURL_FDMAX + 1];
-  int lastPollFdMax; /* Index of highest non-empty entry in lastPollFd */
-
-  int callPerform; /* Non-zero => curl_multi_perform() gets called */
-
-  /* For data returned by curl_multi_fdset */
-  fd_set fdRead;
-  fd_set fdWrite;
-  fd_set fdExc;
-  int fdMax;
-
-} CurlGSource;
-
-/* Global state: Our CurlGSource object */
-static CurlGSource* curlSrc = 0;
-
-/* The "methods" of CurlGSource */
-static gboolean prepare(GSource* source, gint* timeout);
-static gboolean check(GSource* source);
-static gboolean dispatch(GSource* source, GSourceFunc callback,
-                         gpointer user_data);
-static void finalize(GSource* source);
+/* Every connection needs a descriptor, and so does every file being
+   written. Raise the soft limit on open files as far as we may. */
+void glibcurl_raise_fd_limit() {
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) != 0) return;
+  if (limit.rlim_cur == limit.rlim_max) return;
+  D((stderr, "glibcurl_raise_fd_limit: %lu => %lu\n",
+     (unsigned long)limit.rlim_cur, (unsigned long)limit.rlim_max));
+  limit.rlim_cur = limit.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &limit);
+}
+/*______________________________________________________________________*/
 
-static GSourceFuncs curlFuncs = {
-  &prepare, &check, &dispatch, &finalize, 0, 0
-};
+static void freeSocket(gpointer data) {
+  CurlSocket* sock = (CurlSocket*)data;
+  if (sock->watchId != 0) g_source_remove(sock->watchId);
+  g_io_channel_unref(sock->channel);
+  g_free(sock);
+}
 /*______________________________________________________________________*/
 
 void glibcurl_init() {
-  int fd;
-  /* Create source object for curl file descriptors, and hook it into the
-     default main context. */
-  curlSrc = (CurlGSource*)g_source_new(&curlFuncs, sizeof(CurlGSource));
-  g_source_attach(&curlSrc->source, NULL);
-
-  /* Init rest of our data */
-  memset(&curlSrc->lastPollFd, 0, sizeof(curlSrc->lastPollFd));
-  for (fd = 1; fd <= GLIBCURL_FDMAX; ++fd)
-    curlSrc->lastPollFd[fd].fd = fd;
-  curlSrc->lastPollFdMax = 0;
-  curlSrc->callPerform = 0;
+  curlState = g_new0(CurlState, 1);
+  curlState->sockets = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                             NULL, freeSocket);
 
   /* Init libcurl */
   curl_global_init(CURL_GLOBAL_ALL);
-  curlSrc->multiHandle = curl_multi_init();
+  curlState->multiHandle = curl_multi_init();
+  curl_multi_setopt(curlState->multiHandle, CURLMOPT_SOCKETFUNCTION,
+                    socketCallback);
+  curl_multi_setopt(curlState->multiHandle, CURLMOPT_TIMERFUNCTION,
+                    timerCallback);
 
-  D((stderr, "events: R=%x W=%x X=%x\n", GLIBCURL_READ, GLIBCURL_WRITE,
-     GLIBCURL_EXC));
+  D((stderr, "events: R=%x W=%x\n", GLIBCURL_READ, GLIBCURL_WRITE));
 }
 /*______________________________________________________________________*/
 
 CURLM* glibcurl_handle() {
-  return curlSrc->multiHandle;
+  return curlState->multiHandle;
 }
 /*______________________________________________________________________*/
 
 CURLMcode glibcurl_add(CURL *easy_handle) {
-  assert(curlSrc->multiHandle != 0);
-  curlSrc->callPerform = -1;
-  return curl_multi_add_handle(curlSrc->multiHandle, easy_handle);
+  assert(curlState->multiHandle != 0);
+  glibcurl_start();
+  return curl_multi_add_handle(curlState->multiHandle, easy_handle);
 }
 /*______________________________________________________________________*/
 
 CURLMcode glibcurl_remove(CURL *easy_handle) {
-  assert(curlSrc != 0);
-  assert(curlSrc->multiHandle != 0);
-  return curl_multi_remove_handle(curlSrc->multiHandle, easy_handle);
+  assert(curlState != 0);
+  assert(curlState->multiHandle != 0);
+  return curl_multi_remove_handle(curlState->multiHandle, easy_handle);
+}
+/*______________________________________________________________________*/
+
+unsigned int glibcurl_get_n_sockets() {
+  return g_hash_table_size(curlState->sockets);
+}
+/*______________________________________________________________________*/
+
+/* Called after libcurl has done some work */
+static void afterAction() {
+  if (curlState->callback != 0)
+    (*curlState->callback)(curlState->callbackData);
+}
+/*______________________________________________________________________*/
+
+static gboolean timerEvent(gpointer data) {
+  D((stderr, "timerEvent\n"));
+  /* libcurl may set a new timer from within socket_action() */
+  curlState->timerId = 0;
+  curl_multi_socket_action(curlState->multiHandle, CURL_SOCKET_TIMEOUT, 0,
+                           &curlState->running);
+  afterAction();
+  return FALSE;
 }
 /*______________________________________________________________________*/
 
 /* Call this whenever you have added a request using curl_multi_add_handle().
-   This is necessary to start new requests. It does so by triggering a call
-   to curl_multi_perform() even in the case where no open fds cause that
-   function to be called anyway. */
+   It makes libcurl act on its timeouts during the next iteration of the
+   main loop. */
 void glibcurl_start() {
-  curlSrc->callPerform = -1;
+  if (curlState->timerId == 0)
+    curlState->timerId = g_idle_add(timerEvent, NULL);
 }
 /*______________________________________________________________________*/
 
 void glibcurl_set_callback(GlibcurlCallback function, void* data) {
-  g_source_set_callback(&curlSrc->source, (GSourceFunc)function, data,
-                        NULL);
+  curlState->callback = function;
+  curlState->callbackData = data;
 }
 /*______________________________________________________________________*/
 
 void glibcurl_cleanup() {
   /* You must call curl_multi_remove_handle() and curl_easy_cleanup() for all
      requests before calling this. */
-/*   assert(curlSrc->callPerform == 0); */
+  if (curlState->timerId != 0)
+    g_source_remove(curlState->timerId);
 
-  curl_multi_cleanup(curlSrc->multiHandle);
-  curlSrc->multiHandle = 0;
+  curl_multi_cleanup(curlState->multiHandle);
+  curlState->multiHandle = 0;
   curl_global_cleanup();
 
-/*   g_source_destroy(&curlSrc->source); */
-  g_source_unref(&curlSrc->source);
-  curlSrc = 0;
+  /* Sockets libcurl did not tell us to forget about */
+  g_hash_table_destroy(curlState->sockets);
+  g_free(curlState);
+  curlState = 0;
 }
 /*______________________________________________________________________*/
 
-static void registerUnregisterFds() {
-  int fd, fdMax;
-
-  FD_ZERO(&curlSrc->fdRead);
-  FD_ZERO(&curlSrc->fdWrite);
-  FD_ZERO(&curlSrc->fdExc);
-  curlSrc->fdMax = -1;
-  /* What fds does libcurl want us to poll? */
-  curl_multi_fdset(curlSrc->multiHandle, &curlSrc->fdRead,
-                   &curlSrc->fdWrite, &curlSrc->fdExc, &curlSrc->fdMax);
-  /*fprintf(stderr, "registerUnregisterFds: fdMax=%d\n", curlSrc->fdMax);*/
-  assert(curlSrc->fdMax >= -1 && curlSrc->fdMax <= GLIBCURL_FDMAX);
-
-  fdMax = curlSrc->fdMax;
-  if (fdMax < curlSrc->lastPollFdMax) fdMax = curlSrc->lastPollFdMax;
-
-  /* Has the list of required events for any of the fds changed? */
-  for (fd = 0; fd <= fdMax; ++fd) {
-    gushort events = 0;
-    if (FD_ISSET(fd, &curlSrc->fdRead))  events |= GLIBCURL_READ;
-    if (FD_ISSET(fd, &curlSrc->fdWrite)) events |= GLIBCURL_WRITE;
-    if (FD_ISSET(fd, &curlSrc->fdExc))   events |= GLIBCURL_EXC;
-
-    /* List of events unchanged => no (de)registering */
-    if (events == curlSrc->lastPollFd[fd].events) continue;
-
-    D((stderr, "registerUnregisterFds: fd %d: old events %x, "
-       "new events %x\n", fd, curlSrc->lastPollFd[fd].events, events));
-
-    /* fd is already a lastPollFd, but event type has changed => do nothing.
-       Due to the implementation of g_main_context_query(), the new event
-       flags will be picked up automatically. */
-    if (events != 0 && curlSrc->lastPollFd[fd].events != 0) {
-      curlSrc->lastPollFd[fd].events = events;
-      continue;
-    }
-    curlSrc->lastPollFd[fd].events = events;
-
-    /* Otherwise, (de)register as appropriate */
-    if (events == 0) {
-      g_source_remove_poll(&curlSrc->source, &curlSrc->lastPollFd[fd]);
-      curlSrc->lastPollFd[fd].revents = 0;
-      D((stderr, "unregister fd %d\n", fd));
-    } else {
-      g_source_add_poll(&curlSrc->source, &curlSrc->lastPollFd[fd]);
-      D((stderr, "register fd %d\n", fd));
-    }
-  }
-
-  curlSrc->lastPollFdMax = curlSrc->fdMax;
-}
-
-/* Called before all the file descriptors are polled by the glib main loop.
-   We must have a look at all fds that libcurl wants polled. If any of them
-   are new/no longer needed, we have to (de)register them with glib. */
-gboolean prepare(GSource* source, gint* timeout) {
-  D((stderr, "prepare\n"));
-  assert(source == &curlSrc->source);
-
-  if (curlSrc->multiHandle == 0) return FALSE;
-
-  registerUnregisterFds();
-
-  *timeout = GLIBCURL_TIMEOUT;
-/*   return FALSE; */
-  return curlSrc->callPerform == -1 ? TRUE : FALSE;
+static gboolean socketEvent(GIOChannel* channel, GIOCondition condition,
+                            gpointer data) {
+  CurlSocket* sock = (CurlSocket*)data;
+  int mask = 0;
+
+  if (condition & (G_IO_IN | G_IO_PRI)) mask |= CURL_CSELECT_IN;
+  if (condition & G_IO_OUT)             mask |= CURL_CSELECT_OUT;
+  if (condition & (G_IO_ERR | G_IO_HUP)) mask |= CURL_CSELECT_ERR;
+  D((stderr, "socketEvent: fd %d, mask %x\n", sock->fd, mask));
+
+  /* sock may be freed by socketCallback() during this call; its watch is
+     then already removed and our return value is ignored */
+  curl_multi_socket_action(curlState->multiHandle, sock->fd, mask,
+                           &curlState->running);
+  afterAction();
+  return TRUE;
 }
 /*______________________________________________________________________*/
 
-/* Called after all the file descriptors are polled by glib.
-   g_main_context_check() has copied back the revents fields (set by glib's
-   poll() call) to our GPollFD objects. How inefficient all that copying
-   is... let's add some more and copy the results of these revents into
-   libcurl's fd_sets! */
-gboolean check(GSource* source) {
-  int fd, somethingHappened = 0;
+/* Called by libcurl whenever the set of events it waits for on a socket
+   changes */
+static int socketCallback(CURL* easy, curl_socket_t fd, int action,
+                          void* userp, void* socketp) {
+  CurlSocket* sock = (CurlSocket*)socketp;
+  GIOCondition condition = 0;
 
-  if (curlSrc->multiHandle == 0) return FALSE;
+  D((stderr, "socketCallback: fd %d, action %d\n", fd, action));
 
-  assert(source == &curlSrc->source);
-  FD_ZERO(&curlSrc->fdRead);
-  FD_ZERO(&curlSrc->fdWrite);
-  FD_ZERO(&curlSrc->fdExc);
-  for (fd = 0; fd <= curlSrc->fdMax; ++fd) {
-    gushort revents = curlSrc->lastPollFd[fd].revents;
-    if (revents == 0) continue;
-    somethingHappened = 1;
-/*     D((stderr, "[fd%d] ", fd)); */
-    if (revents & (G_IO_IN | G_IO_PRI))
-      FD_SET((unsigned)fd, &curlSrc->fdRead);
-    if (revents & G_IO_OUT)
-      FD_SET((unsigned)fd, &curlSrc->fdWrite);
-    if (revents & (G_IO_ERR | G_IO_HUP))
-      FD_SET((unsigned)fd, &curlSrc->fdExc);
+  if (action == CURL_POLL_REMOVE) {
+    if (sock != 0) {
+      curl_multi_assign(curlState->multiHandle, fd, 0);
+      g_hash_table_remove(curlState->sockets, GINT_TO_POINTER(fd));
+    }
+    return 0;
   }
-/*   D((stderr, "check: fdMax %d\n", curlSrc->fdMax)); */
 
-/*   return TRUE; */
-/*   return FALSE; */
-  return curlSrc->callPerform == -1 || somethingHappened != 0 ? TRUE : FALSE;
+  if (sock == 0) {
+    sock = g_new0(CurlSocket, 1);
+    sock->fd = fd;
+    sock->channel = g_io_channel_unix_new(fd);
+    curl_multi_assign(curlState->multiHandle, fd, sock);
+    g_hash_table_insert(curlState->sockets, GINT_TO_POINTER(fd), sock);
+  }
+  if (sock->action == action && sock->watchId != 0) return 0;
+
+  if (sock->watchId != 0) g_source_remove(sock->watchId);
+  if (action & CURL_POLL_IN)  condition |= GLIBCURL_READ;
+  if (action & CURL_POLL_OUT) condition |= GLIBCURL_WRITE;
+  sock->watchId = g_io_add_watch(sock->channel, condition, socketEvent, sock);
+  sock->action = action;
+  return 0;
 }
 /*______________________________________________________________________*/
 
-gboolean dispatch(GSource* source, GSourceFunc callback,
-                  gpointer user_data) {
-  CURLMcode x;
-
-  assert(source == &curlSrc->source);
-  assert(curlSrc->multiHandle != 0);
-  do {
-    x = curl_multi_perform(curlSrc->multiHandle, &curlSrc->callPerform);
-/*     D((stderr, "dispatched %d\n", x)); */
-  } while (x == CURLM_CALL_MULTI_PERFORM);
-
-  /* If no more calls to curl_multi_perform(), unregister left-over fds */
-  if (curlSrc->callPerform == 0) registerUnregisterFds();
-
-  if (callback != 0) (*callback)(user_data);
-
-  return TRUE; /* "Do not destroy me" */
+/* Called by libcurl to (re)schedule its single timeout; -1 removes it */
+static int timerCallback(CURLM* multi, long timeoutMs, void* userp) {
+  D((stderr, "timerCallback: %ld ms\n", timeoutMs));
+  if (curlState->timerId != 0) {
+    g_source_remove(curlState->timerId);
+    curlState->timerId = 0;
+  }
+  if (timeoutMs == 0)
+    curlState->timerId = g_idle_add(timerEvent, NULL);
+  else if (timeoutMs > 0)
+    curlState->timerId = g_timeout_add(timeoutMs, timerEvent, NULL);
+  return 0;
 }
 /*______________________________________________________________________*/
+#endif
+/*______________________________________________________________________*/
 
-void finalize(GSource* source) {
-  assert(source == &curlSrc->source);
-  registerUnregisterFds();
-}
-
+void glibcurl_set_multiplex(int enable, long maxHostConnections) {
+  CURLM* multiHandle = glibcurl_handle();
+  assert(multiHandle != 0);
+#if LIBCURL_VERSION_NUM >= 0x072b00
+  curl_multi_setopt(multiHandle, CURLMOPT_PIPELINING,
+                    enable ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x071e00
+  curl_multi_setopt(multiHandle, CURLMOPT_MAX_HOST_CONNECTIONS,
+                    enable ? maxHostConnections : 0L);
 #endif
+}
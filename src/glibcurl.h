@@ -60,12 +60,28 @@ CURLMcode glibcurl_remove(CURL* easy_handle);
     glibcurl_start() only sets a flag to make it happen. */
 void glibcurl_start();
 
+/** Return number of sockets currently watched on behalf of libcurl. Always
+    0 on Win32. */
+unsigned int glibcurl_get_n_sockets();
+
+/** Raise the process' soft limit on open files to the hard limit, so
+    that thousands of connections can be open at once. glibcurl_init()
+    does not do this by itself, as the limit affects the whole program.
+    Does nothing on Win32. */
+void glibcurl_raise_fd_limit();
+
+/** Turn HTTP/2 multiplexing on the global multi handle on or off. With
+    multiplexing, requests to one origin are sent as streams of a single
+    connection. maxHostConnections limits the number of connections to
+    each host, 0 means no limit. */
+void glibcurl_set_multiplex(int enable, long maxHostConnections);
+
 /** Callback function for glibcurl_set_callback */
 typedef void (*GlibcurlCallback)(void*);
-/** Set function to call after each invocation of curl_multi_perform(). Pass
-    function==0 to unregister a previously set callback. The callback
-    function will be called with the supplied data pointer as its first
-    argument. */
+/** Set function to call after each invocation of curl_multi_perform() (or
+    curl_multi_socket_action(), on POSIX systems). Pass function==0 to
+    unregister a previously set callback. The callback function will be
+    called with the supplied data pointer as its first argument. */
 void glibcurl_set_callback(GlibcurlCallback function, void* data);
 
 /** You must call glibcurl_remove() and curl_easy_cleanup() for all requests
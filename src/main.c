@@ -7,6 +7,7 @@
 #include "stm-transfer-window.h"
 #include "stm-panel.h"
 #include "stm-main-window.h"
+#include "glibcurl.h"
 
 #ifdef STM_POSIX
 #  include <sys/types.h>
@@ -57,13 +58,32 @@ fifo_callback (GIOChannel *channel,
 
 	}
 
-	if (strcmp (cmd, "get") == 0) {
+	if (strcmp (cmd, "get") == 0 && arg && *arg) {
+		/* get URL [ALGORITHM=CHECKSUM ...] */
+		gchar **args = g_strsplit_set (arg, " \t", -1);
 		gchar *cwd = g_get_current_dir ();
-		StmTransfer *xfer = stm_transfer_new (arg, cwd);
-		stm_manager_add_transfer (manager, xfer);
-		stm_transfer_start (xfer);
+		StmTransfer *xfer = stm_transfer_new (args[0], cwd);
+		gchar **p;
+		for (p = args + 1; *p; p++) {
+			gchar *sep = strchr (*p, '=');
+			if (sep == NULL)
+				continue;
+			*sep = '\0';
+			if (! stm_transfer_set_expected_digest (xfer, stm_digest_type_from_name (*p), sep + 1))
+				g_printerr ("Ignoring invalid %s checksum '%s'\n", *p, sep + 1);
+		}
+		StmTransfer *same = stm_manager_lookup_file (manager, stm_transfer_get_file (xfer));
+		if (same != NULL
+		    && (stm_transfer_get_state (same) == STM_TRANSFER_STATE_RUNNING
+		        || stm_transfer_get_state (same) == STM_TRANSFER_STATE_QUEUED)) {
+			g_printerr ("Already downloading to %s\n", stm_transfer_get_file (xfer));
+		} else {
+			stm_manager_add_transfer (manager, xfer);
+			stm_transfer_queue (xfer);
+		}
 		g_object_unref (xfer);
 		g_free (cwd);
+		g_strfreev (args);
 	} else if (strcmp (cmd, "show") == 0) {
 		gtk_window_present (GTK_WINDOW (main_window));
 	}
@@ -113,7 +133,10 @@ int main (int argc, char *argv[])
 	if (g_file_test (fifo_file, G_FILE_TEST_EXISTS)) {
 		gchar *msg;
 		if (url) {
-			msg = g_strdup_printf ("get %s\n", url);
+			/* Expected checksums may follow URL as ALGORITHM=CHECKSUM */
+			gchar *args = g_strjoinv (" ", argv + 1);
+			msg = g_strdup_printf ("get %s\n", args);
+			g_free (args);
 		} else {
 			msg = g_strdup ("show\n");
 		}
@@ -135,6 +158,9 @@ int main (int argc, char *argv[])
 #endif
 	gtk_init (&argc, &argv);
 
+	/* Every connection and every file being written takes a descriptor */
+	glibcurl_raise_fd_limit ();
+
 	g_print ("Using state file: %s\n", state_file);
 	
 	StmManager *m = stm_manager_new ();
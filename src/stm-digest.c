@@ -0,0 +1,865 @@
+/*
+ * Simple Transfer Manager
+ * -----------------------
+ *
+ * Copyright (C) 2008 Przemysław Sitek
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef HAVE_CRYPTO
+#  include <openssl/evp.h>
+#endif
+#ifdef HAVE_LIBXXHASH
+#  include <xxhash.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  include <nmmintrin.h>
+#  define STM_DIGEST_HAVE_SSE42
+#endif
+#include "stm-digest.h"
+
+
+/* Size of blocks read back from disk */
+#define STM_DIGEST_READ_SIZE		(1024 * 1024)
+
+static const gchar *type_names[STM_DIGEST_N_TYPES] = {
+	"md5", "sha1", "sha256", "crc32c", "xxh3"
+};
+
+/* Length of hexadecimal representation of each checksum */
+static const guint type_lengths[STM_DIGEST_N_TYPES] = {
+	32, 40, 64, 8, 16
+};
+
+
+/**
+ * StmDigestChunk:
+ *
+ * Copy of received data waiting for a hashing thread, or a range of
+ * file to read back from disk if @data is NULL.
+ */
+typedef struct _StmDigestChunk StmDigestChunk;
+struct _StmDigestChunk
+{
+	guchar		*data;
+	gsize		 len;
+	guint64		 start;		// Range to read back
+	guint64		 end;
+};
+
+
+/**
+ * StmDigest:
+ *
+ * Checksums of a single file, computed in a hashing thread while data
+ * arrives. Data received in order is copied and hashed in the
+ * background; whatever could not be hashed on the fly (out-of-order
+ * segments, data received while too much was already queued) is read
+ * back from disk by stm_digest_finish(). At most one thread works on
+ * a digest at any time, so contexts need no locking of their own.
+ */
+struct _StmDigest
+{
+	gint		 ref_count;
+	StmDigestType	 types;
+
+	/* Owned by the thread currently running the digest */
+#ifdef HAVE_CRYPTO
+	EVP_MD_CTX	*md5;
+	EVP_MD_CTX	*sha1;
+	EVP_MD_CTX	*sha256;
+#endif
+	guint32		 crc32c;
+#ifdef HAVE_LIBXXHASH
+	XXH3_state_t	*xxh3;
+#endif
+
+	/* Main thread only */
+	guint64		 fed;		// Bytes accepted by stm_digest_update()
+	gboolean	 stalled;	// Queue overflowed, rest is read from disk
+	guchar		*chunk;		// Chunk being filled, may be NULL
+	gsize		 chunk_fill;
+	StmDigestFunc	 func;
+	gpointer	 data;
+
+	/* Protected by hashing.mutex */
+	GQueue		*chunks;	// Chunks waiting for a thread
+	gsize		 queued;	// Bytes in chunks
+	gboolean	 running;	// Pushed to the thread pool
+	gboolean	 cancelled;
+	gboolean	 finishing;	// stm_digest_finish() was called
+	gchar		*file;		// File to read ranges back from
+	guint64		 length;	// Total length of the file
+
+	/* Owned by the thread currently running the digest */
+	GError		*error;		// First failure of reading back
+	gchar		*results[STM_DIGEST_N_TYPES];
+};
+
+
+/**
+ * Hashing threads shared by all digests.
+ */
+static struct {
+	GThreadPool	*threads;
+	GMutex		 mutex;
+	guint32		 crc32c_table[256];
+	gboolean	 have_sse42;
+} hashing = { NULL, { NULL }, { 0 }, FALSE };
+
+
+static void stm_digest_run (StmDigest *digest, gpointer data);
+
+
+static void
+stm_digest_init (void)
+{
+	guint32 i, j, crc;
+
+	if (hashing.threads)
+		return;
+
+	/* Reflected CRC-32C (Castagnoli) polynomial */
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+		hashing.crc32c_table[i] = crc;
+	}
+
+#ifdef STM_DIGEST_HAVE_SSE42
+	__builtin_cpu_init ();
+	hashing.have_sse42 = __builtin_cpu_supports ("sse4.2");
+#endif
+
+	hashing.threads = g_thread_pool_new ((GFunc) stm_digest_run, NULL,
+					     STM_DIGEST_THREADS, FALSE, NULL);
+}
+
+
+#ifdef STM_DIGEST_HAVE_SSE42
+__attribute__((target ("sse4.2")))
+static guint32
+stm_digest_crc32c_sse42 (guint32 crc, const guchar *p, gsize len)
+{
+#ifdef __x86_64__
+	guint64 crc64 = crc;
+	guint64 word;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy (&word, p, 8);
+		crc64 = _mm_crc32_u64 (crc64, word);
+	}
+	crc = (guint32) crc64;
+#endif
+	for (; len >= 4; p += 4, len -= 4) {
+		guint32 word32;
+		memcpy (&word32, p, 4);
+		crc = _mm_crc32_u32 (crc, word32);
+	}
+	for (; len > 0; p++, len--)
+		crc = _mm_crc32_u8 (crc, *p);
+	return crc;
+}
+#endif
+
+
+static guint32
+stm_digest_crc32c (guint32 crc, const guchar *p, gsize len)
+{
+#ifdef STM_DIGEST_HAVE_SSE42
+	if (hashing.have_sse42)
+		return stm_digest_crc32c_sse42 (crc, p, len);
+#endif
+	for (; len > 0; p++, len--)
+		crc = hashing.crc32c_table[(crc ^ *p) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+
+/**
+ * stm_digest_get_supported:
+ *
+ * Return: Algorithms this build is able to compute
+ */
+StmDigestType
+stm_digest_get_supported (void)
+{
+	StmDigestType types = STM_DIGEST_CRC32C;
+#ifdef HAVE_CRYPTO
+	types |= STM_DIGEST_MD5 | STM_DIGEST_SHA1 | STM_DIGEST_SHA256;
+#endif
+#ifdef HAVE_LIBXXHASH
+	types |= STM_DIGEST_XXH3;
+#endif
+	return types;
+}
+
+
+static gint
+stm_digest_type_index (StmDigestType type)
+{
+	gint i;
+	for (i = 0; i < STM_DIGEST_N_TYPES; i++)
+		if (type == (1 << i))
+			return i;
+	return -1;
+}
+
+
+/**
+ * stm_digest_type_get_name:
+ * @type: A single algorithm
+ *
+ * Return: Lowercase name of algorithm, like "sha256", or NULL
+ */
+const gchar *
+stm_digest_type_get_name (StmDigestType type)
+{
+	gint i = stm_digest_type_index (type);
+	return i < 0 ? NULL : type_names[i];
+}
+
+
+/**
+ * stm_digest_type_from_name:
+ * @name: Name of algorithm, case insensitive
+ *
+ * Return: Algorithm, or STM_DIGEST_NONE if the name is unknown
+ */
+StmDigestType
+stm_digest_type_from_name (const gchar *name)
+{
+	gint i;
+	for (i = 0; i < STM_DIGEST_N_TYPES; i++)
+		if (g_ascii_strcasecmp (name, type_names[i]) == 0)
+			return 1 << i;
+	return STM_DIGEST_NONE;
+}
+
+
+/**
+ * stm_digest_type_get_length:
+ * @type: A single algorithm
+ *
+ * Return: Number of hexadecimal digits of checksum, or 0
+ */
+guint
+stm_digest_type_get_length (StmDigestType type)
+{
+	gint i = stm_digest_type_index (type);
+	return i < 0 ? 0 : type_lengths[i];
+}
+
+
+/**
+ * stm_digest_type_is_valid:
+ * @type: A single algorithm
+ * @str: A string
+ *
+ * Return: TRUE if @str is a hexadecimal checksum of given type
+ */
+gboolean
+stm_digest_type_is_valid (StmDigestType type, const gchar *str)
+{
+	guint len = stm_digest_type_get_length (type);
+	guint i;
+
+	if (len == 0 || str == NULL || strlen (str) != len)
+		return FALSE;
+	for (i = 0; i < len; i++)
+		if (!g_ascii_isxdigit (str[i]))
+			return FALSE;
+	return TRUE;
+}
+
+
+/**
+ * stm_digest_types_to_string:
+ * @types: Set of algorithms
+ *
+ * Return: Comma separated list of names, like "md5,sha256". Free
+ * with g_free().
+ */
+gchar *
+stm_digest_types_to_string (StmDigestType types)
+{
+	GString *str = g_string_new (NULL);
+	gint i;
+
+	for (i = 0; i < STM_DIGEST_N_TYPES; i++) {
+		if (!(types & (1 << i)))
+			continue;
+		if (str->len)
+			g_string_append_c (str, ',');
+		g_string_append (str, type_names[i]);
+	}
+	return g_string_free (str, FALSE);
+}
+
+
+/**
+ * stm_digest_types_from_string:
+ * @str: Comma separated list of names
+ *
+ * Unknown names are ignored.
+ */
+StmDigestType
+stm_digest_types_from_string (const gchar *str)
+{
+	StmDigestType types = STM_DIGEST_NONE;
+	gchar **names, **p;
+
+	if (str == NULL)
+		return types;
+
+	names = g_strsplit (str, ",", -1);
+	for (p = names; *p; p++)
+		types |= stm_digest_type_from_name (g_strstrip (*p));
+	g_strfreev (names);
+
+	return types;
+}
+
+
+/**
+ * stm_digest_new:
+ * @types: Algorithms to compute
+ *
+ * Algorithms not supported by this build are dropped, see
+ * stm_digest_get_supported().
+ *
+ * Return: New digest with one reference
+ */
+StmDigest *
+stm_digest_new (StmDigestType types)
+{
+	StmDigest *digest;
+
+	stm_digest_init ();
+
+	digest = g_new0 (StmDigest, 1);
+	digest->ref_count = 1;
+	digest->types = types & stm_digest_get_supported ();
+	digest->chunks = g_queue_new ();
+
+#ifdef HAVE_CRYPTO
+	if (digest->types & STM_DIGEST_MD5) {
+		digest->md5 = EVP_MD_CTX_create ();
+		EVP_DigestInit_ex (digest->md5, EVP_md5 (), NULL);
+	}
+	if (digest->types & STM_DIGEST_SHA1) {
+		digest->sha1 = EVP_MD_CTX_create ();
+		EVP_DigestInit_ex (digest->sha1, EVP_sha1 (), NULL);
+	}
+	if (digest->types & STM_DIGEST_SHA256) {
+		digest->sha256 = EVP_MD_CTX_create ();
+		EVP_DigestInit_ex (digest->sha256, EVP_sha256 (), NULL);
+	}
+#endif
+	digest->crc32c = 0xffffffff;
+#ifdef HAVE_LIBXXHASH
+	if (digest->types & STM_DIGEST_XXH3) {
+		digest->xxh3 = XXH3_createState ();
+		XXH3_64bits_reset (digest->xxh3);
+	}
+#endif
+
+	return digest;
+}
+
+
+StmDigest *
+stm_digest_ref (StmDigest *digest)
+{
+	g_atomic_int_inc (&digest->ref_count);
+	return digest;
+}
+
+
+void
+stm_digest_unref (StmDigest *digest)
+{
+	StmDigestChunk *chunk;
+	gint i;
+
+	if (!g_atomic_int_dec_and_test (&digest->ref_count))
+		return;
+
+	while ((chunk = g_queue_pop_head (digest->chunks))) {
+		g_free (chunk->data);
+		g_free (chunk);
+	}
+	g_queue_free (digest->chunks);
+	g_free (digest->chunk);
+
+#ifdef HAVE_CRYPTO
+	if (digest->md5)
+		EVP_MD_CTX_destroy (digest->md5);
+	if (digest->sha1)
+		EVP_MD_CTX_destroy (digest->sha1);
+	if (digest->sha256)
+		EVP_MD_CTX_destroy (digest->sha256);
+#endif
+#ifdef HAVE_LIBXXHASH
+	if (digest->xxh3)
+		XXH3_freeState (digest->xxh3);
+#endif
+
+	for (i = 0; i < STM_DIGEST_N_TYPES; i++)
+		g_free (digest->results[i]);
+	if (digest->error)
+		g_error_free (digest->error);
+	g_free (digest->file);
+	g_free (digest);
+}
+
+
+StmDigestType
+stm_digest_get_types (StmDigest *digest)
+{
+	return digest->types;
+}
+
+
+/* Called from hashing threads */
+static void
+stm_digest_process (StmDigest *digest, const guchar *data, gsize len)
+{
+#ifdef HAVE_CRYPTO
+	if (digest->md5)
+		EVP_DigestUpdate (digest->md5, data, len);
+	if (digest->sha1)
+		EVP_DigestUpdate (digest->sha1, data, len);
+	if (digest->sha256)
+		EVP_DigestUpdate (digest->sha256, data, len);
+#endif
+	if (digest->types & STM_DIGEST_CRC32C)
+		digest->crc32c = stm_digest_crc32c (digest->crc32c, data, len);
+#ifdef HAVE_LIBXXHASH
+	if (digest->xxh3)
+		XXH3_64bits_update (digest->xxh3, data, len);
+#endif
+}
+
+
+static gchar *
+stm_digest_hex (const guchar *bytes, guint len)
+{
+	gchar *str = g_malloc (2 * len + 1);
+	guint i;
+
+	for (i = 0; i < len; i++)
+		snprintf (str + 2*i, 3, "%02x", (int) bytes[i]);
+	return str;
+}
+
+
+#ifdef HAVE_CRYPTO
+static gchar *
+stm_digest_evp_final (EVP_MD_CTX *ctx)
+{
+	guchar md[EVP_MAX_MD_SIZE];
+	unsigned int len = 0;
+
+	EVP_DigestFinal_ex (ctx, md, &len);
+	return stm_digest_hex (md, len);
+}
+#endif
+
+
+/* Called from hashing threads */
+static void
+stm_digest_finalize (StmDigest *digest)
+{
+#ifdef HAVE_CRYPTO
+	if (digest->md5)
+		digest->results[0] = stm_digest_evp_final (digest->md5);
+	if (digest->sha1)
+		digest->results[1] = stm_digest_evp_final (digest->sha1);
+	if (digest->sha256)
+		digest->results[2] = stm_digest_evp_final (digest->sha256);
+#endif
+	if (digest->types & STM_DIGEST_CRC32C)
+		digest->results[3] = g_strdup_printf ("%08x", digest->crc32c ^ 0xffffffff);
+#ifdef HAVE_LIBXXHASH
+	if (digest->xxh3)
+		digest->results[4] = g_strdup_printf ("%016" G_GINT64_MODIFIER "x",
+						      (guint64) XXH3_64bits_digest (digest->xxh3));
+#endif
+}
+
+
+/* Called from hashing threads. Hash part of file that was not fed
+ * while downloading. */
+static gboolean
+stm_digest_read_back (StmDigest *digest, guint64 offset, guint64 length,
+		      GError **error)
+{
+	guchar *buffer;
+	gboolean cancelled = FALSE;
+	ssize_t n;
+	int fd;
+
+	if (offset >= length)
+		return TRUE;
+
+	fd = open (digest->file, O_RDONLY);
+	if (fd < 0) {
+		int saved_errno = errno;
+		g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+			     "Cannot open '%s' for hashing: %s",
+			     digest->file, g_strerror (saved_errno));
+		return FALSE;
+	}
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise (fd, offset, length - offset, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	buffer = g_malloc (STM_DIGEST_READ_SIZE);
+	while (offset < length) {
+		gsize want = MIN (STM_DIGEST_READ_SIZE, length - offset);
+
+		g_mutex_lock (&hashing.mutex);
+		cancelled = digest->cancelled;
+		g_mutex_unlock (&hashing.mutex);
+		if (cancelled)
+			break;
+
+		n = pread (fd, buffer, want, offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			int saved_errno = n < 0 ? errno : EIO;
+			g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+				     "Cannot read '%s' for hashing: %s",
+				     digest->file, n < 0 ? g_strerror (saved_errno) : "File is truncated");
+			break;
+		}
+		stm_digest_process (digest, buffer, n);
+		offset += n;
+	}
+	g_free (buffer);
+	close (fd);
+
+	return offset == length;
+}
+
+
+static gboolean
+stm_digest_dispatch (StmDigest *digest)
+{
+	gboolean cancelled;
+
+	g_mutex_lock (&hashing.mutex);
+	cancelled = digest->cancelled;
+	g_mutex_unlock (&hashing.mutex);
+
+	if (!cancelled && digest->func)
+		digest->func (digest, digest->error, digest->data);
+
+	stm_digest_unref (digest);
+	return FALSE;
+}
+
+
+/* Hashing thread body. Consumes queued chunks, and does the final
+ * read-back once there are no more of them. */
+static void
+stm_digest_run (StmDigest *digest, gpointer data)
+{
+	StmDigestChunk *chunk;
+	guint64 offset, length;
+
+	g_mutex_lock (&hashing.mutex);
+	for (;;) {
+		chunk = g_queue_pop_head (digest->chunks);
+		if (chunk == NULL)
+			break;
+		g_mutex_unlock (&hashing.mutex);
+
+		if (digest->cancelled || digest->error)
+			;
+		else if (chunk->data)
+			stm_digest_process (digest, chunk->data, chunk->len);
+		else
+			stm_digest_read_back (digest, chunk->start, chunk->end,
+					      &digest->error);
+
+		g_mutex_lock (&hashing.mutex);
+		digest->queued -= chunk->len;
+		g_free (chunk->data);
+		g_free (chunk);
+	}
+
+	if (!digest->finishing || digest->cancelled) {
+		digest->running = FALSE;
+		g_mutex_unlock (&hashing.mutex);
+		stm_digest_unref (digest);
+		return;
+	}
+	offset = digest->fed;
+	length = digest->length;
+	g_mutex_unlock (&hashing.mutex);
+
+	if (digest->error == NULL
+	    && stm_digest_read_back (digest, offset, length, &digest->error))
+		stm_digest_finalize (digest);
+
+	g_mutex_lock (&hashing.mutex);
+	digest->running = FALSE;
+	g_mutex_unlock (&hashing.mutex);
+
+	/* Reference is passed to dispatch */
+	g_idle_add ((GSourceFunc) stm_digest_dispatch, digest);
+}
+
+
+/* Called with hashing.mutex held */
+static void
+stm_digest_schedule (StmDigest *digest)
+{
+	if (digest->running)
+		return;
+	digest->running = TRUE;
+	g_thread_pool_push (hashing.threads, stm_digest_ref (digest), NULL);
+}
+
+
+static void
+stm_digest_push_chunk (StmDigest *digest)
+{
+	StmDigestChunk *chunk;
+
+	if (digest->chunk_fill == 0)
+		return;
+
+	chunk = g_new (StmDigestChunk, 1);
+	chunk->data = digest->chunk;
+	chunk->len = digest->chunk_fill;
+	digest->chunk = NULL;
+	digest->chunk_fill = 0;
+
+	g_mutex_lock (&hashing.mutex);
+	g_queue_push_tail (digest->chunks, chunk);
+	digest->queued += chunk->len;
+	if (digest->queued > STM_DIGEST_MAX_QUEUED)
+		digest->stalled = TRUE;
+	stm_digest_schedule (digest);
+	g_mutex_unlock (&hashing.mutex);
+}
+
+
+/**
+ * stm_digest_rehash:
+ * @digest: A digest
+ * @file: Partially downloaded file
+ * @length: Length of data already in @file
+ *
+ * Hash first @length bytes of @file, received in previous sessions,
+ * in a background thread. Must be called before any data is fed with
+ * stm_digest_update(); data following the prefix is queued behind it
+ * and the main loop is never blocked.
+ */
+void
+stm_digest_rehash (StmDigest *digest, const gchar *file, guint64 length)
+{
+	StmDigestChunk *chunk;
+
+	g_return_if_fail (digest->fed == 0 && digest->file == NULL);
+
+	if (length == 0 || digest->types == STM_DIGEST_NONE)
+		return;
+
+	chunk = g_new0 (StmDigestChunk, 1);
+	chunk->start = 0;
+	chunk->end = length;
+	digest->fed = length;
+
+	g_mutex_lock (&hashing.mutex);
+	digest->file = g_strdup (file);
+	g_queue_push_tail (digest->chunks, chunk);
+	stm_digest_schedule (digest);
+	g_mutex_unlock (&hashing.mutex);
+}
+
+
+/**
+ * stm_digest_hash_range:
+ * @types: Algorithms to compute
+ * @file: File to read
+ * @offset: Start of range
+ * @length: Length of range
+ * @func: Function called on completion
+ * @data: User data for @func
+ *
+ * Compute checksums of a range of file in a background thread. See
+ * stm_digest_finish() for details on @func.
+ *
+ * Return: New digest; the caller owns a reference, and may cancel it.
+ */
+StmDigest *
+stm_digest_hash_range (StmDigestType types, const gchar *file,
+		       guint64 offset, guint64 length,
+		       StmDigestFunc func, gpointer data)
+{
+	StmDigest *digest = stm_digest_new (types);
+	StmDigestChunk *chunk;
+
+	chunk = g_new0 (StmDigestChunk, 1);
+	chunk->start = offset;
+	chunk->end = offset + length;
+	digest->fed = offset + length;
+
+	g_mutex_lock (&hashing.mutex);
+	digest->file = g_strdup (file);
+	g_queue_push_tail (digest->chunks, chunk);
+	g_mutex_unlock (&hashing.mutex);
+
+	stm_digest_finish (digest, file, offset + length, func, data);
+	return digest;
+}
+
+
+/**
+ * stm_digest_update:
+ * @digest: A digest
+ * @offset: File offset of @data
+ * @data: Received data
+ * @len: Length of @data
+ *
+ * Offer received data to the digest. Only data continuing what was
+ * already fed is taken; anything else will be read back from disk
+ * when finishing. This function only copies data, hashing happens in
+ * a background thread.
+ */
+void
+stm_digest_update (StmDigest *digest, guint64 offset, const void *data, gsize len)
+{
+	const guchar *p = data;
+
+	if (digest->stalled || digest->finishing || digest->types == STM_DIGEST_NONE)
+		return;
+	if (offset > digest->fed || offset + len <= digest->fed)
+		return;
+
+	/* Skip part that was already fed */
+	p += digest->fed - offset;
+	len -= digest->fed - offset;
+	digest->fed += len;
+
+	while (len > 0) {
+		gsize n;
+
+		if (digest->chunk == NULL)
+			digest->chunk = g_malloc (STM_DIGEST_CHUNK_SIZE);
+
+		n = MIN (len, STM_DIGEST_CHUNK_SIZE - digest->chunk_fill);
+		memcpy (digest->chunk + digest->chunk_fill, p, n);
+		digest->chunk_fill += n;
+		p += n;
+		len -= n;
+
+		if (digest->chunk_fill == STM_DIGEST_CHUNK_SIZE)
+			stm_digest_push_chunk (digest);
+	}
+}
+
+
+/**
+ * stm_digest_finish:
+ * @digest: A digest
+ * @file: File containing the complete data
+ * @length: Length of data
+ * @func: Function called on completion
+ * @data: User data for @func
+ *
+ * Finish computation in a background thread. Part of @file not
+ * received in order is read back from disk. @func is called from
+ * the main loop, with @error set if reading failed; it is not called
+ * if the digest gets cancelled.
+ */
+void
+stm_digest_finish (StmDigest *digest, const gchar *file, guint64 length,
+		   StmDigestFunc func, gpointer data)
+{
+	g_return_if_fail (!digest->finishing);
+
+	stm_digest_push_chunk (digest);
+
+	digest->func = func;
+	digest->data = data;
+
+	g_mutex_lock (&hashing.mutex);
+	digest->finishing = TRUE;
+	if (digest->file == NULL)
+		digest->file = g_strdup (file);
+	digest->length = length;
+	if (digest->fed > length)
+		digest->fed = length;
+	stm_digest_schedule (digest);
+	g_mutex_unlock (&hashing.mutex);
+}
+
+
+/**
+ * stm_digest_cancel:
+ * @digest: A digest
+ *
+ * Stop computation. Pending completion function won't be called.
+ */
+void
+stm_digest_cancel (StmDigest *digest)
+{
+	g_mutex_lock (&hashing.mutex);
+	digest->cancelled = TRUE;
+	g_mutex_unlock (&hashing.mutex);
+	digest->stalled = TRUE;
+}
+
+
+/**
+ * stm_digest_get_result:
+ * @digest: A digest
+ * @type: A single algorithm
+ *
+ * Return: Lowercase hexadecimal checksum, or NULL if it was not
+ * requested or is not computed yet
+ */
+const gchar *
+stm_digest_get_result (StmDigest *digest, StmDigestType type)
+{
+	gint i = stm_digest_type_index (type);
+	gboolean running;
+
+	if (i < 0)
+		return NULL;
+
+	g_mutex_lock (&hashing.mutex);
+	running = digest->running;
+	g_mutex_unlock (&hashing.mutex);
+
+	return running ? NULL : digest->results[i];
+}
@@ -0,0 +1,141 @@
+/*
+ * Simple Transfer Manager
+ * -----------------------
+ *
+ * Copyright (C) 2008 Przemysław Sitek
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __STM_DIGEST_H__
+#define __STM_DIGEST_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Number of hashing threads shared by all digests */
+#define STM_DIGEST_THREADS		2
+
+/* Size of chunks handed over to hashing threads, in bytes */
+#define STM_DIGEST_CHUNK_SIZE		(256 * 1024)
+
+/* Data queued for hashing per digest, beyond which data is read back
+ * from disk at the end instead */
+#define STM_DIGEST_MAX_QUEUED		(32 * 1024 * 1024)
+
+
+/* Number of supported algorithms */
+#define STM_DIGEST_N_TYPES		5
+
+
+/**
+ * StmDigestType:
+ *
+ * Checksum algorithms. Values may be combined to compute several
+ * checksums in one pass.
+ */
+typedef enum {
+	STM_DIGEST_NONE		= 0,
+	STM_DIGEST_MD5		= 1 << 0,
+	STM_DIGEST_SHA1		= 1 << 1,
+	STM_DIGEST_SHA256	= 1 << 2,
+	STM_DIGEST_CRC32C	= 1 << 3,
+	STM_DIGEST_XXH3		= 1 << 4
+} StmDigestType;
+
+#define STM_DIGEST_ALL		(STM_DIGEST_MD5 | STM_DIGEST_SHA1 | STM_DIGEST_SHA256 \
+				 | STM_DIGEST_CRC32C | STM_DIGEST_XXH3)
+
+
+typedef struct _StmDigest			StmDigest;
+
+typedef void (*StmDigestFunc)			(StmDigest *digest,
+						 const GError *error,
+						 gpointer data);
+
+
+StmDigestType
+stm_digest_get_supported			(void);
+
+const gchar *
+stm_digest_type_get_name			(StmDigestType type);
+
+StmDigestType
+stm_digest_type_from_name			(const gchar *name);
+
+guint
+stm_digest_type_get_length			(StmDigestType type);
+
+gboolean
+stm_digest_type_is_valid			(StmDigestType type,
+						 const gchar *str);
+
+gchar *
+stm_digest_types_to_string			(StmDigestType types);
+
+StmDigestType
+stm_digest_types_from_string			(const gchar *str);
+
+
+StmDigest *
+stm_digest_new					(StmDigestType types);
+
+StmDigest *
+stm_digest_hash_range				(StmDigestType types,
+						 const gchar *file,
+						 guint64 offset,
+						 guint64 length,
+						 StmDigestFunc func,
+						 gpointer data);
+
+StmDigest *
+stm_digest_ref					(StmDigest *digest);
+
+void
+stm_digest_unref				(StmDigest *digest);
+
+StmDigestType
+stm_digest_get_types				(StmDigest *digest);
+
+void
+stm_digest_rehash				(StmDigest *digest,
+						 const gchar *file,
+						 guint64 length);
+
+void
+stm_digest_update				(StmDigest *digest,
+						 guint64 offset,
+						 const void *data,
+						 gsize len);
+
+void
+stm_digest_finish				(StmDigest *digest,
+						 const gchar *file,
+						 guint64 length,
+						 StmDigestFunc func,
+						 gpointer data);
+
+void
+stm_digest_cancel				(StmDigest *digest);
+
+const gchar *
+stm_digest_get_result				(StmDigest *digest,
+						 StmDigestType type);
+
+G_END_DECLS
+
+#endif
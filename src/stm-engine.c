@@ -0,0 +1,1099 @@
+/*
+ * Simple Transfer Manager
+ * -----------------------
+ *
+ * Copyright (C) 2008 Przemysław Sitek
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <curl/curl.h>
+#include "glibcurl.h"
+#include "stm-engine.h"
+
+
+/*
+ * Network engine. By default libcurl is driven by glibcurl from the
+ * main loop. With network threads, transfers are spread over shards,
+ * each running its own multi handle and main context in a thread of
+ * its own, so TLS and socket work does not compete with the main
+ * loop; a single thread takes all network I/O out of it. Callbacks
+ * given to stm_engine_add() still run in the main thread: shards
+ * copy received data, headers and progress into events queued for
+ * the main thread, and the main thread sends commands back the same
+ * way.
+ */
+
+
+typedef struct _StmEngineShard		StmEngineShard;
+typedef struct _StmEngineHandle		StmEngineHandle;
+typedef struct _StmEngineEvent		StmEngineEvent;
+typedef struct _StmEngineCommand	StmEngineCommand;
+typedef struct _StmEngineSocket		StmEngineSocket;
+
+
+/* Why a handle has been stopped by its callbacks */
+enum {
+	STM_ENGINE_ABORT_NONE,
+	STM_ENGINE_ABORT_WRITE,
+	STM_ENGINE_ABORT_PROGRESS
+};
+
+
+/**
+ * StmEngineHandle:
+ *
+ * An easy handle added to a shard, with callbacks to run in main
+ * thread. Referenced by main thread, by the shard while it is added
+ * and by every event concerning it.
+ */
+struct _StmEngineHandle
+{
+	gint		 ref_count;
+	CURL		*curl;
+	StmEngineShard	*shard;
+	curl_write_callback write;
+	curl_write_callback header;
+	curl_progress_callback progress;
+	gpointer	 data;
+
+	/* Shared, accessed atomically */
+	gint		 pending;	// Received bytes not yet delivered
+	gint		 stalled;	// Paused by shard until pending drops
+	gint		 aborted;	// Reason callbacks stopped the handle
+
+	/* Shard only */
+	double		 dltotal;	// Last reported progress
+	double		 dlnow;
+
+	/* Main thread only */
+	StmEngineInfo	 info;		// As of last delivered event
+	GQueue		*held;		// Events waiting for handle to be unpaused
+	gboolean	 paused;	// Write callback asked for pause
+	gboolean	 removed;
+	StmEngineReleaseFunc release;	// Called once shard has let go of curl
+	gpointer	 release_data;
+};
+
+
+/**
+ * StmEngineEvent:
+ *
+ * Something that happened to a handle in a shard, to be delivered
+ * in main thread.
+ */
+typedef enum {
+	STM_ENGINE_EVENT_WRITE,
+	STM_ENGINE_EVENT_HEADER,
+	STM_ENGINE_EVENT_PROGRESS,
+	STM_ENGINE_EVENT_DONE,
+	STM_ENGINE_EVENT_REMOVED	// Shard does not use the handle any more
+} StmEngineEventType;
+
+struct _StmEngineEvent
+{
+	StmEngineEventType type;
+	StmEngineHandle	*handle;
+	gchar		*data;		// Copy of received data or header
+	gsize		 len;
+	double		 dltotal;
+	double		 dlnow;
+	CURLcode	 result;
+	StmEngineInfo	 info;		// Read in shard, not for WRITE events
+};
+
+
+/**
+ * StmEngineCommand:
+ *
+ * Request from main thread to a shard.
+ */
+typedef enum {
+	STM_ENGINE_COMMAND_ADD,
+	STM_ENGINE_COMMAND_REMOVE,
+	STM_ENGINE_COMMAND_UNPAUSE,
+	STM_ENGINE_COMMAND_MULTIPLEX
+} StmEngineCommandType;
+
+struct _StmEngineCommand
+{
+	StmEngineCommandType type;
+	StmEngineHandle	*handle;
+};
+
+
+/**
+ * StmEngineSocket:
+ *
+ * A socket libcurl asked a shard to watch.
+ */
+struct _StmEngineSocket
+{
+	curl_socket_t	 fd;
+	GIOChannel	*channel;
+	GSource		*watch;
+	int		 action;	// Last CURL_POLL_* value
+};
+
+
+/**
+ * StmEngineShard:
+ *
+ * A network thread with its own main context and multi handle.
+ */
+struct _StmEngineShard
+{
+	GThread		*thread;
+	GMainContext	*context;
+	GMainLoop	*loop;
+	CURLM		*multi;
+	GHashTable	*sockets;	// fd => StmEngineSocket
+	GSource		*timer;		// Pending libcurl timeout, NULL if none
+	int		 running;
+
+	GAsyncQueue	*commands;	// StmEngineCommand's from main thread
+	gint		 wakeup;	// Commands source is scheduled
+
+	guint		 n_handles;	// Main thread only
+};
+
+
+static struct {
+	gboolean	 initialized;
+	guint		 threads;	// Requested number of network threads
+	guint		 n_threads;	// Threads actually running
+	StmEngineShard	*shards;
+	GHashTable	*handles;	// CURL => StmEngineHandle, main thread only
+	GAsyncQueue	*events;	// StmEngineEvent's for main thread
+	gint		 wakeup;	// Events idle is scheduled
+	StmEngineDoneFunc done_func;
+	gpointer	 done_data;
+	gboolean	 multiplex;
+	glong		 max_host_connections;
+} engine = {
+	FALSE,
+	STM_ENGINE_DEFAULT_THREADS, 0,
+	NULL, NULL, NULL, 0, NULL, NULL, FALSE, 0
+};
+
+
+static StmEngineHandle *
+stm_engine_handle_ref (StmEngineHandle *h)
+{
+	g_atomic_int_inc (&h->ref_count);
+	return h;
+}
+
+
+static void
+stm_engine_handle_unref (StmEngineHandle *h)
+{
+	if (! g_atomic_int_dec_and_test (&h->ref_count))
+		return;
+	g_queue_free (h->held);
+	g_free (h);
+}
+
+
+static void
+stm_engine_event_free (StmEngineEvent *ev)
+{
+	stm_engine_handle_unref (ev->handle);
+	g_free (ev->data);
+	g_free (ev);
+}
+
+
+/*
+ * Main loop backend
+ */
+
+/**
+ * stm_engine_read_info:
+ *
+ * Ask libcurl about response of @curl. Only the thread driving @curl
+ * may do this.
+ */
+static void
+stm_engine_read_info (CURL *curl, StmEngineInfo *info)
+{
+	info->response_code = 0;
+	info->content_length = -1;
+	info->http_version = CURL_HTTP_VERSION_NONE;
+
+	curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &info->response_code);
+	curl_easy_getinfo (curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &info->content_length);
+#if LIBCURL_VERSION_NUM >= 0x073200
+	curl_easy_getinfo (curl, CURLINFO_HTTP_VERSION, &info->http_version);
+#endif
+}
+
+
+/**
+ * stm_engine_glibcurl_callback:
+ *
+ * Called by glibcurl after libcurl has done some work in main loop.
+ */
+static void
+stm_engine_glibcurl_callback (void *data)
+{
+	int msgs;
+	CURLMsg *msg;
+
+	while ((msg = curl_multi_info_read (glibcurl_handle (), &msgs)) != NULL) {
+		if (msg->msg == CURLMSG_DONE && engine.done_func)
+			engine.done_func (msg->easy_handle, msg->data.result, engine.done_data);
+	}
+}
+
+
+#ifdef STM_POSIX
+/*
+ * Shards
+ */
+
+static void
+stm_engine_post (StmEngineEvent *ev);
+
+
+/**
+ * stm_engine_shard_check_messages:
+ *
+ * Report finished handles to main thread.
+ */
+static void
+stm_engine_shard_check_messages (StmEngineShard *shard)
+{
+	int msgs;
+	CURLMsg *msg;
+
+	while ((msg = curl_multi_info_read (shard->multi, &msgs)) != NULL) {
+		if (msg->msg != CURLMSG_DONE)
+			continue;
+
+		StmEngineHandle *h = NULL;
+		curl_easy_getinfo (msg->easy_handle, CURLINFO_PRIVATE, (char **) &h);
+		if (h == NULL)
+			continue;
+
+		StmEngineEvent *ev = g_new0 (StmEngineEvent, 1);
+		ev->type = STM_ENGINE_EVENT_DONE;
+		ev->handle = stm_engine_handle_ref (h);
+		ev->result = msg->data.result;
+		stm_engine_read_info (h->curl, &ev->info);
+		stm_engine_post (ev);
+	}
+}
+
+
+static gboolean
+stm_engine_shard_timeout (StmEngineShard *shard)
+{
+	/* libcurl may set a new timer from within socket_action() */
+	g_source_unref (shard->timer);
+	shard->timer = NULL;
+	curl_multi_socket_action (shard->multi, CURL_SOCKET_TIMEOUT, 0, &shard->running);
+	stm_engine_shard_check_messages (shard);
+	return FALSE;
+}
+
+
+/**
+ * stm_engine_shard_timer:
+ *
+ * Called by libcurl to (re)schedule shard's single timeout.
+ */
+static int
+stm_engine_shard_timer (CURLM *multi, long timeout_ms, StmEngineShard *shard)
+{
+	if (shard->timer) {
+		g_source_destroy (shard->timer);
+		g_source_unref (shard->timer);
+		shard->timer = NULL;
+	}
+
+	if (timeout_ms < 0)
+		return 0;
+
+	shard->timer = timeout_ms == 0 ? g_idle_source_new () : g_timeout_source_new (timeout_ms);
+	g_source_set_callback (shard->timer, (GSourceFunc) stm_engine_shard_timeout, shard, NULL);
+	g_source_attach (shard->timer, shard->context);
+	return 0;
+}
+
+
+static gboolean
+stm_engine_shard_socket_event (GIOChannel *channel, GIOCondition condition,
+                               StmEngineShard *shard)
+{
+	int mask = 0;
+
+	if (condition & (G_IO_IN | G_IO_PRI))
+		mask |= CURL_CSELECT_IN;
+	if (condition & G_IO_OUT)
+		mask |= CURL_CSELECT_OUT;
+	if (condition & (G_IO_ERR | G_IO_HUP))
+		mask |= CURL_CSELECT_ERR;
+
+	/* Socket may be freed during this call, its watch is then
+	 * already destroyed and return value is ignored */
+	curl_multi_socket_action (shard->multi, g_io_channel_unix_get_fd (channel),
+	                          mask, &shard->running);
+	stm_engine_shard_check_messages (shard);
+	return TRUE;
+}
+
+
+static void
+stm_engine_socket_free (StmEngineSocket *sock)
+{
+	if (sock->watch) {
+		g_source_destroy (sock->watch);
+		g_source_unref (sock->watch);
+	}
+	g_io_channel_unref (sock->channel);
+	g_free (sock);
+}
+
+
+/**
+ * stm_engine_shard_socket:
+ *
+ * Called by libcurl whenever events it waits for on a socket change.
+ */
+static int
+stm_engine_shard_socket (CURL *curl, curl_socket_t fd, int action,
+                         StmEngineShard *shard, StmEngineSocket *sock)
+{
+	if (action == CURL_POLL_REMOVE) {
+		if (sock) {
+			curl_multi_assign (shard->multi, fd, NULL);
+			g_hash_table_remove (shard->sockets, GINT_TO_POINTER (fd));
+		}
+		return 0;
+	}
+
+	if (sock == NULL) {
+		sock = g_new0 (StmEngineSocket, 1);
+		sock->fd = fd;
+		sock->channel = g_io_channel_unix_new (fd);
+		curl_multi_assign (shard->multi, fd, sock);
+		g_hash_table_insert (shard->sockets, GINT_TO_POINTER (fd), sock);
+	}
+	if (sock->action == action && sock->watch)
+		return 0;
+
+	if (sock->watch) {
+		g_source_destroy (sock->watch);
+		g_source_unref (sock->watch);
+	}
+
+	GIOCondition condition = 0;
+	if (action & CURL_POLL_IN)
+		condition |= G_IO_IN | G_IO_PRI | G_IO_ERR | G_IO_HUP;
+	if (action & CURL_POLL_OUT)
+		condition |= G_IO_OUT | G_IO_ERR | G_IO_HUP;
+	sock->watch = g_io_create_watch (sock->channel, condition);
+	g_source_set_callback (sock->watch, (GSourceFunc) stm_engine_shard_socket_event,
+	                       shard, NULL);
+	g_source_attach (sock->watch, shard->context);
+	sock->action = action;
+	return 0;
+}
+
+
+/**
+ * stm_engine_shard_write:
+ *
+ * Write callback running in shard. Data is copied for main thread,
+ * unless too much of it is waiting already.
+ */
+static size_t
+stm_engine_shard_write (void *buffer, size_t size, size_t nmemb, StmEngineHandle *h)
+{
+	size_t len = size * nmemb;
+
+	if (g_atomic_int_get (&h->aborted))
+		return 0;
+
+	/* Main thread clears stalled and unpauses us once it has caught
+	 * up; check again after setting it, or the wakeup could be lost */
+	if (g_atomic_int_get (&h->pending) >= STM_ENGINE_MAX_PENDING) {
+		g_atomic_int_set (&h->stalled, 1);
+		if (g_atomic_int_get (&h->pending) >= STM_ENGINE_MAX_PENDING
+		    || ! g_atomic_int_compare_and_exchange (&h->stalled, 1, 0))
+			return CURL_WRITEFUNC_PAUSE;
+	}
+
+	StmEngineEvent *ev = g_new0 (StmEngineEvent, 1);
+	ev->type = STM_ENGINE_EVENT_WRITE;
+	ev->handle = stm_engine_handle_ref (h);
+	ev->data = g_malloc (len);
+	memcpy (ev->data, buffer, len);
+	ev->len = len;
+	g_atomic_int_add (&h->pending, len);
+	stm_engine_post (ev);
+	return len;
+}
+
+
+static size_t
+stm_engine_shard_header (void *buffer, size_t size, size_t nmemb, StmEngineHandle *h)
+{
+	size_t len = size * nmemb;
+
+	if (g_atomic_int_get (&h->aborted))
+		return 0;
+
+	StmEngineEvent *ev = g_new0 (StmEngineEvent, 1);
+	ev->type = STM_ENGINE_EVENT_HEADER;
+	ev->handle = stm_engine_handle_ref (h);
+	ev->data = g_malloc (len);
+	memcpy (ev->data, buffer, len);
+	ev->len = len;
+	stm_engine_read_info (h->curl, &ev->info);
+	stm_engine_post (ev);
+	return len;
+}
+
+
+static int
+stm_engine_shard_progress (StmEngineHandle *h, double dltotal, double dlnow,
+                           double ultotal, double ulnow)
+{
+	if (g_atomic_int_get (&h->aborted))
+		return 1;
+
+	/* libcurl calls this very often, only report changes */
+	if (dltotal == h->dltotal && dlnow == h->dlnow)
+		return 0;
+	h->dltotal = dltotal;
+	h->dlnow = dlnow;
+
+	StmEngineEvent *ev = g_new0 (StmEngineEvent, 1);
+	ev->type = STM_ENGINE_EVENT_PROGRESS;
+	ev->handle = stm_engine_handle_ref (h);
+	ev->dltotal = dltotal;
+	ev->dlnow = dlnow;
+	stm_engine_read_info (h->curl, &ev->info);
+	stm_engine_post (ev);
+	return 0;
+}
+
+
+static void
+stm_engine_shard_set_multiplex (StmEngineShard *shard)
+{
+#if LIBCURL_VERSION_NUM >= 0x072b00
+	curl_multi_setopt (shard->multi, CURLMOPT_PIPELINING,
+	                   engine.multiplex ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x071e00
+	curl_multi_setopt (shard->multi, CURLMOPT_MAX_HOST_CONNECTIONS,
+	                   engine.multiplex ? engine.max_host_connections : 0L);
+#endif
+}
+
+
+/**
+ * stm_engine_shard_run_commands:
+ *
+ * Execute commands queued by main thread, in shard.
+ */
+static gboolean
+stm_engine_shard_run_commands (StmEngineShard *shard)
+{
+	StmEngineCommand *cmd;
+
+	g_atomic_int_set (&shard->wakeup, 0);
+	while ((cmd = g_async_queue_try_pop (shard->commands)) != NULL) {
+		StmEngineHandle *h = cmd->handle;
+
+		switch (cmd->type) {
+		case STM_ENGINE_COMMAND_ADD:
+			curl_multi_add_handle (shard->multi, h->curl);
+			break;
+
+		case STM_ENGINE_COMMAND_REMOVE: {
+			curl_multi_remove_handle (shard->multi, h->curl);
+
+			/* Follows every other event of the handle */
+			StmEngineEvent *ev = g_new0 (StmEngineEvent, 1);
+			ev->type = STM_ENGINE_EVENT_REMOVED;
+			ev->handle = h;		// Shard's reference
+			stm_engine_post (ev);
+		} break;
+
+		case STM_ENGINE_COMMAND_UNPAUSE:
+			curl_easy_pause (h->curl, CURLPAUSE_CONT);
+			break;
+
+		case STM_ENGINE_COMMAND_MULTIPLEX:
+			stm_engine_shard_set_multiplex (shard);
+			break;
+		}
+
+		if (h)
+			stm_engine_handle_unref (h);
+		g_free (cmd);
+	}
+	stm_engine_shard_check_messages (shard);
+	return FALSE;
+}
+
+
+/**
+ * stm_engine_shard_send:
+ *
+ * Queue a command for @shard and wake it up. Handle is referenced by
+ * command until it is executed.
+ */
+static void
+stm_engine_shard_send (StmEngineShard *shard, StmEngineCommandType type,
+                       StmEngineHandle *h)
+{
+	StmEngineCommand *cmd = g_new0 (StmEngineCommand, 1);
+	cmd->type = type;
+	cmd->handle = h ? stm_engine_handle_ref (h) : NULL;
+
+	g_async_queue_push (shard->commands, cmd);
+	if (g_atomic_int_compare_and_exchange (&shard->wakeup, 0, 1)) {
+		GSource *source = g_idle_source_new ();
+		g_source_set_callback (source, (GSourceFunc) stm_engine_shard_run_commands,
+		                       shard, NULL);
+		g_source_attach (source, shard->context);
+		g_source_unref (source);
+	}
+}
+
+
+static gpointer
+stm_engine_shard_thread (StmEngineShard *shard)
+{
+	g_main_loop_run (shard->loop);
+	return NULL;
+}
+
+
+static gboolean
+stm_engine_shard_init (StmEngineShard *shard)
+{
+	shard->context = g_main_context_new ();
+	shard->loop = g_main_loop_new (shard->context, FALSE);
+	shard->sockets = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+	                                        NULL, (GDestroyNotify) stm_engine_socket_free);
+	shard->commands = g_async_queue_new ();
+
+	shard->multi = curl_multi_init ();
+	curl_multi_setopt (shard->multi, CURLMOPT_SOCKETFUNCTION, stm_engine_shard_socket);
+	curl_multi_setopt (shard->multi, CURLMOPT_SOCKETDATA, shard);
+	curl_multi_setopt (shard->multi, CURLMOPT_TIMERFUNCTION, stm_engine_shard_timer);
+	curl_multi_setopt (shard->multi, CURLMOPT_TIMERDATA, shard);
+	stm_engine_shard_set_multiplex (shard);
+
+	GError *error = NULL;
+	shard->thread = g_thread_try_new ("stm-network",
+	                                  (GThreadFunc) stm_engine_shard_thread,
+	                                  shard, &error);
+	if (shard->thread == NULL) {
+		g_printerr ("Cannot start network thread: %s\n", error->message);
+		g_error_free (error);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+
+/*
+ * Delivery of events in main thread
+ */
+
+/**
+ * stm_engine_release:
+ *
+ * Account for @len bytes delivered, and let shard receive more data
+ * if it has been waiting for main thread.
+ */
+static void
+stm_engine_release (StmEngineHandle *h, gsize len)
+{
+	g_atomic_int_add (&h->pending, - (gint) len);
+	if (g_atomic_int_get (&h->pending) < STM_ENGINE_MAX_PENDING / 2
+	    && g_atomic_int_compare_and_exchange (&h->stalled, 1, 0)
+	    && ! h->removed)
+		stm_engine_shard_send (h->shard, STM_ENGINE_COMMAND_UNPAUSE, h);
+}
+
+
+static void
+stm_engine_abort (StmEngineHandle *h, gint reason)
+{
+	g_atomic_int_compare_and_exchange (&h->aborted, STM_ENGINE_ABORT_NONE, reason);
+}
+
+
+/**
+ * stm_engine_deliver:
+ *
+ * Run callback of handle for @ev, like libcurl would.
+ *
+ * Returns: FALSE if write callback paused the handle, so @ev must be
+ * delivered again later.
+ */
+static gboolean
+stm_engine_deliver (StmEngineEvent *ev)
+{
+	StmEngineHandle *h = ev->handle;
+	gint aborted = g_atomic_int_get (&h->aborted);
+
+	/* Callbacks may look at it through stm_engine_get_info() */
+	if (ev->type != STM_ENGINE_EVENT_WRITE)
+		h->info = ev->info;
+
+	switch (ev->type) {
+	case STM_ENGINE_EVENT_WRITE: {
+		if (! aborted) {
+			size_t ret = h->write (ev->data, 1, ev->len, h->data);
+			if (ret == CURL_WRITEFUNC_PAUSE) {
+				h->paused = TRUE;
+				return FALSE;
+			}
+			if (ret != ev->len)
+				stm_engine_abort (h, STM_ENGINE_ABORT_WRITE);
+		}
+		stm_engine_release (h, ev->len);
+	} break;
+
+	case STM_ENGINE_EVENT_HEADER:
+		if (! aborted && h->header (ev->data, 1, ev->len, h->data) != ev->len)
+			stm_engine_abort (h, STM_ENGINE_ABORT_WRITE);
+		break;
+
+	case STM_ENGINE_EVENT_PROGRESS:
+		if (! aborted && h->progress (h->data, ev->dltotal, ev->dlnow, 0, 0) != 0)
+			stm_engine_abort (h, STM_ENGINE_ABORT_PROGRESS);
+		break;
+
+	case STM_ENGINE_EVENT_REMOVED:
+		break;
+
+	case STM_ENGINE_EVENT_DONE: {
+		/* Report same result as if callbacks had run in libcurl */
+		CURLcode result = ev->result;
+		if (aborted == STM_ENGINE_ABORT_WRITE)
+			result = CURLE_WRITE_ERROR;
+		else if (aborted == STM_ENGINE_ABORT_PROGRESS)
+			result = CURLE_ABORTED_BY_CALLBACK;
+		if (engine.done_func)
+			engine.done_func (h->curl, result, engine.done_data);
+	} break;
+	}
+	return TRUE;
+}
+
+
+/**
+ * stm_engine_dispatch:
+ *
+ * Deliver events queued by shards. Events of a paused handle are
+ * held in order until it is unpaused.
+ *
+ * Runs as a low priority idle, and gives up after
+ * STM_ENGINE_DISPATCH_BUDGET so that redraws and user input are not
+ * delayed by a burst of data. Shards keep reading meanwhile; they
+ * don't wake main loop again while this idle is scheduled.
+ */
+static gboolean
+stm_engine_dispatch (gpointer data)
+{
+	StmEngineEvent *ev;
+	gint64 start = g_get_monotonic_time ();
+
+	while ((ev = g_async_queue_try_pop (engine.events)) != NULL) {
+		StmEngineHandle *h = ev->handle;
+
+		if (ev->type == STM_ENGINE_EVENT_REMOVED) {
+			/* Easy handle is free to be reused now */
+			h->release (h->curl, h->release_data);
+			stm_engine_event_free (ev);
+		} else if (h->removed) {
+			stm_engine_event_free (ev);
+		} else if (h->paused || ! g_queue_is_empty (h->held)) {
+			g_queue_push_tail (h->held, ev);
+		} else if (stm_engine_deliver (ev)) {
+			stm_engine_event_free (ev);
+		} else {
+			g_queue_push_head (h->held, ev);
+		}
+
+		if (g_get_monotonic_time () - start > STM_ENGINE_DISPATCH_BUDGET)
+			return TRUE;
+	}
+
+	/* An event posted before the flag is cleared would not wake us */
+	g_atomic_int_set (&engine.wakeup, 0);
+	return g_async_queue_length (engine.events) > 0
+		&& g_atomic_int_compare_and_exchange (&engine.wakeup, 0, 1);
+}
+
+
+/**
+ * stm_engine_post:
+ *
+ * Queue an event for main thread, called in shards. Main loop is only
+ * woken up for first of events posted before it gets to them.
+ */
+static void
+stm_engine_post (StmEngineEvent *ev)
+{
+	g_async_queue_push (engine.events, ev);
+	if (g_atomic_int_compare_and_exchange (&engine.wakeup, 0, 1))
+		g_idle_add (stm_engine_dispatch, NULL);
+}
+#endif /* STM_POSIX */
+
+
+/**
+ * stm_engine_init:
+ *
+ * Start network threads, if any. Called from main thread on first
+ * use of the engine.
+ *
+ * Number of threads set with stm_engine_set_threads() may be
+ * overriden with STM_ENGINE_THREADS environment variable.
+ */
+static void
+stm_engine_init (void)
+{
+	if (engine.initialized)
+		return;
+	engine.initialized = TRUE;
+
+	engine.n_threads = engine.threads;
+	const gchar *env = g_getenv ("STM_ENGINE_THREADS");
+	if (env != NULL) {
+		gchar *end;
+		guint64 threads = g_ascii_strtoull (env, &end, 10);
+		/* strtoull silently negates "-1" */
+		if (*env == '\0' || *end != '\0' || strchr (env, '-') != NULL)
+			g_printerr ("Ignoring invalid STM_ENGINE_THREADS '%s'\n", env);
+		else
+			engine.n_threads = MIN (threads, STM_ENGINE_MAX_THREADS);
+	}
+
+#ifdef STM_POSIX
+	if (engine.n_threads > 0) {
+		engine.handles = g_hash_table_new (g_direct_hash, g_direct_equal);
+		engine.events = g_async_queue_new ();
+		engine.shards = g_new0 (StmEngineShard, engine.n_threads);
+
+		guint i;
+		for (i = 0; i < engine.n_threads; i++) {
+			if (! stm_engine_shard_init (&engine.shards[i]))
+				break;
+		}
+		/* Go on with threads that could be started */
+		engine.n_threads = i;
+	}
+#else
+	if (engine.n_threads > 0)
+		g_printerr ("Network threads are not supported on this platform\n");
+	engine.n_threads = 0;
+#endif
+
+	if (engine.n_threads == 0) {
+		glibcurl_set_callback (stm_engine_glibcurl_callback, NULL);
+		glibcurl_set_multiplex (engine.multiplex, engine.max_host_connections);
+	}
+}
+
+
+/**
+ * stm_engine_set_threads:
+ *
+ * @threads: Number of network threads
+ *
+ * Set how many threads drive network transfers. With 0 threads,
+ * libcurl runs in main loop; with 1, all network work is done by a
+ * single dedicated thread. Threads are started along with first
+ * transfer, later changes take effect after restart.
+ */
+void
+stm_engine_set_threads (guint threads)
+{
+	engine.threads = MIN (threads, STM_ENGINE_MAX_THREADS);
+}
+
+
+/**
+ * stm_engine_get_threads:
+ *
+ * Returns: Requested number of network threads.
+ */
+guint
+stm_engine_get_threads (void)
+{
+	return engine.threads;
+}
+
+
+/**
+ * stm_engine_get_running_threads:
+ *
+ * Number of threads is only known once they are started, so this
+ * starts the engine if it is not running yet.
+ *
+ * Returns: Number of network threads actually running, 0 if libcurl
+ * runs in main loop.
+ */
+guint
+stm_engine_get_running_threads (void)
+{
+	stm_engine_init ();
+	return engine.n_threads;
+}
+
+
+/**
+ * stm_engine_set_done_func:
+ *
+ * @func: Function called in main thread when a handle is finished
+ * @data: Data passed to @func
+ */
+void
+stm_engine_set_done_func (StmEngineDoneFunc func, gpointer data)
+{
+	engine.done_func = func;
+	engine.done_data = data;
+}
+
+
+/**
+ * stm_engine_set_multiplex:
+ *
+ * @multiplex: Whether to multiplex requests over HTTP/2 connections
+ * @max_host_connections: Limit of connections per host while multiplexing
+ *
+ * Apply multiplexing setting to all multi handles.
+ */
+void
+stm_engine_set_multiplex (gboolean multiplex, glong max_host_connections)
+{
+	engine.multiplex = multiplex;
+	engine.max_host_connections = max_host_connections;
+
+	/* Otherwise applied when engine is started */
+	if (! engine.initialized)
+		return;
+
+	if (engine.n_threads == 0) {
+		glibcurl_set_multiplex (multiplex, max_host_connections);
+		return;
+	}
+
+#ifdef STM_POSIX
+	guint i;
+	for (i = 0; i < engine.n_threads; i++)
+		stm_engine_shard_send (&engine.shards[i], STM_ENGINE_COMMAND_MULTIPLEX, NULL);
+#endif
+}
+
+
+/**
+ * stm_engine_add:
+ *
+ * @curl: A CURL easy handle
+ * @write: Write callback
+ * @header: Header callback
+ * @progress: Progress callback
+ * @data: Data passed to callbacks
+ *
+ * Start @curl. Callbacks are called in main thread with the same
+ * meaning as in libcurl, so they must not be set on @curl directly.
+ * Handle goes to the network thread with fewest handles.
+ */
+void
+stm_engine_add (CURL *curl,
+                curl_write_callback write,
+                curl_write_callback header,
+                curl_progress_callback progress,
+                gpointer data)
+{
+	stm_engine_init ();
+
+	if (engine.n_threads == 0) {
+		curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, write);
+		curl_easy_setopt (curl, CURLOPT_WRITEDATA, data);
+		curl_easy_setopt (curl, CURLOPT_HEADERFUNCTION, header);
+		curl_easy_setopt (curl, CURLOPT_HEADERDATA, data);
+		curl_easy_setopt (curl, CURLOPT_PROGRESSFUNCTION, progress);
+		curl_easy_setopt (curl, CURLOPT_PROGRESSDATA, data);
+		glibcurl_add (curl);
+		return;
+	}
+
+#ifdef STM_POSIX
+	StmEngineShard *shard = &engine.shards[0];
+	guint i;
+	for (i = 1; i < engine.n_threads; i++) {
+		if (engine.shards[i].n_handles < shard->n_handles)
+			shard = &engine.shards[i];
+	}
+
+	StmEngineHandle *h = g_new0 (StmEngineHandle, 1);
+	h->ref_count = 2;	// Main thread and shard
+	h->curl = curl;
+	h->shard = shard;
+	h->write = write;
+	h->header = header;
+	h->progress = progress;
+	h->data = data;
+	h->dltotal = -1;
+	h->info.content_length = -1;
+	h->info.http_version = CURL_HTTP_VERSION_NONE;
+	h->held = g_queue_new ();
+
+	curl_easy_setopt (curl, CURLOPT_PRIVATE, h);
+	curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, stm_engine_shard_write);
+	curl_easy_setopt (curl, CURLOPT_WRITEDATA, h);
+	curl_easy_setopt (curl, CURLOPT_HEADERFUNCTION, stm_engine_shard_header);
+	curl_easy_setopt (curl, CURLOPT_HEADERDATA, h);
+	curl_easy_setopt (curl, CURLOPT_PROGRESSFUNCTION, stm_engine_shard_progress);
+	curl_easy_setopt (curl, CURLOPT_PROGRESSDATA, h);
+
+	g_hash_table_insert (engine.handles, curl, h);
+	shard->n_handles++;
+
+	stm_engine_shard_send (shard, STM_ENGINE_COMMAND_ADD, h);
+#endif
+}
+
+
+/**
+ * stm_engine_remove:
+ *
+ * @curl: A CURL easy handle added with stm_engine_add()
+ * @release: Function to call once @curl may be reused or freed
+ * @data: Data passed to @release
+ *
+ * Stop @curl. Callbacks of @curl are not called after this. Main
+ * thread does not wait for the network thread driving @curl, which
+ * may be busy resolving or connecting; @release is called from main
+ * loop once the thread has let go of the handle. With libcurl in
+ * main loop, @release is called before this returns.
+ */
+void
+stm_engine_remove (CURL *curl, StmEngineReleaseFunc release, gpointer data)
+{
+	if (engine.n_threads == 0) {
+		glibcurl_remove (curl);
+		release (curl, data);
+		return;
+	}
+
+#ifdef STM_POSIX
+	StmEngineHandle *h = g_hash_table_lookup (engine.handles, curl);
+	if (h == NULL)
+		return;
+	g_hash_table_remove (engine.handles, curl);
+	h->removed = TRUE;
+	h->release = release;
+	h->release_data = data;
+	h->shard->n_handles--;
+
+	StmEngineEvent *ev;
+	while ((ev = g_queue_pop_head (h->held)) != NULL)
+		stm_engine_event_free (ev);
+
+	stm_engine_shard_send (h->shard, STM_ENGINE_COMMAND_REMOVE, h);
+	stm_engine_handle_unref (h);
+#endif
+}
+
+
+/**
+ * stm_engine_unpause:
+ *
+ * @curl: A CURL easy handle added with stm_engine_add()
+ *
+ * Let handle receive data again after its write callback has
+ * returned CURL_WRITEFUNC_PAUSE. Data held back is delivered
+ * immediately, which may pause handle again.
+ */
+void
+stm_engine_unpause (CURL *curl)
+{
+	if (engine.n_threads == 0) {
+		curl_easy_pause (curl, CURLPAUSE_CONT);
+		return;
+	}
+
+#ifdef STM_POSIX
+	StmEngineHandle *h = g_hash_table_lookup (engine.handles, curl);
+	if (h == NULL)
+		return;
+
+	/* Callbacks may remove handle, keep it alive meanwhile */
+	stm_engine_handle_ref (h);
+	h->paused = FALSE;
+	while (! h->paused && ! h->removed) {
+		StmEngineEvent *ev = g_queue_pop_head (h->held);
+		if (ev == NULL)
+			break;
+		if (stm_engine_deliver (ev))
+			stm_engine_event_free (ev);
+		else
+			g_queue_push_head (h->held, ev);
+	}
+	stm_engine_handle_unref (h);
+#endif
+}
+
+
+/**
+ * stm_engine_get_info:
+ *
+ * @curl: A CURL easy handle added with stm_engine_add()
+ * @info: Filled with facts about response
+ *
+ * Main thread must not ask libcurl about handles a network thread is
+ * driving. Shards read these facts along with headers, progress and
+ * completion, and the main thread sees values as of last event it
+ * delivered for @curl.
+ *
+ * Returns: FALSE if @curl is not known to the engine.
+ */
+gboolean
+stm_engine_get_info (CURL *curl, StmEngineInfo *info)
+{
+	if (engine.n_threads == 0) {
+		stm_engine_read_info (curl, info);
+		return TRUE;
+	}
+
+#ifdef STM_POSIX
+	StmEngineHandle *h = g_hash_table_lookup (engine.handles, curl);
+	if (h != NULL) {
+		*info = h->info;
+		return TRUE;
+	}
+#endif
+	return FALSE;
+}
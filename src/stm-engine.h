@@ -0,0 +1,102 @@
+/*
+ * Simple Transfer Manager
+ * -----------------------
+ *
+ * Copyright (C) 2008 Przemysław Sitek
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#ifndef __STM_ENGINE_H__
+#define __STM_ENGINE_H__
+
+#include <glib.h>
+#include <curl/curl.h>
+
+G_BEGIN_DECLS
+
+/* Default number of network threads, 0 runs libcurl in main loop */
+#define STM_ENGINE_DEFAULT_THREADS	0
+
+/* Largest number of network threads */
+#define STM_ENGINE_MAX_THREADS		64
+
+/* Limit of received data waiting for main thread, per handle, in bytes */
+#define STM_ENGINE_MAX_PENDING		(1024 * 1024)
+
+/* Time main thread may spend delivering events before yielding, in us */
+#define STM_ENGINE_DISPATCH_BUDGET	5000
+
+
+typedef void (*StmEngineDoneFunc)		(CURL *curl,
+						 CURLcode result,
+						 gpointer data);
+
+typedef void (*StmEngineReleaseFunc)		(CURL *curl,
+						 gpointer data);
+
+/**
+ * StmEngineInfo:
+ *
+ * Facts about response of a handle, as known to main thread.
+ */
+typedef struct {
+	long		 response_code;		// 0 until known
+	curl_off_t	 content_length;	// -1 until known
+	long		 http_version;		// CURL_HTTP_VERSION_NONE until known
+} StmEngineInfo;
+
+
+void
+stm_engine_set_threads				(guint threads);
+
+guint
+stm_engine_get_threads				(void);
+
+guint
+stm_engine_get_running_threads			(void);
+
+void
+stm_engine_set_done_func			(StmEngineDoneFunc func,
+						 gpointer data);
+
+void
+stm_engine_set_multiplex			(gboolean multiplex,
+						 glong max_host_connections);
+
+void
+stm_engine_add					(CURL *curl,
+						 curl_write_callback write,
+						 curl_write_callback header,
+						 curl_progress_callback progress,
+						 gpointer data);
+
+void
+stm_engine_remove				(CURL *curl,
+						 StmEngineReleaseFunc release,
+						 gpointer data);
+
+void
+stm_engine_unpause				(CURL *curl);
+
+gboolean
+stm_engine_get_info				(CURL *curl,
+						 StmEngineInfo *info);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,228 @@
+/*
+ * Simple Transfer Manager
+ * -----------------------
+ *
+ * Copyright (C) 2008 Przemysław Sitek
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#include <glib.h>
+#include <curl/curl.h>
+#include "stm-engine.h"
+#include "stm-handle-pool.h"
+
+
+/**
+ * StmHandlePool:
+ *
+ * CURL easy handles shared by all transfers of a manager. Handles are
+ * attached to a common CURLSH object, so DNS lookups, TLS sessions
+ * and open connections are reused across transfers. Released handles
+ * are reset and kept for next requests.
+ *
+ * libcurl does not support sharing connections between handles driven
+ * by different threads at once, so with network threads only DNS and
+ * TLS sessions are shared; each shard keeps its own connection cache
+ * in its multi handle.
+ */
+struct _StmHandlePool
+{
+	gint		 ref_count;
+	CURLSH		*share;		// Created on first use, NULL before
+	GMutex		 locks[CURL_LOCK_DATA_LAST];	// One lock per kind of shared data
+	GQueue		*idle;		// Handles ready for reuse
+	gboolean	 multiplex;	// Prefer HTTP/2 streams over new connections
+};
+
+
+static void
+stm_handle_pool_lock (CURL *curl, curl_lock_data data,
+		      curl_lock_access access, StmHandlePool *pool)
+{
+	g_mutex_lock (&pool->locks[data]);
+}
+
+
+static void
+stm_handle_pool_unlock (CURL *curl, curl_lock_data data, StmHandlePool *pool)
+{
+	g_mutex_unlock (&pool->locks[data]);
+}
+
+
+/**
+ * stm_handle_pool_new:
+ *
+ * Returns: A new #StmHandlePool with one reference.
+ */
+StmHandlePool *
+stm_handle_pool_new (void)
+{
+	StmHandlePool *pool = g_new0 (StmHandlePool, 1);
+	guint i;
+
+	pool->ref_count = 1;
+	for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+		g_mutex_init (&pool->locks[i]);
+	pool->idle = g_queue_new ();
+
+	return pool;
+}
+
+
+/**
+ * stm_handle_pool_init_share:
+ *
+ * Create share of @pool. Done on first use rather than in
+ * stm_handle_pool_new(), as number of network threads is only known
+ * once the engine runs.
+ */
+static void
+stm_handle_pool_init_share (StmHandlePool *pool)
+{
+	pool->share = curl_share_init ();
+	curl_share_setopt (pool->share, CURLSHOPT_LOCKFUNC, stm_handle_pool_lock);
+	curl_share_setopt (pool->share, CURLSHOPT_UNLOCKFUNC, stm_handle_pool_unlock);
+	curl_share_setopt (pool->share, CURLSHOPT_USERDATA, pool);
+	curl_share_setopt (pool->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt (pool->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+	if (stm_engine_get_running_threads () == 0)
+		curl_share_setopt (pool->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+}
+
+
+StmHandlePool *
+stm_handle_pool_ref (StmHandlePool *pool)
+{
+	g_atomic_int_inc (&pool->ref_count);
+	return pool;
+}
+
+
+void
+stm_handle_pool_unref (StmHandlePool *pool)
+{
+	CURL *curl;
+	guint i;
+
+	if (!g_atomic_int_dec_and_test (&pool->ref_count))
+		return;
+
+	/* Share may be cleaned up only once no handle uses it */
+	while ((curl = g_queue_pop_head (pool->idle)))
+		curl_easy_cleanup (curl);
+	g_queue_free (pool->idle);
+
+	if (pool->share && curl_share_cleanup (pool->share) != CURLSHE_OK)
+		g_printerr ("Connection cache is still in use\n");
+
+	for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+		g_mutex_clear (&pool->locks[i]);
+	g_free (pool);
+}
+
+
+/**
+ * stm_handle_pool_get_share:
+ *
+ * Returns: CURLSH object owned by @pool.
+ */
+CURLSH *
+stm_handle_pool_get_share (StmHandlePool *pool)
+{
+	if (pool->share == NULL)
+		stm_handle_pool_init_share (pool);
+	return pool->share;
+}
+
+
+/**
+ * stm_handle_pool_set_multiplex:
+ *
+ * @pool: A #StmHandlePool
+ * @multiplex: Whether to prefer HTTP/2 multiplexing
+ *
+ * Make handles acquired from now on negotiate HTTP/2 and wait for an
+ * existing connection to the same origin rather than open a new one.
+ * Multiplexing itself has to be enabled on the multi handle.
+ */
+void
+stm_handle_pool_set_multiplex (StmHandlePool *pool, gboolean multiplex)
+{
+	pool->multiplex = multiplex;
+}
+
+
+gboolean
+stm_handle_pool_get_multiplex (StmHandlePool *pool)
+{
+	return pool->multiplex;
+}
+
+
+/**
+ * stm_handle_pool_acquire:
+ *
+ * @pool: A #StmHandlePool
+ *
+ * Take an idle handle, or create a new one. The handle is attached to
+ * the share of @pool and has no other options set.
+ *
+ * Returns: A CURL easy handle, give it back with
+ * stm_handle_pool_release().
+ */
+CURL *
+stm_handle_pool_acquire (StmHandlePool *pool)
+{
+	CURL *curl = g_queue_pop_head (pool->idle);
+
+	if (curl == NULL)
+		curl = curl_easy_init ();
+	curl_easy_setopt (curl, CURLOPT_SHARE, stm_handle_pool_get_share (pool));
+	if (pool->multiplex) {
+		curl_easy_setopt (curl, CURLOPT_HTTP_VERSION, (long) CURL_HTTP_VERSION_2TLS);
+#if LIBCURL_VERSION_NUM >= 0x072b00
+		curl_easy_setopt (curl, CURLOPT_PIPEWAIT, 1L);
+#endif
+	}
+	return curl;
+}
+
+
+/**
+ * stm_handle_pool_release:
+ *
+ * @pool: A #StmHandlePool
+ * @curl: A handle obtained with stm_handle_pool_acquire()
+ *
+ * Return a handle which is no longer attached to a multi handle.
+ * Its options are reset, while caches it holds survive.
+ */
+void
+stm_handle_pool_release (StmHandlePool *pool, CURL *curl)
+{
+	if (g_queue_get_length (pool->idle) >= STM_HANDLE_POOL_MAX_IDLE) {
+		curl_easy_cleanup (curl);
+		return;
+	}
+
+	curl_easy_reset (curl);
+	g_queue_push_head (pool->idle, curl);
+}
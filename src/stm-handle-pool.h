@@ -0,0 +1,67 @@
+/*
+ * Simple Transfer Manager
+ * -----------------------
+ *
+ * Copyright (C) 2008 Przemysław Sitek
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#ifndef __STM_HANDLE_POOL_H__
+#define __STM_HANDLE_POOL_H__
+
+#include <glib.h>
+#include <curl/curl.h>
+
+G_BEGIN_DECLS
+
+/* Maximum number of idle handles kept for reuse */
+#define STM_HANDLE_POOL_MAX_IDLE	32
+
+
+typedef struct _StmHandlePool		StmHandlePool;
+
+
+StmHandlePool *
+stm_handle_pool_new				(void);
+
+StmHandlePool *
+stm_handle_pool_ref				(StmHandlePool *pool);
+
+void
+stm_handle_pool_unref				(StmHandlePool *pool);
+
+CURLSH *
+stm_handle_pool_get_share			(StmHandlePool *pool);
+
+void
+stm_handle_pool_set_multiplex			(StmHandlePool *pool,
+						 gboolean multiplex);
+
+gboolean
+stm_handle_pool_get_multiplex			(StmHandlePool *pool);
+
+CURL *
+stm_handle_pool_acquire				(StmHandlePool *pool);
+
+void
+stm_handle_pool_release				(StmHandlePool *pool,
+						 CURL *curl);
+
+G_END_DECLS
+
+#endif
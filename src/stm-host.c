@@ -0,0 +1,321 @@
+/*
+ * Simple Transfer Manager
+ * -----------------------
+ *
+ * Copyright (C) 2008 Przemysław Sitek
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#include <glib.h>
+#include "stm-host.h"
+
+
+/**
+ * StmHost:
+ *
+ * Origin shared by one or more transfers. Counts connections open to
+ * the origin by all of them, so that a limit can be enforced, and
+ * wakes up transfers waiting for a connection once one is closed.
+ */
+struct _StmHost
+{
+	gint		 ref_count;
+	gchar		*origin;	// scheme://host:port
+	guint		 max_connections;	// 0 if unlimited
+	guint		 connections;	// Open connections
+	GList		*waiters;	// StmHostWaiter's, in order of arrival
+	guint		 wake_id;	// ID of idle function waking waiters
+	guint		 active;	// Running transfers
+	guint		 weight;	// Share in weighted scheduling
+	guint		 served;	// When a transfer was last started, 0 if never
+};
+
+
+typedef struct {
+	StmHostFunc	 func;
+	gpointer	 data;
+} StmHostWaiter;
+
+
+/**
+ * stm_host_wake:
+ *
+ * Call waiters in order of arrival, while there is room for them.
+ */
+static gboolean
+stm_host_wake (StmHost *host)
+{
+	host->wake_id = 0;
+
+	stm_host_ref (host);
+	while (host->waiters && stm_host_has_room (host)) {
+		StmHostWaiter *waiter = host->waiters->data;
+		host->waiters = g_list_delete_link (host->waiters, host->waiters);
+		waiter->func (waiter->data);
+		g_free (waiter);
+	}
+	stm_host_unref (host);
+	return FALSE;
+}
+
+
+/**
+ * stm_host_new:
+ *
+ * @origin: Origin of URIs, see stm_uri_get_origin()
+ *
+ * Returns: A new #StmHost with one reference.
+ */
+StmHost *
+stm_host_new (const gchar *origin)
+{
+	StmHost *host = g_new0 (StmHost, 1);
+	host->ref_count = 1;
+	host->origin = g_strdup (origin);
+	host->max_connections = STM_HOST_DEFAULT_MAX_CONNECTIONS;
+	host->weight = STM_HOST_DEFAULT_WEIGHT;
+	return host;
+}
+
+
+StmHost *
+stm_host_ref (StmHost *host)
+{
+	g_atomic_int_inc (&host->ref_count);
+	return host;
+}
+
+
+void
+stm_host_unref (StmHost *host)
+{
+	if (! g_atomic_int_dec_and_test (&host->ref_count))
+		return;
+
+	if (host->wake_id)
+		g_source_remove (host->wake_id);
+	g_list_foreach (host->waiters, (GFunc) g_free, NULL);
+	g_list_free (host->waiters);
+	g_free (host->origin);
+	g_free (host);
+}
+
+
+const gchar *
+stm_host_get_origin (StmHost *host)
+{
+	return host->origin;
+}
+
+
+/**
+ * stm_host_set_max_connections:
+ *
+ * @host: A #StmHost
+ * @max_connections: Limit of open connections, 0 for no limit
+ *
+ * Limit number of connections all transfers may open to @host.
+ * Raising the limit lets waiting transfers go on.
+ */
+void
+stm_host_set_max_connections (StmHost *host, guint max_connections)
+{
+	host->max_connections = max_connections;
+	if (stm_host_has_room (host) && host->waiters && host->wake_id == 0)
+		host->wake_id = g_idle_add ((GSourceFunc) stm_host_wake, host);
+}
+
+
+guint
+stm_host_get_max_connections (StmHost *host)
+{
+	return host->max_connections;
+}
+
+
+/**
+ * stm_host_get_connections:
+ *
+ * Returns: Number of connections currently open to @host.
+ */
+guint
+stm_host_get_connections (StmHost *host)
+{
+	return host->connections;
+}
+
+
+/**
+ * stm_host_has_room:
+ *
+ * Returns: TRUE if another connection may be opened to @host.
+ */
+gboolean
+stm_host_has_room (StmHost *host)
+{
+	return host->max_connections == 0 || host->connections < host->max_connections;
+}
+
+
+void
+stm_host_add_connection (StmHost *host)
+{
+	host->connections++;
+}
+
+
+/**
+ * stm_host_remove_connection:
+ *
+ * @host: A #StmHost
+ *
+ * Account for a closed connection. Waiting transfers are woken up
+ * from an idle handler, as connections are closed from libcurl
+ * callbacks.
+ */
+void
+stm_host_remove_connection (StmHost *host)
+{
+	g_return_if_fail (host->connections > 0);
+
+	host->connections--;
+	if (host->waiters && host->wake_id == 0)
+		host->wake_id = g_idle_add ((GSourceFunc) stm_host_wake, host);
+}
+
+
+/**
+ * stm_host_get_active:
+ *
+ * Returns: Number of transfers currently running from @host.
+ */
+guint
+stm_host_get_active (StmHost *host)
+{
+	return host->active;
+}
+
+
+void
+stm_host_add_active (StmHost *host)
+{
+	host->active++;
+}
+
+
+void
+stm_host_remove_active (StmHost *host)
+{
+	g_return_if_fail (host->active > 0);
+
+	host->active--;
+}
+
+
+/**
+ * stm_host_set_weight:
+ *
+ * @host: A #StmHost
+ * @weight: Share of @host in weighted scheduling, at least 1
+ *
+ * A host with weight 2 is allowed to run twice as many transfers as
+ * a host with weight 1 before the scheduler prefers the latter.
+ */
+void
+stm_host_set_weight (StmHost *host, guint weight)
+{
+	host->weight = MAX (weight, 1);
+}
+
+
+guint
+stm_host_get_weight (StmHost *host)
+{
+	return host->weight;
+}
+
+
+/**
+ * stm_host_set_served:
+ *
+ * @host: A #StmHost
+ * @served: Sequence number of the last transfer started from @host
+ *
+ * Used by the scheduler to serve hosts in round-robin order.
+ */
+void
+stm_host_set_served (StmHost *host, guint served)
+{
+	host->served = served;
+}
+
+
+guint
+stm_host_get_served (StmHost *host)
+{
+	return host->served;
+}
+
+
+/**
+ * stm_host_wait:
+ *
+ * @host: A #StmHost
+ * @func: Function to call when a connection may be available
+ * @data: Data passed to @func, identifies waiter
+ *
+ * Ask to be called back once a connection to @host is closed. A
+ * waiter is called once; it should check stm_host_has_room() and
+ * wait again if needed. Waiting twice with the same @data has no
+ * effect.
+ */
+void
+stm_host_wait (StmHost *host, StmHostFunc func, gpointer data)
+{
+	GList *node;
+	for (node = host->waiters; node; node = node->next) {
+		if (((StmHostWaiter *) node->data)->data == data)
+			return;
+	}
+
+	StmHostWaiter *waiter = g_new (StmHostWaiter, 1);
+	waiter->func = func;
+	waiter->data = data;
+	host->waiters = g_list_append (host->waiters, waiter);
+}
+
+
+/**
+ * stm_host_cancel_wait:
+ *
+ * @host: A #StmHost
+ * @data: Data given to stm_host_wait()
+ */
+void
+stm_host_cancel_wait (StmHost *host, gpointer data)
+{
+	GList *node;
+	for (node = host->waiters; node; node = node->next) {
+		StmHostWaiter *waiter = node->data;
+		if (waiter->data == data) {
+			host->waiters = g_list_delete_link (host->waiters, node);
+			g_free (waiter);
+			return;
+		}
+	}
+}
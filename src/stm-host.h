@@ -0,0 +1,111 @@
+/*
+ * Simple Transfer Manager
+ * -----------------------
+ *
+ * Copyright (C) 2008 Przemysław Sitek
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#ifndef __STM_HOST_H__
+#define __STM_HOST_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Default limit of transfers running at once per host */
+#define STM_HOST_DEFAULT_MAX_ACTIVE		2
+
+/* Default limit of connections open at once per host */
+#define STM_HOST_DEFAULT_MAX_CONNECTIONS	8
+
+/* Default share of a host in weighted scheduling */
+#define STM_HOST_DEFAULT_WEIGHT			1
+
+
+typedef struct _StmHost			StmHost;
+
+typedef void (*StmHostFunc)			(gpointer data);
+
+
+StmHost *
+stm_host_new					(const gchar *origin);
+
+StmHost *
+stm_host_ref					(StmHost *host);
+
+void
+stm_host_unref					(StmHost *host);
+
+const gchar *
+stm_host_get_origin				(StmHost *host);
+
+void
+stm_host_set_max_connections			(StmHost *host,
+						 guint max_connections);
+
+guint
+stm_host_get_max_connections			(StmHost *host);
+
+guint
+stm_host_get_connections			(StmHost *host);
+
+gboolean
+stm_host_has_room				(StmHost *host);
+
+void
+stm_host_add_connection				(StmHost *host);
+
+void
+stm_host_remove_connection			(StmHost *host);
+
+guint
+stm_host_get_active				(StmHost *host);
+
+void
+stm_host_add_active				(StmHost *host);
+
+void
+stm_host_remove_active				(StmHost *host);
+
+void
+stm_host_set_weight				(StmHost *host,
+						 guint weight);
+
+guint
+stm_host_get_weight				(StmHost *host);
+
+void
+stm_host_set_served				(StmHost *host,
+						 guint served);
+
+guint
+stm_host_get_served				(StmHost *host);
+
+void
+stm_host_wait					(StmHost *host,
+						 StmHostFunc func,
+						 gpointer data);
+
+void
+stm_host_cancel_wait				(StmHost *host,
+						 gpointer data);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,372 @@
+/*
+ * Simple Transfer Manager
+ * -----------------------
+ *
+ * Copyright (C) 2008 Przemysław Sitek
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <glib.h>
+#include "stm-limiter.h"
+
+
+/**
+ * StmLimiterClient:
+ *
+ * A party sharing the global bandwidth, usually a transfer. Client
+ * may only receive data while it has tokens in its own bucket (if
+ * it has a speed limit) and credit in global bucket (if there is a
+ * global limit). Either may drop below zero by one chunk, as data
+ * can't be split.
+ */
+struct _StmLimiterClient
+{
+	guint64		 max_speed;	// Own limit in bytes/s, 0 if unlimited
+	guint		 weight;	// Relative share of global limit
+	gdouble		 tokens;	// Own bucket
+	gdouble		 credit;	// Share of global bucket
+	gdouble		 need;		// Credit wanted in current refill
+	gboolean	 active;	// Received data since last refill
+	gboolean	 throttled;	// Has been refused data
+	StmLimiterFunc	 resume_func;	// Called when throttled client may go on
+	gpointer	 resume_data;
+};
+
+
+/**
+ * Global limiter state. Buckets are refilled from a timeout running
+ * only while some client is active or throttled. Global budget of
+ * each refill is split among clients in proportion to their weights;
+ * share of a client that does not need it, because it is slow or
+ * limited on its own, goes to the others in the same refill.
+ */
+static struct {
+	GList		*clients;
+	guint64		 max_speed;	// Global limit in bytes/s, 0 if unlimited
+	guint		 tick_id;	// ID of refill timeout
+	gdouble		 last_tick;	// Time of last refill
+} limiter = { NULL, 0, 0, 0.0 };
+
+
+/**
+ * stm_limiter_now:
+ *
+ * Returns: Current time in seconds.
+ */
+static gdouble
+stm_limiter_now (void)
+{
+	return g_get_monotonic_time () / 1e6;
+}
+
+
+/**
+ * stm_limiter_share:
+ *
+ * Distribute @budget bytes of global bucket among clients which
+ * need it, by weight. Amount a client can use is limited by its own
+ * speed limit and, unless it has been throttled, by room left in
+ * its share of global burst.
+ */
+static void
+stm_limiter_share (gdouble budget, gdouble dt)
+{
+	GList *wanting = NULL;
+	guint total_weight = 0;
+
+	GList *node;
+	for (node = limiter.clients; node; node = node->next) {
+		StmLimiterClient *client = node->data;
+		if (client->active || client->throttled) {
+			wanting = g_list_prepend (wanting, client);
+			total_weight += client->weight;
+		} else {
+			/* Idle clients don't hoard credit */
+			client->credit = MIN (client->credit, 0.0);
+		}
+	}
+
+	for (node = wanting; node; node = node->next) {
+		StmLimiterClient *client = node->data;
+		gdouble need = G_MAXDOUBLE;
+		if (client->max_speed)
+			need = client->max_speed * dt - client->credit;
+		if (! client->throttled)
+			need = MIN (need, limiter.max_speed * STM_LIMITER_BURST
+			                  * client->weight / total_weight - client->credit);
+		client->need = MAX (need, 0.0);
+	}
+
+	/* Satisfy clients needing less than their fair share, then
+	 * split the rest among the others */
+	while (wanting != NULL && budget >= 1.0) {
+		gboolean satisfied = FALSE;
+		gdouble left = budget;
+
+		for (node = wanting; node; ) {
+			StmLimiterClient *client = node->data;
+			GList *next = node->next;
+
+			if (client->need <= budget * client->weight / total_weight) {
+				client->credit += client->need;
+				left -= client->need;
+				total_weight -= client->weight;
+				wanting = g_list_delete_link (wanting, node);
+				satisfied = TRUE;
+			}
+			node = next;
+		}
+
+		if (! satisfied) {
+			for (node = wanting; node; node = node->next) {
+				StmLimiterClient *client = node->data;
+				client->credit += budget * client->weight / total_weight;
+			}
+			break;
+		}
+		budget = left;
+	}
+	g_list_free (wanting);
+}
+
+
+/**
+ * stm_limiter_tick:
+ *
+ * Timeout callback refilling buckets and resuming throttled clients.
+ */
+static gboolean
+stm_limiter_tick (gpointer data)
+{
+	gdouble now = stm_limiter_now ();
+	gdouble dt = CLAMP (now - limiter.last_tick, 0.0, 1.0);
+	limiter.last_tick = now;
+
+	GList *node;
+	for (node = limiter.clients; node; node = node->next) {
+		StmLimiterClient *client = node->data;
+		if (client->max_speed)
+			client->tokens = MIN (client->tokens + client->max_speed * dt,
+			                      client->max_speed * STM_LIMITER_BURST);
+	}
+	if (limiter.max_speed)
+		stm_limiter_share (limiter.max_speed * dt, dt);
+
+	/* Resuming may throttle clients again, or free them */
+	gboolean busy = FALSE;
+	GList *resumed = NULL;
+	for (node = limiter.clients; node; node = node->next) {
+		StmLimiterClient *client = node->data;
+		busy |= client->active || client->throttled;
+		client->active = FALSE;
+
+		if (client->throttled
+		    && (client->max_speed == 0 || client->tokens > 0)
+		    && (limiter.max_speed == 0 || client->credit > 0)) {
+			client->throttled = FALSE;
+			resumed = g_list_prepend (resumed, client);
+		}
+	}
+	for (node = resumed; node; node = node->next) {
+		StmLimiterClient *client = node->data;
+		client->resume_func (client->resume_data);
+	}
+	g_list_free (resumed);
+
+	if (! busy)
+		limiter.tick_id = 0;
+	return busy;
+}
+
+
+/**
+ * stm_limiter_arm:
+ *
+ * Make sure refill timeout is running.
+ */
+static void
+stm_limiter_arm (void)
+{
+	if (limiter.tick_id != 0)
+		return;
+
+	limiter.last_tick = stm_limiter_now ();
+	limiter.tick_id = g_timeout_add (STM_LIMITER_TICK, stm_limiter_tick, NULL);
+}
+
+
+/**
+ * stm_limiter_set_max_speed:
+ *
+ * @speed: Limit in bytes per second, 0 for no limit
+ *
+ * Set limit of combined download speed of all clients.
+ */
+void
+stm_limiter_set_max_speed (guint64 speed)
+{
+	limiter.max_speed = speed;
+
+	/* Let everybody go on, buckets will sort it out */
+	GList *node;
+	for (node = limiter.clients; node; node = node->next) {
+		StmLimiterClient *client = node->data;
+		client->credit = 0.0;
+		if (client->throttled)
+			stm_limiter_arm ();
+	}
+}
+
+
+/**
+ * stm_limiter_get_max_speed:
+ *
+ * Returns: Global speed limit in bytes per second, 0 if unlimited.
+ */
+guint64
+stm_limiter_get_max_speed (void)
+{
+	return limiter.max_speed;
+}
+
+
+/**
+ * stm_limiter_client_new:
+ *
+ * @resume_func: Function called when client may receive data again
+ * @data: Data passed to @resume_func
+ *
+ * Returns: A new #StmLimiterClient. Free with
+ * stm_limiter_client_free().
+ */
+StmLimiterClient *
+stm_limiter_client_new (StmLimiterFunc resume_func, gpointer data)
+{
+	StmLimiterClient *client = g_new0 (StmLimiterClient, 1);
+	client->weight = STM_LIMITER_DEFAULT_WEIGHT;
+	client->resume_func = resume_func;
+	client->resume_data = data;
+
+	limiter.clients = g_list_prepend (limiter.clients, client);
+	return client;
+}
+
+
+/**
+ * stm_limiter_client_free:
+ *
+ * @client: A #StmLimiterClient
+ */
+void
+stm_limiter_client_free (StmLimiterClient *client)
+{
+	limiter.clients = g_list_remove (limiter.clients, client);
+	g_free (client);
+}
+
+
+/**
+ * stm_limiter_client_set_max_speed:
+ *
+ * @client: A #StmLimiterClient
+ * @speed: Limit in bytes per second, 0 for no limit
+ */
+void
+stm_limiter_client_set_max_speed (StmLimiterClient *client, guint64 speed)
+{
+	client->max_speed = speed;
+	client->tokens = 0.0;
+	if (client->throttled)
+		stm_limiter_arm ();
+}
+
+
+/**
+ * stm_limiter_client_get_max_speed:
+ *
+ * @client: A #StmLimiterClient
+ *
+ * Returns: Limit in bytes per second, 0 if unlimited.
+ */
+guint64
+stm_limiter_client_get_max_speed (StmLimiterClient *client)
+{
+	return client->max_speed;
+}
+
+
+/**
+ * stm_limiter_client_set_weight:
+ *
+ * @client: A #StmLimiterClient
+ * @weight: Relative share of global limit
+ *
+ * Clients share global limit in proportion to their weights.
+ */
+void
+stm_limiter_client_set_weight (StmLimiterClient *client, guint weight)
+{
+	client->weight = MAX (weight, 1);
+}
+
+
+/**
+ * stm_limiter_client_get_weight:
+ *
+ * @client: A #StmLimiterClient
+ *
+ * Returns: Weight of client.
+ */
+guint
+stm_limiter_client_get_weight (StmLimiterClient *client)
+{
+	return client->weight;
+}
+
+
+/**
+ * stm_limiter_client_consume:
+ *
+ * @client: A #StmLimiterClient
+ * @bytes: Amount of data received
+ *
+ * Ask for permission to accept data. If it is refused, client should
+ * stop receiving until its resume function is called.
+ *
+ * Returns: TRUE if data may be accepted.
+ */
+gboolean
+stm_limiter_client_consume (StmLimiterClient *client, gsize bytes)
+{
+	if (limiter.max_speed == 0 && client->max_speed == 0)
+		return TRUE;
+
+	stm_limiter_arm ();
+	client->active = TRUE;
+
+	if ((client->max_speed && client->tokens <= 0)
+	    || (limiter.max_speed && client->credit <= 0)) {
+		client->throttled = TRUE;
+		return FALSE;
+	}
+
+	if (client->max_speed)
+		client->tokens -= bytes;
+	if (limiter.max_speed)
+		client->credit -= bytes;
+	return TRUE;
+}
@@ -0,0 +1,79 @@
+/*
+ * Simple Transfer Manager
+ * -----------------------
+ *
+ * Copyright (C) 2008 Przemysław Sitek
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __STM_LIMITER_H__
+#define __STM_LIMITER_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Interval between bucket refills, in milliseconds */
+#define STM_LIMITER_TICK		50
+
+/* Amount of data a bucket can hold, in seconds of its rate */
+#define STM_LIMITER_BURST		0.25
+
+/* Default weight of a client */
+#define STM_LIMITER_DEFAULT_WEIGHT	10
+
+
+typedef struct _StmLimiterClient		StmLimiterClient;
+
+typedef void (*StmLimiterFunc)			(gpointer data);
+
+
+void
+stm_limiter_set_max_speed			(guint64 speed);
+
+guint64
+stm_limiter_get_max_speed			(void);
+
+
+StmLimiterClient *
+stm_limiter_client_new				(StmLimiterFunc resume_func,
+						 gpointer data);
+
+void
+stm_limiter_client_free				(StmLimiterClient *client);
+
+void
+stm_limiter_client_set_max_speed		(StmLimiterClient *client,
+						 guint64 speed);
+
+guint64
+stm_limiter_client_get_max_speed		(StmLimiterClient *client);
+
+void
+stm_limiter_client_set_weight			(StmLimiterClient *client,
+						 guint weight);
+
+guint
+stm_limiter_client_get_weight			(StmLimiterClient *client);
+
+gboolean
+stm_limiter_client_consume			(StmLimiterClient *client,
+						 gsize bytes);
+
+G_END_DECLS
+
+#endif
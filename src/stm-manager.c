@@ -22,96 +22,938 @@
 
 #include <gtk/gtk.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "stm-manager.h"
+#include "stm-engine.h"
+#include "stm-handle-pool.h"
+#include "stm-limiter.h"
+#include "stm-progress-scheduler.h"
 #include "stm-private-api.h"
 #include "glibcurl.h"
 
 
-G_DEFINE_TYPE (StmManager, stm_manager, G_TYPE_OBJECT)
+static void
+stm_manager_tree_model_init (GtkTreeModelIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (StmManager, stm_manager, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (GTK_TYPE_TREE_MODEL,
+                                                stm_manager_tree_model_init))
+
+
+/**
+ * StmManagerRow:
+ *
+ * Record of a transfer in manager's collection, also a row of tree
+ * model. Rows are allocated separately, so that iterators pointing
+ * at them stay valid while other rows come and go.
+ */
+typedef struct _StmManagerRow StmManagerRow;
+
+struct _StmManagerRow {
+	StmTransfer	*transfer;
+	GSequenceIter	*iter;		// Place in row sequence
+	guint		 id;		// Never reused while manager lives
+	StmManagerRow	*uri_next;	// Older row with the same URI
+	StmManagerRow	*file_next;	// Older row with the same file
+};
 
 struct _StmManagerPrivate
 {
 	/* Private members go here */
-	GList		*transfers;		/* list of transfers */
-	GtkTreeModel	*model;			/* Tree model singleton */
+	StmRateEstimator *rate;			/* Rate of all transfers */
+	StmHandlePool	*handles;		/* Connections shared by transfers */
+	GSequence	*row_seq;		/* StmManagerRow's, in order of adding */
+	GHashTable	*rows;			/* StmTransfer -> StmManagerRow */
+	GHashTable	*ids;			/* ID -> StmManagerRow */
+	GHashTable	*uris;			/* URI -> newest StmManagerRow */
+	GHashTable	*files;			/* File path -> newest StmManagerRow */
+	guint		 next_id;		/* ID of next added transfer */
+	gint		 stamp;			/* Stamp of valid tree iterators */
+
+	GQueue		*queued;		/* Queued transfers, in order of queueing */
+	guint		 max_active;		/* Limit of running transfers, 0 for none */
+	StmManagerPolicy policy;		/* Order of starting queued transfers */
+	guint		 schedule_id;		/* ID of idle function starting transfers */
+
+	GHashTable	*hosts;			/* Origin -> StmHost */
+	GHashTable	*transfer_hosts;	/* StmTransfer -> StmHost */
+	GHashTable	*running;		/* Running transfers, counted by their hosts */
+	guint		 host_max_active;	/* Limit of running transfers per host, 0 for none */
+	guint		 host_max_connections;	/* Limit of connections per host, 0 for none */
+	StmManagerHostPolicy host_policy;	/* Order of serving hosts */
+	guint		 served;		/* Number of transfers started by scheduler */
+	guint		 hosts_changed_id;	/* ID of idle function emitting hosts-changed */
 
 	gchar		*state_file;		/* State file */
-	guint		 state_file_id;		/* ID of idle function writing state file */
+	guint		 state_file_id;		/* ID of timeout writing state file */
+
+	gboolean disposed;
+};
+
+
+#define STM_MANAGER_GET_PRIVATE(obj) \
+	(G_TYPE_INSTANCE_GET_PRIVATE ((obj), \
+	STM_TYPE_MANAGER, StmManagerPrivate))
+
+
+/* Signals */
+enum {
+	TRANSFER_ADDED,
+	TRANSFER_REMOVED,
+	HOSTS_CHANGED,
+	
+	LAST_SIGNAL
+};
+
+static guint signals[LAST_SIGNAL];
+
+static void
+stm_manager_schedule_save (StmManager *self);
+
+static void
+stm_manager_schedule (StmManager *self);
+
+static void
+stm_manager_transfer_state_changed (StmTransfer *transfer, StmManager *self);
+
+static StmHost *
+stm_manager_get_host (StmManager *self, const gchar *origin);
+
+static void
+stm_manager_update_running (StmManager *self, StmTransfer *transfer);
+
+static void
+stm_manager_hosts_changed (StmManager *self);
+
+static void
+stm_manager_append_row (StmManager *self, StmTransfer *transfer);
+
+static void
+stm_manager_remove_row (StmManager *self, StmTransfer *transfer);
+
+static void
+stm_manager_tm_flush (StmProgressScheduler *scheduler, GPtrArray *transfers,
+                      StmManager *self);
+
+static void
+stm_manager_state_flush (StmProgressScheduler *scheduler, GPtrArray *transfers,
+                         StmManager *self);
+
+StmManager*
+stm_manager_new (void)
+{
+	StmManager *self = g_object_new (STM_TYPE_MANAGER, NULL);
+	return self;
+}
+
+
+/**
+ * stm_manager_add_transfer:
+ * 
+ * @self A #StmManager
+ * @transfer A #StmTransfer
+ * 
+ * Add a transfer to manager.
+ */
+void
+stm_manager_add_transfer (StmManager *self, StmTransfer *transfer)
+{
+	StmManagerPrivate *priv = self->priv;
+
+	if (g_hash_table_lookup (priv->rows, transfer) != NULL) {
+		g_printerr ("Attempting to add transfer which is already added!");
+		return;
+	}
+
+	g_object_ref (transfer);
+	stm_rate_estimator_set_parent (stm_transfer_get_rate_estimator (transfer),
+	                               priv->rate);
+	_stm_transfer_set_handle_pool (transfer, priv->handles);
+//	stm_transfer_start (transfer);
+
+	gchar *origin = stm_uri_get_origin (stm_transfer_get_uri (transfer));
+	StmHost *host = stm_manager_get_host (self, origin ? origin : "");
+	g_free (origin);
+	g_hash_table_insert (priv->transfer_hosts, transfer, host);
+	_stm_transfer_set_host (transfer, host);
+	stm_manager_update_running (self, transfer);
+
+	g_signal_connect (transfer, "state-changed",
+	                  G_CALLBACK (stm_manager_transfer_state_changed), self);
+	g_signal_connect_swapped (transfer, "notify::priority",
+	                          G_CALLBACK (stm_manager_schedule), self);
+	if (stm_transfer_get_state (transfer) == STM_TRANSFER_STATE_QUEUED) {
+		g_queue_push_tail (priv->queued, transfer);
+		stm_manager_schedule (self);
+	}
+
+	stm_manager_append_row (self, transfer);
+	g_signal_emit (self, signals[TRANSFER_ADDED], 0, transfer);
+	stm_manager_schedule_save (self);
+}
+
+
+/**
+ * stm_manager_remove_transfer:
+ * 
+ * @self: A #StmManager
+ * @transfer: A #StmTransfer
+ * 
+ * Remove transfer form manager.
+ */
+void
+stm_manager_remove_transfer (StmManager *self, StmTransfer *transfer)
+{
+	StmManagerPrivate *priv = self->priv;
+
+//	glibcurl_remove (_stm_transfer_get_handle (transfer));
+	if (g_hash_table_lookup (priv->rows, transfer) != NULL) {
+		g_signal_handlers_disconnect_matched (transfer, G_SIGNAL_MATCH_DATA,
+		                                      0, 0, NULL, NULL, self);
+		g_queue_remove (priv->queued, transfer);
+		if (g_hash_table_remove (priv->running, transfer)) {
+			stm_host_remove_active (g_hash_table_lookup (priv->transfer_hosts, transfer));
+			stm_manager_hosts_changed (self);
+			stm_manager_schedule (self);
+		}
+		g_hash_table_remove (priv->transfer_hosts, transfer);
+		_stm_transfer_set_host (transfer, NULL);
+		stm_rate_estimator_set_parent (stm_transfer_get_rate_estimator (transfer), NULL);
+		stm_manager_remove_row (self, transfer);
+		g_signal_emit (self, signals[TRANSFER_REMOVED], 0, transfer);
+		g_object_unref (transfer);
+		stm_manager_schedule_save (self);
+//		g_print ("Removing transfer, left %u references\n", G_OBJECT (transfer)->ref_count);
+	} else {
+		g_printerr ("Attempting to remove transfer which is not added!");
+	}
+}
+
+
+/*
+ * Collection
+ */
+
+/**
+ * stm_manager_index_row:
+ *
+ * Make @row found by ID, URI and file of its transfer.
+ */
+static void
+stm_manager_index_row (StmManager *self, StmManagerRow *row)
+{
+	StmManagerPrivate *priv = self->priv;
+
+	const gchar *uri = stm_transfer_get_uri (row->transfer);
+	const gchar *file = stm_transfer_get_file (row->transfer);
+
+	g_hash_table_insert (priv->rows, row->transfer, row);
+	g_hash_table_insert (priv->ids, GUINT_TO_POINTER (row->id), row);
+	/* Keys are owned by transfer of the first row in chain */
+	if (uri) {
+		row->uri_next = g_hash_table_lookup (priv->uris, uri);
+		g_hash_table_replace (priv->uris, (gpointer) uri, row);
+	}
+	if (file) {
+		row->file_next = g_hash_table_lookup (priv->files, file);
+		g_hash_table_replace (priv->files, (gpointer) file, row);
+	}
+}
+
+
+typedef const gchar *(*StmManagerKeyFunc) (StmTransfer *transfer);
+
+/**
+ * stm_manager_unindex_chain:
+ *
+ * @index: Hash table of chains
+ * @row: Row to unlink
+ * @next_offset: Offset of link to the next row in chain
+ * @key_func: Function giving key of a transfer
+ *
+ * Unlink @row from chain of rows sharing a key in @index. Chains are
+ * as long as number of duplicates, usually one.
+ */
+static void
+stm_manager_unindex_chain (GHashTable *index, StmManagerRow *row,
+                           gsize next_offset, StmManagerKeyFunc key_func)
+{
+	const gchar *key = key_func (row->transfer);
+	if (key == NULL)
+		return;
+
+	StmManagerRow **next = &G_STRUCT_MEMBER (StmManagerRow *, row, next_offset);
+	StmManagerRow *head = g_hash_table_lookup (index, key);
+	if (head == row) {
+		/* Key of removed row is going away with it */
+		g_hash_table_remove (index, key);
+		if (*next)
+			g_hash_table_insert (index, (gpointer) key_func ((*next)->transfer), *next);
+		return;
+	}
+	for (; head; head = G_STRUCT_MEMBER (StmManagerRow *, head, next_offset)) {
+		StmManagerRow **link = &G_STRUCT_MEMBER (StmManagerRow *, head, next_offset);
+		if (*link == row) {
+			*link = *next;
+			break;
+		}
+	}
+}
+
+
+static void
+stm_manager_unindex_row (StmManager *self, StmManagerRow *row)
+{
+	StmManagerPrivate *priv = self->priv;
+
+	stm_manager_unindex_chain (priv->uris, row, G_STRUCT_OFFSET (StmManagerRow, uri_next),
+	                           stm_transfer_get_uri);
+	stm_manager_unindex_chain (priv->files, row, G_STRUCT_OFFSET (StmManagerRow, file_next),
+	                           stm_transfer_get_file);
+	g_hash_table_remove (priv->ids, GUINT_TO_POINTER (row->id));
+	g_hash_table_remove (priv->rows, row->transfer);
+}
+
+
+/**
+ * stm_manager_get_n_transfers:
+ *
+ * @self: A #StmManager
+ *
+ * Returns: Number of transfers in @self.
+ */
+guint
+stm_manager_get_n_transfers (StmManager *self)
+{
+	return g_sequence_get_length (self->priv->row_seq);
+}
+
+
+/**
+ * stm_manager_get_nth_transfer:
+ *
+ * @self: A #StmManager
+ * @n: Position of transfer, in order of adding
+ *
+ * Returns: A #StmTransfer owned by @self, or NULL if @n is out of range.
+ */
+StmTransfer *
+stm_manager_get_nth_transfer (StmManager *self, guint n)
+{
+	StmManagerPrivate *priv = self->priv;
+
+	if (n >= (guint) g_sequence_get_length (priv->row_seq))
+		return NULL;
+
+	StmManagerRow *row = g_sequence_get (g_sequence_get_iter_at_pos (priv->row_seq, n));
+	return row->transfer;
+}
+
+
+/**
+ * stm_manager_get_transfer_id:
+ *
+ * @self: A #StmManager
+ * @transfer: A #StmTransfer
+ *
+ * Get ID given to @transfer when it was added. IDs are not reused,
+ * so an ID kept after transfer was removed won't find another one.
+ *
+ * Returns: ID of @transfer, or 0 if it is not in @self.
+ */
+guint
+stm_manager_get_transfer_id (StmManager *self, StmTransfer *transfer)
+{
+	StmManagerRow *row = g_hash_table_lookup (self->priv->rows, transfer);
+	return row ? row->id : 0;
+}
+
+
+/**
+ * stm_manager_lookup_id:
+ *
+ * @self: A #StmManager
+ * @id: ID returned by stm_manager_get_transfer_id()
+ *
+ * Returns: A #StmTransfer owned by @self, or NULL if none has @id.
+ */
+StmTransfer *
+stm_manager_lookup_id (StmManager *self, guint id)
+{
+	StmManagerRow *row = g_hash_table_lookup (self->priv->ids, GUINT_TO_POINTER (id));
+	return row ? row->transfer : NULL;
+}
+
+
+/**
+ * stm_manager_lookup_uri:
+ *
+ * @self: A #StmManager
+ * @uri: An URI
+ *
+ * Returns: Most recently added #StmTransfer downloading @uri, owned
+ * by @self, or NULL if none.
+ */
+StmTransfer *
+stm_manager_lookup_uri (StmManager *self, const gchar *uri)
+{
+	StmManagerRow *row = g_hash_table_lookup (self->priv->uris, uri);
+	return row ? row->transfer : NULL;
+}
+
+
+/**
+ * stm_manager_lookup_file:
+ *
+ * @self: A #StmManager
+ * @file: Full path of destination file
+ *
+ * Returns: Most recently added #StmTransfer writing to @file, owned
+ * by @self, or NULL if none.
+ */
+StmTransfer *
+stm_manager_lookup_file (StmManager *self, const gchar *file)
+{
+	StmManagerRow *row = g_hash_table_lookup (self->priv->files, file);
+	return row ? row->transfer : NULL;
+}
+
+
+/**
+ * stm_manager_get_rate_estimator:
+ *
+ * @self: A #StmManager
+ *
+ * Get estimator measuring combined download rate of all transfers.
+ *
+ * Returns: A #StmRateEstimator owned by @self.
+ */
+StmRateEstimator *
+stm_manager_get_rate_estimator (StmManager *self)
+{
+	return self->priv->rate;
+}
+
+
+/**
+ * stm_manager_get_speed:
+ *
+ * @self: A #StmManager
+ *
+ * Returns: Combined speed of all transfers, in bytes per second.
+ */
+guint64
+stm_manager_get_speed (StmManager *self)
+{
+	return (guint64) stm_rate_estimator_get_windowed (self->priv->rate);
+}
+
+
+/**
+ * stm_manager_set_max_speed:
+ *
+ * @self: A #StmManager
+ * @speed: Limit in bytes per second, 0 for no limit
+ *
+ * Limit combined download speed of all transfers. Transfers share
+ * the limit according to their weights, and bandwidth a transfer
+ * does not use is given to the others.
+ */
+void
+stm_manager_set_max_speed (StmManager *self, guint64 speed)
+{
+	stm_limiter_set_max_speed (speed);
+}
+
+
+/**
+ * stm_manager_get_max_speed:
+ *
+ * @self: A #StmManager
+ *
+ * Returns: Global speed limit in bytes per second, 0 if unlimited.
+ */
+guint64
+stm_manager_get_max_speed (StmManager *self)
+{
+	return stm_limiter_get_max_speed ();
+}
+
+
+/**
+ * stm_manager_set_multiplex:
+ *
+ * @self: A #StmManager
+ * @multiplex: Whether to multiplex transfers
+ *
+ * In multiplexing mode, transfers to the same origin share a single
+ * HTTP/2 connection as separate streams, and the number of
+ * connections per host is limited. Applies to connections opened
+ * from now on.
+ */
+void
+stm_manager_set_multiplex (StmManager *self, gboolean multiplex)
+{
+	StmManagerPrivate *priv = self->priv;
+
+	stm_handle_pool_set_multiplex (priv->handles, multiplex);
+	stm_engine_set_multiplex (multiplex, STM_MANAGER_MULTIPLEX_HOST_CONNECTIONS);
+}
+
+
+/**
+ * stm_manager_get_multiplex:
+ *
+ * @self: A #StmManager
+ *
+ * Returns: TRUE if multiplexing mode is on.
+ */
+gboolean
+stm_manager_get_multiplex (StmManager *self)
+{
+	return stm_handle_pool_get_multiplex (self->priv->handles);
+}
+
+
+/**
+ * stm_manager_set_network_threads:
+ *
+ * @self: A #StmManager
+ * @threads: Number of network threads
+ *
+ * Choose where network I/O runs. With 0 threads it shares main loop
+ * with the user interface, with 1 it runs in a dedicated thread so
+ * that redraws and dialogs don't hold up sockets, and vice versa.
+ * More threads spread transfers over several cores. Takes effect
+ * before first transfer is started, or after restart.
+ */
+void
+stm_manager_set_network_threads (StmManager *self, guint threads)
+{
+	stm_engine_set_threads (threads);
+}
+
+
+/**
+ * stm_manager_get_network_threads:
+ *
+ * @self: A #StmManager
+ *
+ * Returns: Requested number of network threads.
+ */
+guint
+stm_manager_get_network_threads (StmManager *self)
+{
+	return stm_engine_get_threads ();
+}
+
+
+/*
+ * Queue
+ */
+
+/**
+ * stm_manager_transfer_state_changed:
+ *
+ * Keep track of queued transfers, and fill slots freed by transfers
+ * which are no longer running.
+ */
+static void
+stm_manager_transfer_state_changed (StmTransfer *transfer, StmManager *self)
+{
+	StmManagerPrivate *priv = self->priv;
+
+	if (stm_transfer_get_state (transfer) == STM_TRANSFER_STATE_QUEUED) {
+		if (g_queue_find (priv->queued, transfer) == NULL)
+			g_queue_push_tail (priv->queued, transfer);
+	} else {
+		g_queue_remove (priv->queued, transfer);
+	}
+	stm_manager_update_running (self, transfer);
+	stm_manager_schedule (self);
+}
+
+
+/**
+ * stm_manager_update_running:
+ *
+ * Count @transfer as active for its host while it runs.
+ */
+static void
+stm_manager_update_running (StmManager *self, StmTransfer *transfer)
+{
+	StmManagerPrivate *priv = self->priv;
+
+	gboolean running = stm_transfer_get_state (transfer) == STM_TRANSFER_STATE_RUNNING;
+	if (running == (g_hash_table_lookup (priv->running, transfer) != NULL))
+		return;
+
+	StmHost *host = g_hash_table_lookup (priv->transfer_hosts, transfer);
+	if (running) {
+		g_hash_table_insert (priv->running, transfer, transfer);
+		stm_host_add_active (host);
+	} else {
+		g_hash_table_remove (priv->running, transfer);
+		stm_host_remove_active (host);
+	}
+	stm_manager_hosts_changed (self);
+}
+
+
+/**
+ * stm_manager_compare_hosts:
+ *
+ * Returns: Negative if @a should be served before @b, positive if
+ * after, 0 if hosts are equal to scheduler.
+ */
+static gint
+stm_manager_compare_hosts (StmManager *self, StmHost *a, StmHost *b)
+{
+	if (a == b)
+		return 0;
+
+	if (self->priv->host_policy == STM_MANAGER_HOST_POLICY_WEIGHTED) {
+		/* Compare active / weight without division */
+		guint64 la = (guint64) stm_host_get_active (a) * stm_host_get_weight (b);
+		guint64 lb = (guint64) stm_host_get_active (b) * stm_host_get_weight (a);
+		if (la != lb)
+			return la < lb ? -1 : 1;
+	}
+
+	/* Host served longest ago goes first */
+	guint sa = stm_host_get_served (a);
+	guint sb = stm_host_get_served (b);
+	if (sa != sb)
+		return sa < sb ? -1 : 1;
+	return 0;
+}
+
+
+/**
+ * stm_manager_compare_queued:
+ *
+ * Returns: TRUE if @a should be started before @b.
+ */
+static gboolean
+stm_manager_compare_queued (StmManager *self, StmTransfer *a, StmTransfer *b)
+{
+	StmManagerPrivate *priv = self->priv;
+
+	gint pa = stm_transfer_get_priority (a);
+	gint pb = stm_transfer_get_priority (b);
+	if (pa != pb)
+		return pa > pb;
+
+	gint hosts = stm_manager_compare_hosts (self,
+	                                        g_hash_table_lookup (priv->transfer_hosts, a),
+	                                        g_hash_table_lookup (priv->transfer_hosts, b));
+	if (hosts != 0)
+		return hosts < 0;
+
+	if (priv->policy == STM_MANAGER_POLICY_SHORTEST_FIRST) {
+		/* Transfers of unknown length go last */
+		guint64 la = stm_transfer_get_content_length (a);
+		guint64 lb = stm_transfer_get_content_length (b);
+		guint64 ra = la ? la - MIN (la, stm_transfer_get_downloaded (a)) : G_MAXUINT64;
+		guint64 rb = lb ? lb - MIN (lb, stm_transfer_get_downloaded (b)) : G_MAXUINT64;
+		return ra < rb;
+	}
+
+	/* Queue is in FIFO order already */
+	return FALSE;
+}
+
+
+/**
+ * idle_schedule:
+ *
+ * @self: A #StmManager
+ *
+ * Start queued transfers while there are free slots. Transfers from
+ * hosts which already run their share are passed over, so that one
+ * slow origin can't take all the slots.
+ */
+static gboolean
+idle_schedule (StmManager *self)
+{
+	StmManagerPrivate *priv = self->priv;
+	priv->schedule_id = 0;
+
+	while (priv->max_active == 0 || g_hash_table_size (priv->running) < priv->max_active) {
+		StmTransfer *next = NULL;
+		GList *node;
+		for (node = priv->queued->head; node; node = node->next) {
+			StmHost *host = g_hash_table_lookup (priv->transfer_hosts, node->data);
+			if (priv->host_max_active != 0 && stm_host_get_active (host) >= priv->host_max_active)
+				continue;
+			if (next == NULL || stm_manager_compare_queued (self, node->data, next))
+				next = node->data;
+		}
+		if (next == NULL)
+			break;
+
+		/* Leaves the queue and is counted through state-changed */
+		stm_host_set_served (g_hash_table_lookup (priv->transfer_hosts, next), ++priv->served);
+		stm_transfer_start (next);
+		g_queue_remove (priv->queued, next);
+	}
+	return FALSE;
+}
+
+
+/**
+ * stm_manager_schedule:
+ *
+ * @self: A #StmManager
+ *
+ * Look for queued transfers to start soon. Several changes in a row
+ * are handled at once.
+ */
+static void
+stm_manager_schedule (StmManager *self)
+{
+	StmManagerPrivate *priv = self->priv;
+
+	if (priv->schedule_id == 0 && ! priv->disposed)
+		priv->schedule_id = g_idle_add ((GSourceFunc) idle_schedule, self);
+}
+
+
+/**
+ * stm_manager_set_max_active:
+ *
+ * @self: A #StmManager
+ * @max_active: Limit of running transfers, 0 for no limit
+ *
+ * Limit number of transfers running at once. Queued transfers are
+ * started as running ones finish or stop; transfers already running
+ * are not stopped when limit is lowered.
+ */
+void
+stm_manager_set_max_active (StmManager *self, guint max_active)
+{
+	self->priv->max_active = max_active;
+	stm_manager_schedule (self);
+}
+
+
+/**
+ * stm_manager_get_max_active:
+ *
+ * @self: A #StmManager
+ *
+ * Returns: Limit of running transfers, 0 if unlimited.
+ */
+guint
+stm_manager_get_max_active (StmManager *self)
+{
+	return self->priv->max_active;
+}
+
+
+/**
+ * stm_manager_set_policy:
+ *
+ * @self: A #StmManager
+ * @policy: A #StmManagerPolicy
+ *
+ * Choose which of queued transfers with the same priority is
+ * started first.
+ */
+void
+stm_manager_set_policy (StmManager *self, StmManagerPolicy policy)
+{
+	self->priv->policy = policy;
+	stm_manager_schedule (self);
+}
+
+
+/**
+ * stm_manager_get_policy:
+ *
+ * @self: A #StmManager
+ *
+ * Returns: Order of starting queued transfers.
+ */
+StmManagerPolicy
+stm_manager_get_policy (StmManager *self)
+{
+	return self->priv->policy;
+}
+
+
+/*
+ * Hosts
+ */
+
+/**
+ * stm_manager_get_host:
+ *
+ * @self: A #StmManager
+ * @origin: Origin, see stm_uri_get_origin()
+ *
+ * Returns: #StmHost for @origin owned by @self, created if needed.
+ */
+static StmHost *
+stm_manager_get_host (StmManager *self, const gchar *origin)
+{
+	StmManagerPrivate *priv = self->priv;
+
+	StmHost *host = g_hash_table_lookup (priv->hosts, origin);
+	if (host == NULL) {
+		host = stm_host_new (origin);
+		stm_host_set_max_connections (host, priv->host_max_connections);
+		g_hash_table_insert (priv->hosts, (gpointer) stm_host_get_origin (host), host);
+	}
+	return host;
+}
+
+
+/**
+ * idle_hosts_changed:
+ *
+ * Emit "hosts-changed" once for a batch of changes.
+ */
+static gboolean
+idle_hosts_changed (StmManager *self)
+{
+	self->priv->hosts_changed_id = 0;
+	g_signal_emit (self, signals[HOSTS_CHANGED], 0);
+	return FALSE;
+}
+
+
+static void
+stm_manager_hosts_changed (StmManager *self)
+{
+	StmManagerPrivate *priv = self->priv;
+
+	if (priv->hosts_changed_id == 0 && ! priv->disposed)
+		priv->hosts_changed_id = g_idle_add ((GSourceFunc) idle_hosts_changed, self);
+}
+
+
+/**
+ * stm_manager_set_host_max_active:
+ *
+ * @self: A #StmManager
+ * @max_active: Limit of running transfers per host, 0 for no limit
+ *
+ * Limit number of transfers running at once from the same origin.
+ * Slots left over are given to transfers from other origins.
+ */
+void
+stm_manager_set_host_max_active (StmManager *self, guint max_active)
+{
+	self->priv->host_max_active = max_active;
+	stm_manager_schedule (self);
+}
+
 
-	gboolean disposed;
-};
+guint
+stm_manager_get_host_max_active (StmManager *self)
+{
+	return self->priv->host_max_active;
+}
 
 
-#define STM_MANAGER_GET_PRIVATE(obj) \
-	(G_TYPE_INSTANCE_GET_PRIVATE ((obj), \
-	STM_TYPE_MANAGER, StmManagerPrivate))
+/**
+ * stm_manager_set_host_max_connections:
+ *
+ * @self: A #StmManager
+ * @max_connections: Limit of connections per host, 0 for no limit
+ *
+ * Limit number of connections, and so segments, all transfers may
+ * open to the same origin. Each running transfer keeps at least one
+ * connection regardless of the limit.
+ */
+void
+stm_manager_set_host_max_connections (StmManager *self, guint max_connections)
+{
+	StmManagerPrivate *priv = self->priv;
 
+	priv->host_max_connections = max_connections;
 
-/* Signals */
-enum {
-	TRANSFER_ADDED,
-	TRANSFER_REMOVED,
-	
-	LAST_SIGNAL
-};
+	GHashTableIter iter;
+	gpointer host;
+	g_hash_table_iter_init (&iter, priv->hosts);
+	while (g_hash_table_iter_next (&iter, NULL, &host))
+		stm_host_set_max_connections (host, max_connections);
+}
 
-static guint signals[LAST_SIGNAL];
 
-StmManager*
-stm_manager_new (void)
+guint
+stm_manager_get_host_max_connections (StmManager *self)
 {
-	StmManager *self = g_object_new (STM_TYPE_MANAGER, NULL);
-	return self;
+	return self->priv->host_max_connections;
 }
 
 
 /**
- * stm_manager_add_transfer:
- * 
- * @self A #StmManager
- * @transfer A #StmTransfer
- * 
- * Add a transfer to manager.
+ * stm_manager_set_host_policy:
+ *
+ * @self: A #StmManager
+ * @policy: A #StmManagerHostPolicy
+ *
+ * Choose how free slots are shared between hosts.
  */
 void
-stm_manager_add_transfer (StmManager *self, StmTransfer *transfer)
+stm_manager_set_host_policy (StmManager *self, StmManagerHostPolicy policy)
 {
-	StmManagerPrivate *priv = self->priv;
+	self->priv->host_policy = policy;
+	stm_manager_schedule (self);
+}
 
-	priv->transfers = g_list_append (priv->transfers, 
-	                                 g_object_ref (transfer));
-//	stm_transfer_start (transfer);
 
-	g_signal_emit (self, signals[TRANSFER_ADDED], 0, transfer);
+StmManagerHostPolicy
+stm_manager_get_host_policy (StmManager *self)
+{
+	return self->priv->host_policy;
 }
 
 
 /**
- * stm_manager_remove_transfer:
- * 
+ * stm_manager_set_host_weight:
+ *
  * @self: A #StmManager
- * @transfer: A #StmTransfer
- * 
- * Remove transfer form manager.
+ * @origin: Origin, see stm_uri_get_origin()
+ * @weight: Share of host in weighted scheduling
  */
 void
-stm_manager_remove_transfer (StmManager *self, StmTransfer *transfer)
+stm_manager_set_host_weight (StmManager *self, const gchar *origin, guint weight)
 {
-	StmManagerPrivate *priv = self->priv;
+	stm_host_set_weight (stm_manager_get_host (self, origin), weight);
+	stm_manager_schedule (self);
+}
 
-//	glibcurl_remove (_stm_transfer_get_handle (transfer));
-	GList *node = g_list_find (priv->transfers, transfer);
-	if (node != NULL) {
-		priv->transfers = g_list_delete_link (priv->transfers, node);
-		g_signal_emit (self, signals[TRANSFER_REMOVED], 0, transfer);
-		g_object_unref (transfer);
-//		g_print ("Removing transfer, left %u references\n", G_OBJECT (transfer)->ref_count);
-	} else {
-		g_printerr ("Attempting to remove transfer which is not added!");
-	}
-//	priv->transfers = g_list_remove (priv->transfers, transfer);
 
+static gint
+stm_manager_compare_origins (StmHost *a, StmHost *b)
+{
+	return strcmp (stm_host_get_origin (a), stm_host_get_origin (b));
+}
+
+
+/**
+ * stm_manager_get_hosts:
+ *
+ * @self: A #StmManager
+ *
+ * Returns: List of #StmHost's known to @self, sorted by origin. Hosts
+ * are owned by @self; list should be freed with g_list_free().
+ */
+GList *
+stm_manager_get_hosts (StmManager *self)
+{
+	GList *hosts = NULL;
+
+	GHashTableIter iter;
+	gpointer host;
+	g_hash_table_iter_init (&iter, self->priv->hosts);
+	while (g_hash_table_iter_next (&iter, NULL, &host))
+		hosts = g_list_prepend (hosts, host);
+	return g_list_sort (hosts, (GCompareFunc) stm_manager_compare_origins);
 }
 
 
@@ -138,7 +980,41 @@ stm_manager_load_state_start_element (GMarkupParseContext *context,
 	StmManager *self = STM_MANAGER (user_data);
 //	StmManagerPrivate *priv = self->priv;
 
-	if (strcmp (element_name, "transfer") == 0) {
+	if (strcmp (element_name, "transfers") == 0) {
+		int i;
+		for (i = 0; attribute_names[i]; i++) {
+			if (strcmp (attribute_names[i], "max_speed") == 0)
+				stm_manager_set_max_speed (self, g_ascii_strtoull (attribute_values[i], NULL, 10));
+			else if (strcmp (attribute_names[i], "multiplex") == 0)
+				stm_manager_set_multiplex (self, atoi (attribute_values[i]) != 0);
+			else if (strcmp (attribute_names[i], "network_threads") == 0)
+				stm_manager_set_network_threads (self, atoi (attribute_values[i]));
+			else if (strcmp (attribute_names[i], "max_active") == 0)
+				stm_manager_set_max_active (self, atoi (attribute_values[i]));
+			else if (strcmp (attribute_names[i], "policy") == 0)
+				stm_manager_set_policy (self, atoi (attribute_values[i]) == STM_MANAGER_POLICY_SHORTEST_FIRST
+				                        ? STM_MANAGER_POLICY_SHORTEST_FIRST : STM_MANAGER_POLICY_FIFO);
+			else if (strcmp (attribute_names[i], "host_max_active") == 0)
+				stm_manager_set_host_max_active (self, atoi (attribute_values[i]));
+			else if (strcmp (attribute_names[i], "host_max_connections") == 0)
+				stm_manager_set_host_max_connections (self, atoi (attribute_values[i]));
+			else if (strcmp (attribute_names[i], "host_policy") == 0)
+				stm_manager_set_host_policy (self, atoi (attribute_values[i]) == STM_MANAGER_HOST_POLICY_WEIGHTED
+				                             ? STM_MANAGER_HOST_POLICY_WEIGHTED : STM_MANAGER_HOST_POLICY_ROUND_ROBIN);
+		}
+	} else if (strcmp (element_name, "host") == 0) {
+		const gchar *origin = NULL;
+		guint weight = STM_HOST_DEFAULT_WEIGHT;
+		int i;
+		for (i = 0; attribute_names[i]; i++) {
+			if (strcmp (attribute_names[i], "origin") == 0)
+				origin = attribute_values[i];
+			else if (strcmp (attribute_names[i], "weight") == 0)
+				weight = atoi (attribute_values[i]);
+		}
+		if (origin)
+			stm_manager_set_host_weight (self, origin, weight);
+	} else if (strcmp (element_name, "transfer") == 0) {
 		StmTransfer *transfer = _stm_transfer_from_xml (element_name,
                                                         attribute_names,
                                                         attribute_values);
@@ -250,11 +1126,38 @@ stm_manager_save_state (StmManager *self, const gchar *file_name)
 	}
 	
 	fprintf (f, "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n");
-	fprintf (f, "<transfers>\n");
+	fprintf (f, "<transfers max_speed='%llu' multiplex='%d' network_threads='%u'"
+	            " max_active='%u' policy='%d' host_max_active='%u'"
+	            " host_max_connections='%u' host_policy='%d'>\n",
+	         (unsigned long long) stm_manager_get_max_speed (self),
+	         stm_manager_get_multiplex (self),
+	         stm_manager_get_network_threads (self),
+	         stm_manager_get_max_active (self),
+	         stm_manager_get_policy (self),
+	         stm_manager_get_host_max_active (self),
+	         stm_manager_get_host_max_connections (self),
+	         stm_manager_get_host_policy (self));
 
 	GList *node;
-	for (node = priv->transfers; node; node = node->next) {
-		StmTransfer *transfer = node->data;
+	GList *hosts = stm_manager_get_hosts (self);
+	for (node = hosts; node; node = node->next) {
+		StmHost *host = node->data;
+		if (stm_host_get_weight (host) == STM_HOST_DEFAULT_WEIGHT)
+			continue;
+
+		char *xml = g_markup_printf_escaped ("<host origin='%s' weight='%u'/>",
+		                                     stm_host_get_origin (host),
+		                                     stm_host_get_weight (host));
+		fprintf (f, "%s\n", xml);
+		g_free (xml);
+	}
+	g_list_free (hosts);
+
+	GSequenceIter *it;
+	for (it = g_sequence_get_begin_iter (priv->row_seq);
+	     !g_sequence_iter_is_end (it);
+	     it = g_sequence_iter_next (it)) {
+		StmTransfer *transfer = ((StmManagerRow *) g_sequence_get (it))->transfer;
 		
 		char *xml = _stm_transfer_to_xml (transfer);
 		fprintf (f, "%s\n", xml);
@@ -275,7 +1178,8 @@ stm_manager_save_state (StmManager *self, const gchar *file_name)
  * @self A #StmManager
  *
  * Callback run once in a while, saving current transfers state
- * to a file, so that they can be restored.
+ * to a file, so that they can be restored. Keeps running only while
+ * some transfer is running, see stm_manager_schedule_save().
  */
 static gboolean
 idle_write_state (StmManager *self)
@@ -285,7 +1189,49 @@ idle_write_state (StmManager *self)
 	if (priv->state_file)
 		stm_manager_save_state (self, priv->state_file);
 
-	return TRUE;
+	if (g_hash_table_size (priv->running) > 0)
+		return TRUE;
+
+	/* Nothing will change until somebody touches transfers again */
+	priv->state_file_id = 0;
+	return FALSE;
+}
+
+
+/**
+ * stm_manager_schedule_save:
+ *
+ * @self A #StmManager
+ *
+ * Make sure state file is written soon, after something changed.
+ */
+static void
+stm_manager_schedule_save (StmManager *self)
+{
+	StmManagerPrivate *priv = self->priv;
+
+	if (priv->state_file == NULL || priv->state_file_id != 0)
+		return;
+
+	priv->state_file_id = g_timeout_add (STM_MANAGER_STATE_INTERVAL,
+	                                     (GSourceFunc) idle_write_state,
+	                                     self);
+}
+
+
+/**
+ * stm_manager_state_flush:
+ *
+ * Callback called by #StmProgressScheduler when transfers changed,
+ * used to wake up state file writer.
+ */
+static void
+stm_manager_state_flush (StmProgressScheduler *scheduler, GPtrArray *transfers,
+                         StmManager *self)
+{
+	stm_manager_schedule_save (self);
+	/* Connections per host change as transfers split */
+	stm_manager_hosts_changed (self);
 }
 
 
@@ -296,7 +1242,7 @@ idle_write_state (StmManager *self)
  * @file State file name
  *
  * Set state file name, so that state of transfer is periodically
- * written to that file
+ * written to that file. Writing stops while no transfer is running.
  */
 void
 stm_manager_set_state_file (StmManager *self,
@@ -308,14 +1254,16 @@ stm_manager_set_state_file (StmManager *self,
 
 	if (priv->state_file) {
 		g_free (priv->state_file);
+		priv->state_file = NULL;
+	}
+	if (priv->state_file_id) {
 		g_source_remove (priv->state_file_id);
+		priv->state_file_id = 0;
 	}
 
 	if (file) {
 		priv->state_file = g_strdup (file);
-		priv->state_file_id = g_timeout_add (10000,
-		                                     (GSourceFunc) idle_write_state,
-						     self);
+		stm_manager_schedule_save (self);
 	}
 }
 
@@ -347,177 +1295,345 @@ stm_manager_get_state_file (StmManager *self)
 
 /*
  * Tree model associated with this manager
+ *
+ * Manager implements #GtkTreeModel itself, as a flat list over its
+ * array of rows. Column values are computed from transfers only when
+ * a view asks for them, so nothing is copied for rows which are not
+ * visible. Sizes and speed are raw numbers, formatting is up to views.
  */
 
+#define STM_MANAGER_N_COLUMNS	(STM_COLUMN_HOST + 1)
+
+#define STM_MANAGER_ROW(iter)	((StmManagerRow *) (iter)->user_data)
+
+
 /**
- * stm_manager_tm_update_iter:
- * 
- * Update iterator contents in associated TreeModel
+ * stm_manager_row_changed:
+ *
+ * Tell views that @transfer needs to be redrawn.
  */
 static void
-stm_manager_tm_update_iter (StmManager *self, StmTransfer *transfer, GtkTreeIter *iter)
+stm_manager_row_changed (StmManager *self, StmTransfer *transfer)
 {
 	StmManagerPrivate *priv = self->priv;
-	
-	static const gchar *stock_ids[] = {
-		GTK_STOCK_FILE,
-		GTK_STOCK_MEDIA_PAUSE,
-		GTK_STOCK_MEDIA_PLAY,
-		GTK_STOCK_OK,
-		GTK_STOCK_CANCEL
-	};
-
-	guint64 downloaded      = stm_transfer_get_downloaded (transfer);
-	guint64 content_length  = stm_transfer_get_content_length (transfer);
-	guint64 speed           = stm_transfer_get_speed (transfer);
-	gint    state           = stm_transfer_get_state (transfer);
-	
-	gchar buf1[16];
-	gchar buf2[16];
-	gchar buf3[18];
 
-	double r		= (content_length != 0) ? ((double)downloaded / content_length) : 0.0;
-	int ratio		= (int) 100 * r;
+	StmManagerRow *row = g_hash_table_lookup (priv->rows, transfer);
+	if (row == NULL)
+		return;
 
-	stm_format_size_buffer (speed, buf3, 16);
-	g_strlcat (buf3, "/s", 18);
+	GtkTreeIter iter;
+	iter.stamp = priv->stamp;
+	iter.user_data = row;
 
-	gtk_list_store_set (GTK_LIST_STORE (priv->model), iter,
-	                    STM_COLUMN_TRANSFER,   transfer,
-			            STM_COLUMN_URI,        stm_transfer_get_uri (transfer),
-			            STM_COLUMN_FILE,       stm_transfer_get_file_name (transfer),
-			            STM_COLUMN_DOWNLOADED, stm_format_size_buffer (downloaded, buf1, 16),
-			            STM_COLUMN_TOTAL,      stm_format_size_buffer (content_length, buf2, 16),
-			            STM_COLUMN_SPEED,      buf3,
-			            STM_COLUMN_PERCENT,    ratio,
-			            STM_COLUMN_STOCK_ID,   stock_ids[state],
-			            -1);
+	GtkTreePath *path = gtk_tree_path_new ();
+	gtk_tree_path_append_index (path, g_sequence_iter_get_position (row->iter));
+	gtk_tree_model_row_changed (GTK_TREE_MODEL (self), path, &iter);
+	gtk_tree_path_free (path);
 }
 
 
 /**
- * stm_manager_tm_progress:
- * 
- * Callback called whenever associated #StmTransfer receives some data
+ * stm_manager_append_row:
+ *
+ * Add @transfer at the end of collection and of the model.
  */
 static void
-stm_manager_tm_progress (StmTransfer *transfer, StmManager *self)
+stm_manager_append_row (StmManager *self, StmTransfer *transfer)
 {
 	StmManagerPrivate *priv = self->priv;
 
+	StmManagerRow *row = g_slice_new0 (StmManagerRow);
+	row->transfer = transfer;
+	row->id = priv->next_id++;
+	row->iter = g_sequence_append (priv->row_seq, row);
+	stm_manager_index_row (self, row);
+
 	GtkTreeIter iter;
-	gtk_tree_model_get_iter_first (priv->model, &iter);
-	do {
-		StmTransfer *t;
-		gtk_tree_model_get (priv->model, &iter, 0, &t, -1);
-		if (t == transfer) {
-			/* Right iter */
-			stm_manager_tm_update_iter (self, transfer, &iter);
-		}
-		g_object_unref (t);
-	} while (gtk_tree_model_iter_next (priv->model, &iter));
+	iter.stamp = priv->stamp;
+	iter.user_data = row;
 
+	GtkTreePath *path = gtk_tree_path_new ();
+	gtk_tree_path_append_index (path, g_sequence_iter_get_position (row->iter));
+	gtk_tree_model_row_inserted (GTK_TREE_MODEL (self), path, &iter);
+	gtk_tree_path_free (path);
 }
 
 
 /**
- * stm_manager_tm_transfer_added:
- * 
- * Callback called when a new #StmTransfer is added to #StmManager.
- * 
- * Add new row to associated #GtkTreeModel and update its iterator.
+ * stm_manager_remove_row:
+ *
+ * Remove @transfer from collection and model, keeping order of the
+ * others.
  */
 static void
-stm_manager_tm_transfer_added (StmManager *self, StmTransfer *transfer, gpointer data)
+stm_manager_remove_row (StmManager *self, StmTransfer *transfer)
 {
 	StmManagerPrivate *priv = self->priv;
-	GtkTreeIter iter;
 
-	gtk_list_store_append (GTK_LIST_STORE (priv->model), &iter);
-	stm_manager_tm_update_iter (self, transfer, &iter);
+	StmManagerRow *row = g_hash_table_lookup (priv->rows, transfer);
+	if (row == NULL)
+		return;
+
+	/* Sequence is a balanced tree, so both of these are O(log n) */
+	gint index = g_sequence_iter_get_position (row->iter);
+	stm_manager_unindex_row (self, row);
+	g_sequence_remove (row->iter);
+	g_slice_free (StmManagerRow, row);
 
-	g_signal_connect (transfer, "progress",
-	                  G_CALLBACK (stm_manager_tm_progress), self);
+	GtkTreePath *path = gtk_tree_path_new ();
+	gtk_tree_path_append_index (path, index);
+	gtk_tree_model_row_deleted (GTK_TREE_MODEL (self), path);
+	gtk_tree_path_free (path);
 }
 
 
 /**
- * stm_manager_tm_transfer_removed:
- * 
- * Callback called when #StmTransfer is removed from #StmManager
- * 
- * Remove row from associated #GtkTreeModel
+ * stm_manager_tm_flush:
+ *
+ * Callback called by #StmProgressScheduler with batch of transfers
+ * whose progress has changed since last flush. Only their rows are
+ * redrawn.
  */
 static void
-stm_manager_tm_transfer_removed (StmManager *self, StmTransfer *transfer, gpointer data)
+stm_manager_tm_flush (StmProgressScheduler *scheduler, GPtrArray *transfers,
+                      StmManager *self)
 {
-	StmManagerPrivate *priv = self->priv;
-	g_print ("Transfer removed!\n");
+	guint i;
+	for (i = 0; i < transfers->len; i++) {
+		stm_manager_row_changed (self, transfers->pdata[i]);
+	}
+}
 
-	GtkTreeIter iter;
-	gtk_tree_model_get_iter_first (priv->model, &iter);
-	do {
-		StmTransfer *t;
-		gtk_tree_model_get (priv->model, &iter, 0, &t, -1);
-		if (t == transfer) {
-			/* Right iter */
-			gtk_list_store_remove (GTK_LIST_STORE (priv->model), &iter);
-			g_object_unref (t);
-			return;
-		}
-		g_object_unref (t);
-	} while (gtk_tree_model_iter_next (priv->model, &iter));
+
+static GtkTreeModelFlags
+stm_manager_tm_get_flags (GtkTreeModel *model)
+{
+	return GTK_TREE_MODEL_LIST_ONLY | GTK_TREE_MODEL_ITERS_PERSIST;
+}
+
+
+static gint
+stm_manager_tm_get_n_columns (GtkTreeModel *model)
+{
+	return STM_MANAGER_N_COLUMNS;
+}
+
+
+static GType
+stm_manager_tm_get_column_type (GtkTreeModel *model, gint column)
+{
+	switch (column) {
+		case STM_COLUMN_TRANSFER:
+			return STM_TYPE_TRANSFER;
+		case STM_COLUMN_PERCENT:
+		case STM_COLUMN_PRIORITY:
+			return G_TYPE_INT;
+		case STM_COLUMN_MULTIPLEXED:
+			return G_TYPE_BOOLEAN;
+		case STM_COLUMN_DOWNLOADED:
+		case STM_COLUMN_TOTAL:
+		case STM_COLUMN_SPEED:
+			return G_TYPE_UINT64;
+		default:
+			return G_TYPE_STRING;
+	}
+}
+
+
+static gboolean
+stm_manager_tm_get_iter (GtkTreeModel *model, GtkTreeIter *iter, GtkTreePath *path)
+{
+	StmManagerPrivate *priv = STM_MANAGER (model)->priv;
+
+	if (gtk_tree_path_get_depth (path) != 1)
+		return FALSE;
+
+	gint index = gtk_tree_path_get_indices (path)[0];
+	if (index < 0 || index >= g_sequence_get_length (priv->row_seq))
+		return FALSE;
+
+	iter->stamp = priv->stamp;
+	iter->user_data = g_sequence_get (g_sequence_get_iter_at_pos (priv->row_seq, index));
+	return TRUE;
+}
+
+
+static GtkTreePath *
+stm_manager_tm_get_path (GtkTreeModel *model, GtkTreeIter *iter)
+{
+	g_return_val_if_fail (iter->stamp == STM_MANAGER (model)->priv->stamp, NULL);
+
+	GtkTreePath *path = gtk_tree_path_new ();
+	gtk_tree_path_append_index (path, g_sequence_iter_get_position (STM_MANAGER_ROW (iter)->iter));
+	return path;
 }
 
 
 /**
- * stm_manager_get_tree_model:
- * 
- * @self A #StmManager
- * 
- * Get associated #GtkTreeModel.
- * 
- * Model will be created if necessary. There will always be one
- * instance of model per #StmManager. This model can be viewed with
- * #GtkTreeView or #GtkIconView.
- * 
- * Returns: A #GtkTreeModel.
+ * stm_manager_tm_get_value:
+ *
+ * Compute value of a column from transfer of the row.
  */
-GtkTreeModel *
-stm_manager_get_tree_model (StmManager *self)
+static void
+stm_manager_tm_get_value (GtkTreeModel *model, GtkTreeIter *iter, gint column,
+                          GValue *value)
 {
-	StmManagerPrivate *priv = self->priv;
-	// TODO: count references!!!
+	StmManagerPrivate *priv = STM_MANAGER (model)->priv;
+
+	static const gchar *stock_ids[] = {
+		GTK_STOCK_FILE,
+		GTK_STOCK_MEDIA_PAUSE,
+		GTK_STOCK_MEDIA_PLAY,
+		GTK_STOCK_OK,
+		GTK_STOCK_CANCEL,
+		GTK_STOCK_MEDIA_NEXT
+	};
+
+	g_return_if_fail (iter->stamp == priv->stamp);
+
+	StmTransfer *transfer = STM_MANAGER_ROW (iter)->transfer;
+
+	g_value_init (value, stm_manager_tm_get_column_type (model, column));
+	switch (column) {
+		case STM_COLUMN_TRANSFER:
+			g_value_set_object (value, transfer);
+			break;
+		case STM_COLUMN_URI:
+			g_value_set_string (value, stm_transfer_get_uri (transfer));
+			break;
+		case STM_COLUMN_FILE:
+			g_value_set_string (value, stm_transfer_get_file_name (transfer));
+			break;
+		case STM_COLUMN_DOWNLOADED:
+			g_value_set_uint64 (value, stm_transfer_get_downloaded (transfer));
+			break;
+		case STM_COLUMN_TOTAL:
+			g_value_set_uint64 (value, stm_transfer_get_content_length (transfer));
+			break;
+		case STM_COLUMN_SPEED:
+			g_value_set_uint64 (value, stm_transfer_get_speed (transfer));
+			break;
+		case STM_COLUMN_PERCENT: {
+			guint64 downloaded     = stm_transfer_get_downloaded (transfer);
+			guint64 content_length = stm_transfer_get_content_length (transfer);
+			double r = (content_length != 0) ? ((double)downloaded / content_length) : 0.0;
+			g_value_set_int (value, (int) 100 * r);
+			break;
+		}
+		case STM_COLUMN_STOCK_ID:
+			g_value_set_static_string (value, stock_ids[stm_transfer_get_state (transfer)]);
+			break;
+		case STM_COLUMN_MULTIPLEXED:
+			g_value_set_boolean (value, stm_transfer_is_multiplexed (transfer));
+			break;
+		case STM_COLUMN_PRIORITY:
+			g_value_set_int (value, stm_transfer_get_priority (transfer));
+			break;
+		case STM_COLUMN_HOST: {
+			StmHost *host = g_hash_table_lookup (priv->transfer_hosts, transfer);
+			g_value_set_string (value, host ? stm_host_get_origin (host) : NULL);
+			break;
+		}
+		default:
+			g_warning ("Invalid column %d", column);
+	}
+}
 
-	if (priv->model != NULL)
-		return priv->model;
 
-	GtkListStore *model = gtk_list_store_new (8,
-			STM_TYPE_TRANSFER,
-			G_TYPE_STRING,
-			G_TYPE_STRING,
-			G_TYPE_STRING,
-			G_TYPE_STRING,
-			G_TYPE_STRING,
-			G_TYPE_INT,
-			G_TYPE_STRING);
+static gboolean
+stm_manager_tm_iter_nth_child (GtkTreeModel *model, GtkTreeIter *iter,
+                               GtkTreeIter *parent, gint n)
+{
+	StmManagerPrivate *priv = STM_MANAGER (model)->priv;
 
-	priv->model = GTK_TREE_MODEL (model);
+	/* List only */
+	if (parent != NULL || n < 0 || n >= g_sequence_get_length (priv->row_seq))
+		return FALSE;
 
+	iter->stamp = priv->stamp;
+	iter->user_data = g_sequence_get (g_sequence_get_iter_at_pos (priv->row_seq, n));
+	return TRUE;
+}
 
-	g_signal_connect (self, "transfer-added",
-	                  G_CALLBACK (stm_manager_tm_transfer_added), NULL);
-	g_signal_connect (self, "transfer-removed",
-	                  G_CALLBACK (stm_manager_tm_transfer_removed), NULL);
 
-	GList *node;
-	for (node = priv->transfers; node; node = node->next) {
-		StmTransfer *transfer = node->data;
+static gboolean
+stm_manager_tm_iter_next (GtkTreeModel *model, GtkTreeIter *iter)
+{
+	g_return_val_if_fail (iter->stamp == STM_MANAGER (model)->priv->stamp, FALSE);
+
+	GSequenceIter *next = g_sequence_iter_next (STM_MANAGER_ROW (iter)->iter);
+	if (g_sequence_iter_is_end (next))
+		return FALSE;
+
+	iter->user_data = g_sequence_get (next);
+	return TRUE;
+}
+
+
+static gboolean
+stm_manager_tm_iter_children (GtkTreeModel *model, GtkTreeIter *iter,
+                              GtkTreeIter *parent)
+{
+	return stm_manager_tm_iter_nth_child (model, iter, parent, 0);
+}
+
+
+static gboolean
+stm_manager_tm_iter_has_child (GtkTreeModel *model, GtkTreeIter *iter)
+{
+	return FALSE;
+}
 
-		stm_manager_tm_transfer_added (self, transfer, NULL);
-	}
 
-	return priv->model;
+static gint
+stm_manager_tm_iter_n_children (GtkTreeModel *model, GtkTreeIter *iter)
+{
+	if (iter != NULL)
+		return 0;
+	return g_sequence_get_length (STM_MANAGER (model)->priv->row_seq);
+}
+
+
+static gboolean
+stm_manager_tm_iter_parent (GtkTreeModel *model, GtkTreeIter *iter,
+                            GtkTreeIter *child)
+{
+	return FALSE;
+}
+
+
+static void
+stm_manager_tree_model_init (GtkTreeModelIface *iface)
+{
+	iface->get_flags       = stm_manager_tm_get_flags;
+	iface->get_n_columns   = stm_manager_tm_get_n_columns;
+	iface->get_column_type = stm_manager_tm_get_column_type;
+	iface->get_iter        = stm_manager_tm_get_iter;
+	iface->get_path        = stm_manager_tm_get_path;
+	iface->get_value       = stm_manager_tm_get_value;
+	iface->iter_next       = stm_manager_tm_iter_next;
+	iface->iter_children   = stm_manager_tm_iter_children;
+	iface->iter_has_child  = stm_manager_tm_iter_has_child;
+	iface->iter_n_children = stm_manager_tm_iter_n_children;
+	iface->iter_nth_child  = stm_manager_tm_iter_nth_child;
+	iface->iter_parent     = stm_manager_tm_iter_parent;
+}
+
+
+/**
+ * stm_manager_get_tree_model:
+ * 
+ * @self A #StmManager
+ * 
+ * Get associated #GtkTreeModel, which is @self itself. This model
+ * can be viewed with #GtkTreeView or #GtkIconView.
+ * 
+ * Returns: A #GtkTreeModel owned by @self.
+ */
+GtkTreeModel *
+stm_manager_get_tree_model (StmManager *self)
+{
+	return GTK_TREE_MODEL (self);
 }
 
 /* GObject implementation */
@@ -528,8 +1644,35 @@ stm_manager_init (StmManager *self)
 	self->priv = STM_MANAGER_GET_PRIVATE (self);
 	StmManagerPrivate *priv = self->priv;
 
-	priv->transfers = NULL;
-	priv->model = NULL;
+	priv->rate = stm_rate_estimator_new ();
+	priv->handles = stm_handle_pool_new ();
+	priv->row_seq = g_sequence_new (NULL);
+	priv->rows = g_hash_table_new (g_direct_hash, g_direct_equal);
+	priv->ids = g_hash_table_new (g_direct_hash, g_direct_equal);
+	priv->uris = g_hash_table_new (g_str_hash, g_str_equal);
+	priv->files = g_hash_table_new (g_str_hash, g_str_equal);
+	priv->next_id = 1;
+	priv->stamp = g_random_int ();
+
+	priv->queued = g_queue_new ();
+	priv->max_active = STM_MANAGER_DEFAULT_MAX_ACTIVE;
+	priv->policy = STM_MANAGER_POLICY_FIFO;
+	priv->schedule_id = 0;
+
+	priv->hosts = g_hash_table_new_full (g_str_hash, g_str_equal,
+	                                     NULL, (GDestroyNotify) stm_host_unref);
+	priv->transfer_hosts = g_hash_table_new (g_direct_hash, g_direct_equal);
+	priv->running = g_hash_table_new (g_direct_hash, g_direct_equal);
+	priv->host_max_active = STM_HOST_DEFAULT_MAX_ACTIVE;
+	priv->host_max_connections = STM_HOST_DEFAULT_MAX_CONNECTIONS;
+	priv->host_policy = STM_MANAGER_HOST_POLICY_ROUND_ROBIN;
+	priv->served = 0;
+	priv->hosts_changed_id = 0;
+
+	g_signal_connect (stm_progress_scheduler_get_default (), "flush",
+	                  G_CALLBACK (stm_manager_state_flush), self);
+	g_signal_connect (stm_progress_scheduler_get_default (), "flush",
+	                  G_CALLBACK (stm_manager_tm_flush), self);
 
 	priv->disposed = FALSE;
 }
@@ -548,18 +1691,42 @@ stm_manager_dispose (GObject *object)
 	}
 	priv->disposed = TRUE;
 
-	if (priv->model) {
-		g_object_unref (priv->model);
-	}
+	g_signal_handlers_disconnect_by_func (stm_progress_scheduler_get_default (),
+	                                      stm_manager_state_flush, self);
+	g_signal_handlers_disconnect_by_func (stm_progress_scheduler_get_default (),
+	                                      stm_manager_tm_flush, self);
 	
-	GList *node;
-	for (node = priv->transfers; node; node = node->next) {
-		StmTransfer *transfer = node->data;
+	GSequenceIter *it = g_sequence_get_begin_iter (priv->row_seq);
+	while (!g_sequence_iter_is_end (it)) {
+		StmManagerRow *row = g_sequence_get (it);
+		StmTransfer *transfer = row->transfer;
 		
 		g_print ("Unreffing transfer, now %u\n", G_OBJECT(transfer)->ref_count);
+		g_signal_handlers_disconnect_matched (transfer, G_SIGNAL_MATCH_DATA,
+		                                      0, 0, NULL, NULL, self);
+		stm_rate_estimator_set_parent (stm_transfer_get_rate_estimator (transfer), NULL);
+		_stm_transfer_set_host (transfer, NULL);
+		it = g_sequence_iter_next (it);
+		g_sequence_remove (row->iter);
+		g_slice_free (StmManagerRow, row);
 		g_object_unref (transfer);
 	}
-	g_list_free (priv->transfers);
+	g_hash_table_remove_all (priv->rows);
+	g_hash_table_remove_all (priv->ids);
+	g_hash_table_remove_all (priv->uris);
+	g_hash_table_remove_all (priv->files);
+	g_queue_free (priv->queued);
+	if (priv->schedule_id)
+		g_source_remove (priv->schedule_id);
+	if (priv->hosts_changed_id)
+		g_source_remove (priv->hosts_changed_id);
+	g_hash_table_destroy (priv->running);
+	g_hash_table_destroy (priv->transfer_hosts);
+	g_hash_table_destroy (priv->hosts);
+	stm_rate_estimator_free (priv->rate);
+	priv->rate = NULL;
+	stm_handle_pool_unref (priv->handles);
+	priv->handles = NULL;
 	stm_manager_set_state_file (self, NULL);
 
 	/* Chain up to the parent class */
@@ -570,6 +1737,14 @@ stm_manager_dispose (GObject *object)
 static void
 stm_manager_finalize (GObject *object)
 {
+	StmManagerPrivate *priv = STM_MANAGER (object)->priv;
+
+	g_sequence_free (priv->row_seq);
+	g_hash_table_destroy (priv->rows);
+	g_hash_table_destroy (priv->ids);
+	g_hash_table_destroy (priv->uris);
+	g_hash_table_destroy (priv->files);
+
 	G_OBJECT_CLASS (stm_manager_parent_class)->finalize (object);
 }
 
@@ -625,6 +1800,14 @@ stm_manager_class_init (StmManagerClass *klass)
 	                                  g_cclosure_marshal_VOID__OBJECT,
 	                                  G_TYPE_NONE, 1,
 	                                  STM_TYPE_TRANSFER);
+
+	signals[HOSTS_CHANGED] = g_signal_new ("hosts-changed",
+	                                  G_TYPE_FROM_CLASS (klass),
+	                                  G_SIGNAL_RUN_LAST,
+	                                  G_STRUCT_OFFSET (StmManagerClass, hosts_changed),
+	                                  NULL, NULL,
+	                                  g_cclosure_marshal_VOID__VOID,
+	                                  G_TYPE_NONE, 0);
 	                                  
 
 	
@@ -28,6 +28,7 @@
 #include <gtk/gtktreemodel.h>
 #include "stm.h"
 #include "stm-transfer.h"
+#include "stm-host.h"
 
 
 G_BEGIN_DECLS
@@ -57,9 +58,48 @@ typedef enum {
 	STM_COLUMN_TOTAL,
 	STM_COLUMN_SPEED,
 	STM_COLUMN_PERCENT,
-	STM_COLUMN_STOCK_ID
+	STM_COLUMN_STOCK_ID,
+	STM_COLUMN_MULTIPLEXED,
+	STM_COLUMN_PRIORITY,
+	STM_COLUMN_HOST
 } StmManagerColumn;
 
+/**
+ * StmManagerPolicy:
+ *
+ * @STM_MANAGER_POLICY_FIFO: Start transfers in order they were queued
+ * @STM_MANAGER_POLICY_SHORTEST_FIRST: Start transfers with least data left first
+ *
+ * Order of starting queued transfers of the same priority.
+ */
+typedef enum {
+	STM_MANAGER_POLICY_FIFO,
+	STM_MANAGER_POLICY_SHORTEST_FIRST
+} StmManagerPolicy;
+
+/**
+ * StmManagerHostPolicy:
+ *
+ * @STM_MANAGER_HOST_POLICY_ROUND_ROBIN: Take turns between hosts
+ * @STM_MANAGER_HOST_POLICY_WEIGHTED: Prefer hosts with fewest running transfers per weight
+ *
+ * Order in which hosts get free slots, among queued transfers of the
+ * same priority.
+ */
+typedef enum {
+	STM_MANAGER_HOST_POLICY_ROUND_ROBIN,
+	STM_MANAGER_HOST_POLICY_WEIGHTED
+} StmManagerHostPolicy;
+
+/* Default limit of running transfers */
+#define STM_MANAGER_DEFAULT_MAX_ACTIVE		5
+
+/* Connections per host in multiplexing mode */
+#define STM_MANAGER_MULTIPLEX_HOST_CONNECTIONS	2
+
+/* Interval of writing state file while transfers run, in ms */
+#define STM_MANAGER_STATE_INTERVAL		10000
+
 struct _StmManager{
 	GObject		parent;
 	StmManagerPrivate	*priv;
@@ -72,6 +112,7 @@ struct _StmManagerClass
 	/* Signals */
 	void				(*transfer_added) 	(StmManager *self, StmTransfer *transfer);
 	void				(*transfer_removed)	(StmManager *self, StmTransfer *transfer);
+	void				(*hosts_changed)	(StmManager *self);
 };
 
 
@@ -89,6 +130,85 @@ stm_manager_add_transfer (StmManager *self, StmTransfer *transfer);
 void
 stm_manager_remove_transfer (StmManager *self, StmTransfer *transfer);
 
+guint
+stm_manager_get_n_transfers (StmManager *self);
+
+StmTransfer *
+stm_manager_get_nth_transfer (StmManager *self, guint n);
+
+guint
+stm_manager_get_transfer_id (StmManager *self, StmTransfer *transfer);
+
+StmTransfer *
+stm_manager_lookup_id (StmManager *self, guint id);
+
+StmTransfer *
+stm_manager_lookup_uri (StmManager *self, const gchar *uri);
+
+StmTransfer *
+stm_manager_lookup_file (StmManager *self, const gchar *file);
+
+
+StmRateEstimator *
+stm_manager_get_rate_estimator (StmManager *self);
+
+guint64
+stm_manager_get_speed (StmManager *self);
+
+void
+stm_manager_set_max_speed (StmManager *self, guint64 speed);
+
+guint64
+stm_manager_get_max_speed (StmManager *self);
+
+void
+stm_manager_set_multiplex (StmManager *self, gboolean multiplex);
+
+gboolean
+stm_manager_get_multiplex (StmManager *self);
+
+void
+stm_manager_set_network_threads (StmManager *self, guint threads);
+
+guint
+stm_manager_get_network_threads (StmManager *self);
+
+void
+stm_manager_set_max_active (StmManager *self, guint max_active);
+
+guint
+stm_manager_get_max_active (StmManager *self);
+
+void
+stm_manager_set_policy (StmManager *self, StmManagerPolicy policy);
+
+StmManagerPolicy
+stm_manager_get_policy (StmManager *self);
+
+void
+stm_manager_set_host_max_active (StmManager *self, guint max_active);
+
+guint
+stm_manager_get_host_max_active (StmManager *self);
+
+void
+stm_manager_set_host_max_connections (StmManager *self, guint max_connections);
+
+guint
+stm_manager_get_host_max_connections (StmManager *self);
+
+void
+stm_manager_set_host_policy (StmManager *self, StmManagerHostPolicy policy);
+
+StmManagerHostPolicy
+stm_manager_get_host_policy (StmManager *self);
+
+void
+stm_manager_set_host_weight (StmManager *self, const gchar *origin, guint weight);
+
+GList *
+stm_manager_get_hosts (StmManager *self);
+
 
 
 gboolean
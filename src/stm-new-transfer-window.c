@@ -23,6 +23,7 @@
 #include <gtk/gtk.h>
 #include "stm.h"
 #include "stm-new-transfer-window.h"
+#include "stm-transfer.h"
 
 
 G_DEFINE_TYPE (StmNewTransferWindow, stm_new_transfer_window, GTK_TYPE_DIALOG)
@@ -33,6 +34,7 @@ struct _StmNewTransferWindowPrivate
 	
 	GtkEntry				*source;
 	GtkFileChooserButton	*destination;
+	GtkSpinButton			*connections;
 	GtkCheckButton			*auto_start;
 
 	gboolean disposed;
@@ -68,6 +70,14 @@ stm_new_transfer_window_get_destination (StmNewTransferWindow *self)
 }
 
 
+guint
+stm_new_transfer_window_get_connections (StmNewTransferWindow *self)
+{
+	StmNewTransferWindowPrivate *priv = self->priv;
+	return (guint) gtk_spin_button_get_value_as_int (priv->connections);
+}
+
+
 gboolean
 stm_new_transfer_window_get_auto_start (StmNewTransferWindow *self)
 {
@@ -99,7 +109,7 @@ stm_new_transfer_window_ui (StmNewTransferWindow *self)
 	                  G_CALLBACK (stm_new_transfer_window_close_clicked), self);
 
 	/* Table */
-	GtkWidget *table = gtk_table_new (3, 2, FALSE);
+	GtkWidget *table = gtk_table_new (4, 2, FALSE);
 	gtk_table_set_row_spacings (GTK_TABLE (table), 6);
 	gtk_table_set_col_spacings (GTK_TABLE (table), 6);
 	gtk_container_set_border_width (GTK_CONTAINER (table), 12);
@@ -120,6 +130,13 @@ stm_new_transfer_window_ui (StmNewTransferWindow *self)
 	                  0, 1, 1, 2,
 	                  GTK_FILL, GTK_SHRINK, 0, 0);
 
+	label = gtk_label_new ("");
+	gtk_label_set_markup (GTK_LABEL (label), _("<b>Connections:</b>"));
+	gtk_misc_set_alignment (GTK_MISC (label), 1.0, 0.5);
+	gtk_table_attach (GTK_TABLE (table), label,
+	                  0, 1, 2, 3,
+	                  GTK_FILL, GTK_SHRINK, 0, 0);
+
 	/* Right column */
 	GtkWidget *entry;
 	entry = gtk_entry_new ();
@@ -135,10 +152,16 @@ stm_new_transfer_window_ui (StmNewTransferWindow *self)
 	                  GTK_FILL | GTK_EXPAND, GTK_SHRINK, 0, 0);
 	priv->destination = GTK_FILE_CHOOSER_BUTTON (entry);
 	
+	entry = gtk_spin_button_new_with_range (1, STM_TRANSFER_MAX_CONNECTIONS, 1);
+	gtk_table_attach (GTK_TABLE (table), entry,
+	                  1, 2, 2, 3,
+	                  GTK_FILL, GTK_SHRINK, 0, 0);
+	priv->connections = GTK_SPIN_BUTTON (entry);
+	
 	entry = gtk_check_button_new_with_label (_("Automatically start transfer"));
 	gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (entry), TRUE);
 	gtk_table_attach (GTK_TABLE (table), entry,
-	                  0, 2, 2, 3,
+	                  0, 2, 3, 4,
 	                  GTK_FILL | GTK_EXPAND, GTK_SHRINK, 0, 0);
 	priv->auto_start = GTK_CHECK_BUTTON (entry);
 	
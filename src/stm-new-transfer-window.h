@@ -72,6 +72,9 @@ stm_new_transfer_window_get_uri            (StmNewTransferWindow *self);
 const gchar *
 stm_new_transfer_window_get_destination    (StmNewTransferWindow *self);
 
+guint
+stm_new_transfer_window_get_connections    (StmNewTransferWindow *self);
+
 gboolean
 stm_new_transfer_window_get_auto_start     (StmNewTransferWindow *self);
 
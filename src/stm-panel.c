@@ -41,6 +41,8 @@ struct _StmPanelPrivate
 	GtkWidget	*scrolled_window;	/* Scrolled window holding tree view */
 	GtkWidget	*tree_view;			/* Transfers list */
 	GtkWidget	*search_entry;		/* Search entry */
+	GtkWidget	*max_active;		/* Limit of running transfers */
+	GtkWidget	*hosts_label;		/* Running transfers and connections per host */
 	
 	GtkTreeModel *filter;
 
@@ -57,6 +59,9 @@ stm_panel_filter_function                               (GtkTreeModel *model,
                                                          GtkTreeIter *iter,
                                                          gpointer data);
 
+static void
+stm_panel_update_hosts (StmPanel *self);
+
 
 
 GtkWidget*
@@ -78,9 +83,57 @@ stm_panel_set_manager (StmPanel *self, StmManager *manager)
 	                                        stm_panel_filter_function,
 	                                        self,
 	                                        NULL);
-	gtk_tree_view_set_model (GTK_TREE_VIEW (priv->tree_view), filter);
+	GtkTreeModel *sort = gtk_tree_model_sort_new_with_model (filter);
+	gtk_tree_view_set_model (GTK_TREE_VIEW (priv->tree_view), sort);
+	g_object_unref (sort);
 	priv->manager = g_object_ref (manager);
 	priv->filter = g_object_ref (filter);
+
+	GtkAction *action = gtk_action_group_get_action (priv->action_group, "Multiplex");
+	gtk_toggle_action_set_active (GTK_TOGGLE_ACTION (action),
+	                              stm_manager_get_multiplex (manager));
+	action = gtk_action_group_get_action (priv->action_group, "ShortestFirst");
+	gtk_toggle_action_set_active (GTK_TOGGLE_ACTION (action),
+	                              stm_manager_get_policy (manager) == STM_MANAGER_POLICY_SHORTEST_FIRST);
+	gtk_spin_button_set_value (GTK_SPIN_BUTTON (priv->max_active),
+	                           stm_manager_get_max_active (manager));
+
+	g_signal_connect_swapped (manager, "hosts-changed",
+	                          G_CALLBACK (stm_panel_update_hosts), self);
+	stm_panel_update_hosts (self);
+}
+
+
+/**
+ * stm_panel_update_hosts:
+ *
+ * Show running transfers and open connections of hosts which have
+ * any of them.
+ */
+static void
+stm_panel_update_hosts (StmPanel *self)
+{
+	StmPanelPrivate *priv = self->priv;
+
+	GString *text = g_string_new (NULL);
+	GList *hosts = stm_manager_get_hosts (priv->manager);
+	GList *node;
+	for (node = hosts; node; node = node->next) {
+		StmHost *host = node->data;
+		if (stm_host_get_active (host) == 0 && stm_host_get_connections (host) == 0)
+			continue;
+
+		if (text->len > 0)
+			g_string_append (text, "   ");
+		g_string_append_printf (text, _("%s: %u active, %u connections"),
+		                        stm_host_get_origin (host),
+		                        stm_host_get_active (host),
+		                        stm_host_get_connections (host));
+	}
+	g_list_free (hosts);
+
+	gtk_label_set_text (GTK_LABEL (priv->hosts_label), text->str);
+	g_string_free (text, TRUE);
 }
 
 static gboolean
@@ -115,6 +168,31 @@ stm_panel_search_entry_changed                         (GtkEditable *editable,
 }
 
 
+/**
+ * stm_panel_size_cell_data:
+ *
+ * Format size stored in model column given as @data, only for rows
+ * being drawn.
+ */
+static void
+stm_panel_size_cell_data                               (GtkTreeViewColumn *column,
+                                                        GtkCellRenderer *renderer,
+                                                        GtkTreeModel *model,
+                                                        GtkTreeIter *iter,
+                                                        gpointer data)
+{
+	gint model_column = GPOINTER_TO_INT (data);
+	guint64 size;
+	gchar buf[18];
+
+	gtk_tree_model_get (model, iter, model_column, &size, -1);
+	stm_format_size_buffer (size, buf, 16);
+	if (model_column == STM_COLUMN_SPEED)
+		g_strlcat (buf, "/s", 18);
+	g_object_set (G_OBJECT (renderer), "text", buf, NULL);
+}
+
+
 /*
  *  Actions
  */
@@ -162,8 +240,10 @@ _update_actions (StmPanel *self)
 	stm_panel_action_set_sensitive (self, "TransferOpenDir", state == STM_TRANSFER_STATE_FINISHED);
 	
 	stm_panel_action_set_sensitive (self, "TransferStart", state == STM_TRANSFER_STATE_STOPPED || state == STM_TRANSFER_STATE_ERROR);
-	stm_panel_action_set_sensitive (self, "TransferStop", state == STM_TRANSFER_STATE_RUNNING);
+	stm_panel_action_set_sensitive (self, "TransferStop", state == STM_TRANSFER_STATE_RUNNING || state == STM_TRANSFER_STATE_QUEUED);
 	stm_panel_action_set_sensitive (self, "TransferDelete", transfer != NULL);
+	stm_panel_action_set_sensitive (self, "TransferPriorityUp", transfer != NULL);
+	stm_panel_action_set_sensitive (self, "TransferPriorityDown", transfer != NULL);
 }
 
 static void
@@ -220,11 +300,14 @@ on_new_transfer_response                               (GtkDialog *dialog,
 	                   STM_NEW_TRANSFER_WINDOW (dialog));
 	gboolean start = stm_new_transfer_window_get_auto_start (
 	                 STM_NEW_TRANSFER_WINDOW (dialog));
+	guint connections = stm_new_transfer_window_get_connections (
+	                    STM_NEW_TRANSFER_WINDOW (dialog));
 	
 	StmTransfer *xfer = stm_transfer_new (uri, dest);
+	stm_transfer_set_connections (xfer, connections);
 	stm_manager_add_transfer (priv->manager, xfer);
 	if (start) {
-		stm_transfer_start (xfer);
+		stm_transfer_queue (xfer);
 	}
 	
 	
@@ -285,7 +368,7 @@ on_action_transfer_start (GtkAction*     action,
 {
 	StmTransfer *transfer = stm_panel_get_selected_transfer (self);
 	if (transfer) {
-		stm_transfer_start (transfer);
+		stm_transfer_queue (transfer);
 		_update_actions (self);
 	}
 }
@@ -316,6 +399,63 @@ on_action_transfer_delete (GtkAction*     action,
 }
 
 
+static void
+on_action_transfer_priority_up (GtkAction*     action,
+                                StmPanel* self)
+{
+	StmTransfer *transfer = stm_panel_get_selected_transfer (self);
+	if (transfer) {
+		stm_transfer_set_priority (transfer, stm_transfer_get_priority (transfer) + 1);
+	}
+}
+
+
+static void
+on_action_transfer_priority_down (GtkAction*     action,
+                                  StmPanel* self)
+{
+	StmTransfer *transfer = stm_panel_get_selected_transfer (self);
+	if (transfer) {
+		stm_transfer_set_priority (transfer, stm_transfer_get_priority (transfer) - 1);
+	}
+}
+
+
+static void
+on_action_shortest_first (GtkToggleAction* action,
+                          StmPanel* self)
+{
+	StmPanelPrivate *priv = self->priv;
+
+	if (priv->manager)
+		stm_manager_set_policy (priv->manager, gtk_toggle_action_get_active (action)
+		                        ? STM_MANAGER_POLICY_SHORTEST_FIRST
+		                        : STM_MANAGER_POLICY_FIFO);
+}
+
+
+static void
+on_max_active_changed (GtkSpinButton* spin,
+                       StmPanel* self)
+{
+	StmPanelPrivate *priv = self->priv;
+
+	if (priv->manager)
+		stm_manager_set_max_active (priv->manager, gtk_spin_button_get_value_as_int (spin));
+}
+
+
+static void
+on_action_multiplex (GtkToggleAction* action,
+                     StmPanel* self)
+{
+	StmPanelPrivate *priv = self->priv;
+
+	if (priv->manager)
+		stm_manager_set_multiplex (priv->manager, gtk_toggle_action_get_active (action));
+}
+
+
 /* User interface */
 
 static const GtkActionEntry entries[] = {
@@ -335,9 +475,24 @@ static const GtkActionEntry entries[] = {
 		N_("Pause transfer"), G_CALLBACK (on_action_transfer_stop) },
 	{ "TransferDelete", GTK_STOCK_DELETE, NULL, NULL,
 		N_("Delete transfer"), G_CALLBACK (on_action_transfer_delete) },
+
+	{ "TransferPriorityUp", GTK_STOCK_GO_UP, N_("Raise priority"), NULL,
+		N_("Start transfer before others in queue"), G_CALLBACK (on_action_transfer_priority_up) },
+	{ "TransferPriorityDown", GTK_STOCK_GO_DOWN, N_("Lower priority"), NULL,
+		N_("Start transfer after others in queue"), G_CALLBACK (on_action_transfer_priority_down) },
 };
 static const guint entries_n = G_N_ELEMENTS (entries);
 
+static const GtkToggleActionEntry toggle_entries[] = {
+	{ "Multiplex", GTK_STOCK_CONNECT, N_("Multiplex"), NULL,
+		N_("Share HTTP/2 connections between transfers to the same host"),
+		G_CALLBACK (on_action_multiplex), FALSE },
+	{ "ShortestFirst", GTK_STOCK_SORT_ASCENDING, N_("Shortest first"), NULL,
+		N_("Start queued transfers with least data left first"),
+		G_CALLBACK (on_action_shortest_first), FALSE },
+};
+static const guint toggle_entries_n = G_N_ELEMENTS (toggle_entries);
+
 /**
  * \brief User interface description
  **/
@@ -354,6 +509,9 @@ static const gchar *ui_markup =
 			"<toolitem action='TransferStart'/>"
 			"<toolitem action='TransferStop'/>"
 			"<toolitem action='TransferDelete'/>"
+			"<separator/>"
+			"<toolitem action='Multiplex'/>"
+			"<toolitem action='ShortestFirst'/>"
 		"</toolbar>"
 
 		/* Popup menu */
@@ -366,6 +524,9 @@ static const gchar *ui_markup =
 			"<menuitem action='TransferStart'/>"
 			"<menuitem action='TransferStop'/>"
 			"<menuitem action='TransferDelete'/>"
+			"<separator/>"
+			"<menuitem action='TransferPriorityUp'/>"
+			"<menuitem action='TransferPriorityDown'/>"
 		"</popup>"
 	"</ui>";
 
@@ -378,6 +539,7 @@ stm_panel_ui_toolbar (StmPanel *self)
 	GtkActionGroup *group = gtk_action_group_new ("StmPanel");
 //	gtk_action_group_set_translation_domain (group, GETTEXT_PACKAGE);
 	gtk_action_group_add_actions (group, entries, entries_n, self);
+	gtk_action_group_add_toggle_actions (group, toggle_entries, toggle_entries_n, self);
 	priv->ui_manager = gtk_ui_manager_new ();
 	gtk_ui_manager_insert_action_group (priv->ui_manager, group, 0);
 	gtk_ui_manager_add_ui_from_string(priv->ui_manager, ui_markup, -1, NULL);
@@ -386,6 +548,21 @@ stm_panel_ui_toolbar (StmPanel *self)
 	gtk_box_pack_start (GTK_BOX (self), priv->toolbar, FALSE, FALSE, 0);
 	priv->action_group = group;
 	
+	/* Limit of running transfers */
+	GtkToolItem *item = gtk_tool_item_new ();
+	GtkWidget *box = gtk_hbox_new (FALSE, 4);
+	GtkWidget *spin = gtk_spin_button_new_with_range (0, 999, 1);
+	gtk_widget_set_tooltip_text (spin, _("Number of transfers running at once, 0 for no limit"));
+	gtk_spin_button_set_value (GTK_SPIN_BUTTON (spin), STM_MANAGER_DEFAULT_MAX_ACTIVE);
+	g_signal_connect (G_OBJECT (spin), "value-changed",
+	                  G_CALLBACK (on_max_active_changed), self);
+	gtk_box_pack_start (GTK_BOX (box), gtk_label_new (_("Active:")), FALSE, FALSE, 0);
+	gtk_box_pack_start (GTK_BOX (box), spin, FALSE, FALSE, 0);
+	gtk_container_add (GTK_CONTAINER (item), box);
+	gtk_toolbar_insert (GTK_TOOLBAR (priv->toolbar), item, -1);
+	gtk_widget_show_all (GTK_WIDGET (item));
+	priv->max_active = spin;
+
 	/* Spacer */
 	GtkToolItem *separator = gtk_separator_tool_item_new ();
 	gtk_separator_tool_item_set_draw (GTK_SEPARATOR_TOOL_ITEM (separator), FALSE);
@@ -394,7 +571,7 @@ stm_panel_ui_toolbar (StmPanel *self)
 	gtk_widget_show (GTK_WIDGET (separator));
 	
 	/* Search entry */
-	GtkToolItem *item = gtk_tool_item_new ();
+	item = gtk_tool_item_new ();
 	GtkWidget *entry = gtk_entry_new ();
 	g_signal_connect (G_OBJECT (entry), "changed",
 	                  G_CALLBACK (stm_panel_search_entry_changed), self);
@@ -445,13 +622,19 @@ stm_panel_ui (StmPanel *self)
 	                                    renderer,
 	                                    "text",
 	                                    STM_COLUMN_FILE);
+	gtk_tree_view_column_set_sort_column_id (column, STM_COLUMN_FILE);
 	gtk_tree_view_append_column (GTK_TREE_VIEW (priv->tree_view), column);
 	
 	
 	renderer = gtk_cell_renderer_text_new ();
-	column = gtk_tree_view_column_new_with_attributes ("Downloaded", renderer,
-	                                                   "text", 3,
-	                                                   NULL);
+	column = gtk_tree_view_column_new ();
+	gtk_tree_view_column_set_title (column, "Downloaded");
+	gtk_tree_view_column_pack_start (column, renderer, TRUE);
+	gtk_tree_view_column_set_cell_data_func (column, renderer,
+	                                         stm_panel_size_cell_data,
+	                                         GINT_TO_POINTER (STM_COLUMN_DOWNLOADED),
+	                                         NULL);
+	gtk_tree_view_column_set_sort_column_id (column, STM_COLUMN_DOWNLOADED);
 	g_object_set (G_OBJECT (renderer), "alignment", PANGO_ALIGN_RIGHT,
 	                                   "xalign", 1.0f,
 	                                   NULL);
@@ -459,9 +642,14 @@ stm_panel_ui (StmPanel *self)
 	gtk_tree_view_append_column (GTK_TREE_VIEW (priv->tree_view), column);
 
 	renderer = gtk_cell_renderer_text_new ();
-	column = gtk_tree_view_column_new_with_attributes ("Total", renderer,
-	                                                   "text", 4,
-	                                                   NULL);
+	column = gtk_tree_view_column_new ();
+	gtk_tree_view_column_set_title (column, "Total");
+	gtk_tree_view_column_pack_start (column, renderer, TRUE);
+	gtk_tree_view_column_set_cell_data_func (column, renderer,
+	                                         stm_panel_size_cell_data,
+	                                         GINT_TO_POINTER (STM_COLUMN_TOTAL),
+	                                         NULL);
+	gtk_tree_view_column_set_sort_column_id (column, STM_COLUMN_TOTAL);
 	g_object_set (G_OBJECT (renderer), "alignment", PANGO_ALIGN_RIGHT,
 	                                   "xalign", 1.0f,
 	                                   NULL);
@@ -469,23 +657,57 @@ stm_panel_ui (StmPanel *self)
 
 	renderer = gtk_cell_renderer_progress_new ();
 	column = gtk_tree_view_column_new_with_attributes ("Progress", renderer,
-	                                                   "value", 6,
+	                                                   "value", STM_COLUMN_PERCENT,
 	                                                   NULL);
+	gtk_tree_view_column_set_sort_column_id (column, STM_COLUMN_PERCENT);
 	gtk_tree_view_append_column (GTK_TREE_VIEW (priv->tree_view), column);
 
 	renderer = gtk_cell_renderer_text_new ();
-	column = gtk_tree_view_column_new_with_attributes ("Speed", renderer,
-	                                                   "text", 5,
-	                                                   NULL);
+	column = gtk_tree_view_column_new ();
+	gtk_tree_view_column_set_title (column, "Speed");
+	gtk_tree_view_column_pack_start (column, renderer, TRUE);
+	gtk_tree_view_column_set_cell_data_func (column, renderer,
+	                                         stm_panel_size_cell_data,
+	                                         GINT_TO_POINTER (STM_COLUMN_SPEED),
+	                                         NULL);
+	gtk_tree_view_column_set_sort_column_id (column, STM_COLUMN_SPEED);
 	g_object_set (G_OBJECT (renderer), "alignment", PANGO_ALIGN_RIGHT,
 	                                   "xalign", 1.0f,
 	                                   NULL);
 	gtk_tree_view_append_column (GTK_TREE_VIEW (priv->tree_view), column);
 
+	renderer = gtk_cell_renderer_toggle_new ();
+	column = gtk_tree_view_column_new_with_attributes ("Multiplexed", renderer,
+	                                                   "active", STM_COLUMN_MULTIPLEXED,
+	                                                   NULL);
+	g_object_set (G_OBJECT (renderer), "activatable", FALSE, NULL);
+	gtk_tree_view_append_column (GTK_TREE_VIEW (priv->tree_view), column);
+
+	renderer = gtk_cell_renderer_text_new ();
+	column = gtk_tree_view_column_new_with_attributes ("Priority", renderer,
+	                                                   "text", STM_COLUMN_PRIORITY,
+	                                                   NULL);
+	gtk_tree_view_column_set_sort_column_id (column, STM_COLUMN_PRIORITY);
+	g_object_set (G_OBJECT (renderer), "xalign", 1.0f, NULL);
+	gtk_tree_view_append_column (GTK_TREE_VIEW (priv->tree_view), column);
+
+	renderer = gtk_cell_renderer_text_new ();
+	column = gtk_tree_view_column_new_with_attributes ("Host", renderer,
+	                                                   "text", STM_COLUMN_HOST,
+	                                                   NULL);
+	gtk_tree_view_column_set_sort_column_id (column, STM_COLUMN_HOST);
+	gtk_tree_view_append_column (GTK_TREE_VIEW (priv->tree_view), column);
+
 
 	gtk_container_add (GTK_CONTAINER (priv->scrolled_window), priv->tree_view);
 	gtk_box_pack_start (GTK_BOX (self), priv->scrolled_window, TRUE, TRUE, 0);
 
+	priv->hosts_label = gtk_label_new (NULL);
+	gtk_misc_set_alignment (GTK_MISC (priv->hosts_label), 0.0f, 0.5f);
+	gtk_label_set_ellipsize (GTK_LABEL (priv->hosts_label), PANGO_ELLIPSIZE_END);
+	gtk_box_pack_start (GTK_BOX (self), priv->hosts_label, FALSE, FALSE, 0);
+	gtk_widget_show (priv->hosts_label);
+
 	GtkTreeSelection *select;
 	select = gtk_tree_view_get_selection (GTK_TREE_VIEW (priv->tree_view));
 	gtk_tree_selection_set_mode (select, GTK_SELECTION_SINGLE);
@@ -526,8 +748,10 @@ stm_panel_dispose (GObject *object)
 	}
 	priv->disposed = TRUE;
 	
-	if (priv->manager)
+	if (priv->manager) {
+		g_signal_handlers_disconnect_by_func (priv->manager, stm_panel_update_hosts, self);
 		g_object_unref (priv->manager);
+	}
 
 
 	/* Chain up to the parent class */
@@ -23,6 +23,9 @@
 #ifndef __STM_PRIVATE_API_H__
 #define __STM_PRIVATE_API_H__
 
+#include "stm-handle-pool.h"
+#include "stm-host.h"
+
 #define BUFFER_SIZE 4096
 
 
@@ -36,4 +39,10 @@ _stm_transfer_from_xml (const gchar         *element_name,
                         const gchar        **attribute_names,
                         const gchar        **attribute_values);
 
+void
+_stm_transfer_set_handle_pool (StmTransfer *transfer, StmHandlePool *pool);
+
+void
+_stm_transfer_set_host (StmTransfer *transfer, StmHost *host);
+
 #endif
@@ -0,0 +1,314 @@
+/*
+ * Simple Transfer Manager
+ * -----------------------
+ *
+ * Copyright (C) 2008 Przemysław Sitek
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <glib-object.h>
+#include "stm-progress-scheduler.h"
+
+
+G_DEFINE_TYPE (StmProgressScheduler, stm_progress_scheduler, G_TYPE_OBJECT)
+
+/**
+ * StmProgressScheduler:
+ *
+ * Collects transfers whose progress has changed and notifies
+ * observers about all of them at once, at most "rate" times per
+ * second. The timer runs only while there is something to report.
+ */
+struct _StmProgressSchedulerPrivate
+{
+	/* Private members go here */
+	GHashTable	*dirty;		// Set of changed transfers, holds references
+	guint		 rate;		// Flushes per second
+	guint		 flush_id;	// ID of flush timeout, 0 when idle
+
+	gboolean disposed;
+};
+
+
+#define STM_PROGRESS_SCHEDULER_GET_PRIVATE(obj) \
+	(G_TYPE_INSTANCE_GET_PRIVATE ((obj), \
+	STM_TYPE_PROGRESS_SCHEDULER, StmProgressSchedulerPrivate))
+
+
+/* Properties */
+enum {
+	PROP_0,
+
+	PROP_RATE
+};
+
+
+/* Signals */
+enum {
+	FLUSH,
+
+	LAST_SIGNAL
+};
+
+static guint signals[LAST_SIGNAL];
+
+
+/**
+ * stm_progress_scheduler_get_default:
+ *
+ * Get the scheduler used by all transfers.
+ *
+ * Returns: A #StmProgressScheduler owned by STM.
+ */
+StmProgressScheduler *
+stm_progress_scheduler_get_default (void)
+{
+	static StmProgressScheduler *scheduler = NULL;
+
+	if (scheduler == NULL)
+		scheduler = g_object_new (STM_TYPE_PROGRESS_SCHEDULER, NULL);
+	return scheduler;
+}
+
+
+/**
+ * stm_progress_scheduler_timeout:
+ *
+ * Timeout callback flushing pending updates.
+ */
+static gboolean
+stm_progress_scheduler_timeout (StmProgressScheduler *self)
+{
+	self->priv->flush_id = 0;
+	stm_progress_scheduler_flush (self);
+	return FALSE;
+}
+
+
+/**
+ * stm_progress_scheduler_mark_dirty:
+ *
+ * @self: A #StmProgressScheduler
+ * @transfer: A #StmTransfer
+ *
+ * Schedule a progress update of @transfer. Marking a transfer
+ * several times before next flush results in one update.
+ */
+void
+stm_progress_scheduler_mark_dirty (StmProgressScheduler *self,
+                                   StmTransfer *transfer)
+{
+	StmProgressSchedulerPrivate *priv = self->priv;
+
+	if (g_hash_table_lookup (priv->dirty, transfer) == NULL)
+		g_hash_table_insert (priv->dirty, g_object_ref (transfer), transfer);
+
+	if (priv->flush_id == 0)
+		priv->flush_id = g_timeout_add (1000 / priv->rate,
+		                                (GSourceFunc) stm_progress_scheduler_timeout,
+		                                self);
+}
+
+
+/**
+ * stm_progress_scheduler_flush:
+ *
+ * @self: A #StmProgressScheduler
+ *
+ * Deliver pending updates now. "progress" signal is emitted on every
+ * changed transfer, followed by one "flush" signal carrying all of
+ * them.
+ */
+void
+stm_progress_scheduler_flush (StmProgressScheduler *self)
+{
+	StmProgressSchedulerPrivate *priv = self->priv;
+
+	if (priv->flush_id) {
+		g_source_remove (priv->flush_id);
+		priv->flush_id = 0;
+	}
+	if (g_hash_table_size (priv->dirty) == 0)
+		return;
+
+	/* Handlers may mark transfers dirty again */
+	GPtrArray *transfers = g_ptr_array_sized_new (g_hash_table_size (priv->dirty));
+	GHashTableIter iter;
+	gpointer key;
+	g_hash_table_iter_init (&iter, priv->dirty);
+	while (g_hash_table_iter_next (&iter, &key, NULL)) {
+		g_ptr_array_add (transfers, key);
+		g_hash_table_iter_steal (&iter);
+	}
+
+	guint i;
+	for (i = 0; i < transfers->len; i++) {
+		g_signal_emit_by_name (transfers->pdata[i], "progress");
+	}
+	g_signal_emit (self, signals[FLUSH], 0, transfers);
+
+	for (i = 0; i < transfers->len; i++) {
+		g_object_unref (transfers->pdata[i]);
+	}
+	g_ptr_array_free (transfers, TRUE);
+}
+
+
+/**
+ * stm_progress_scheduler_set_rate:
+ *
+ * @self: A #StmProgressScheduler
+ * @rate: Number of flushes per second
+ *
+ * Set how often observers are notified.
+ */
+void
+stm_progress_scheduler_set_rate (StmProgressScheduler *self, guint rate)
+{
+	StmProgressSchedulerPrivate *priv = self->priv;
+
+	priv->rate = CLAMP (rate, 1, 100);
+	g_object_notify (G_OBJECT (self), "rate");
+}
+
+
+/**
+ * stm_progress_scheduler_get_rate:
+ *
+ * @self: A #StmProgressScheduler
+ *
+ * Returns: Number of flushes per second.
+ */
+guint
+stm_progress_scheduler_get_rate (StmProgressScheduler *self)
+{
+	return self->priv->rate;
+}
+
+/* GObject implementation */
+
+static void
+stm_progress_scheduler_init (StmProgressScheduler *self)
+{
+	self->priv = STM_PROGRESS_SCHEDULER_GET_PRIVATE (self);
+	StmProgressSchedulerPrivate *priv = self->priv;
+
+	priv->dirty = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+	                                     g_object_unref, NULL);
+	priv->rate = STM_PROGRESS_SCHEDULER_DEFAULT_RATE;
+	priv->flush_id = 0;
+
+	priv->disposed = FALSE;
+}
+
+
+static void
+stm_progress_scheduler_dispose (GObject *object)
+{
+	StmProgressScheduler *self = (StmProgressScheduler*) object;
+	StmProgressSchedulerPrivate *priv = self->priv;
+
+	/* Make sure dispose is called only once */
+	if (priv->disposed) {
+		return;
+	}
+	priv->disposed = TRUE;
+
+	if (priv->flush_id) {
+		g_source_remove (priv->flush_id);
+		priv->flush_id = 0;
+	}
+	g_hash_table_destroy (priv->dirty);
+
+	/* Chain up to the parent class */
+	G_OBJECT_CLASS (stm_progress_scheduler_parent_class)->dispose (object);
+}
+
+
+static void
+stm_progress_scheduler_finalize (GObject *object)
+{
+	G_OBJECT_CLASS (stm_progress_scheduler_parent_class)->finalize (object);
+}
+
+
+static void
+stm_progress_scheduler_get_property (GObject *object, guint property_id,
+                                     GValue *value, GParamSpec *pspec)
+{
+	StmProgressScheduler *self = STM_PROGRESS_SCHEDULER (object);
+
+	switch (property_id) {
+		case PROP_RATE:
+			g_value_set_uint (value, self->priv->rate);
+			break;
+		default:
+			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+	}
+}
+
+
+static void
+stm_progress_scheduler_set_property (GObject *object, guint property_id,
+                                     const GValue *value, GParamSpec *pspec)
+{
+	StmProgressScheduler *self = STM_PROGRESS_SCHEDULER (object);
+
+	switch (property_id) {
+		case PROP_RATE:
+			stm_progress_scheduler_set_rate (self, g_value_get_uint (value));
+			break;
+		default:
+			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+	}
+}
+
+
+static void
+stm_progress_scheduler_class_init (StmProgressSchedulerClass *klass)
+{
+	GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+	gobject_class->get_property = stm_progress_scheduler_get_property;
+	gobject_class->set_property = stm_progress_scheduler_set_property;
+	gobject_class->dispose = stm_progress_scheduler_dispose;
+	gobject_class->finalize = stm_progress_scheduler_finalize;
+
+	g_type_class_add_private (klass, sizeof (StmProgressSchedulerPrivate));
+
+	/* Signals */
+	signals[FLUSH] = g_signal_new ("flush",
+	                               G_TYPE_FROM_CLASS (klass),
+	                               G_SIGNAL_RUN_LAST,
+	                               G_STRUCT_OFFSET (StmProgressSchedulerClass, flush),
+	                               NULL, NULL,
+	                               g_cclosure_marshal_VOID__POINTER,
+	                               G_TYPE_NONE, 1,
+	                               G_TYPE_POINTER);
+
+	/* Properties */
+	g_object_class_install_property (gobject_class,
+	                                 PROP_RATE,
+	                                 g_param_spec_uint (
+	                                 "rate",
+	                                 "Rate",
+	                                 "Number of progress updates per second",
+	                                 1,				/* min */
+	                                 100,				/* max */
+	                                 STM_PROGRESS_SCHEDULER_DEFAULT_RATE,	/* default */
+	                                 G_PARAM_READWRITE));
+}
@@ -0,0 +1,92 @@
+/*
+ * Simple Transfer Manager
+ * -----------------------
+ *
+ * Copyright (C) 2008 Przemysław Sitek
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __STM_PROGRESS_SCHEDULER_H__
+#define __STM_PROGRESS_SCHEDULER_H__
+
+/* Includes here */
+#include <glib-object.h>
+#include "stm-transfer.h"
+
+
+G_BEGIN_DECLS
+
+#define STM_TYPE_PROGRESS_SCHEDULER \
+	(stm_progress_scheduler_get_type ())
+#define STM_PROGRESS_SCHEDULER(obj) \
+	(G_TYPE_CHECK_INSTANCE_CAST ((obj), STM_TYPE_PROGRESS_SCHEDULER, StmProgressScheduler))
+#define STM_PROGRESS_SCHEDULER_CLASS(klass) \
+	(G_TYPE_CHECK_CLASS_CAST ((klass), STM_TYPE_PROGRESS_SCHEDULER, StmProgressSchedulerClass))
+#define STM_IS_PROGRESS_SCHEDULER(obj) \
+	(G_TYPE_CHECK_INSTANCE_TYPE ((obj), STM_TYPE_PROGRESS_SCHEDULER))
+#define STM_PROGRESS_SCHEDULER_GET_CLASS(obj) \
+	(G_TYPE_INSTANCE_GET_CLASS ((obj), STM_TYPE_PROGRESS_SCHEDULER, StmProgressSchedulerClass))
+
+/* Default number of flushes per second */
+#define STM_PROGRESS_SCHEDULER_DEFAULT_RATE	5
+
+
+typedef struct _StmProgressScheduler		StmProgressScheduler;
+typedef struct _StmProgressSchedulerPrivate	StmProgressSchedulerPrivate;
+typedef struct _StmProgressSchedulerClass	StmProgressSchedulerClass;
+
+struct _StmProgressScheduler{
+	GObject		parent;
+	StmProgressSchedulerPrivate	*priv;
+};
+
+struct _StmProgressSchedulerClass
+{
+	GObjectClass		parent;
+
+	/* Signals */
+	void				(*flush)	(StmProgressScheduler *self,
+							 GPtrArray *transfers);
+};
+
+
+GType
+stm_progress_scheduler_get_type			(void);
+
+StmProgressScheduler *
+stm_progress_scheduler_get_default		(void);
+
+
+void
+stm_progress_scheduler_mark_dirty		(StmProgressScheduler *self,
+						 StmTransfer *transfer);
+
+void
+stm_progress_scheduler_flush			(StmProgressScheduler *self);
+
+
+void
+stm_progress_scheduler_set_rate			(StmProgressScheduler *self,
+						 guint rate);
+
+guint
+stm_progress_scheduler_get_rate			(StmProgressScheduler *self);
+
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,474 @@
+/*
+ * Simple Transfer Manager
+ * -----------------------
+ *
+ * Copyright (C) 2008 Przemysław Sitek
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+#define _FILE_OFFSET_BITS 64
+
+#include <glib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "stm-range-map.h"
+
+
+#define STM_RANGE_MAP_MAGIC		"STMRMAP"
+#define STM_RANGE_MAP_VERSION		1
+
+
+/**
+ * StmRangeMapHeader:
+ *
+ * On-disk header of a range map file. It is followed by a bitmap
+ * with one bit per block, stored as 32-bit words in host byte order.
+ */
+typedef struct _StmRangeMapHeader StmRangeMapHeader;
+struct _StmRangeMapHeader
+{
+	gchar		 magic[8];
+	guint32		 version;
+	guint32		 block_size;
+	guint64		 length;	// Length of described file
+};
+
+
+/**
+ * StmRangeMap:
+ *
+ * Record of blocks of a partial file which have been written, kept in
+ * a sidecar file next to it. The sidecar is mapped in memory, so
+ * marking a block costs one atomic operation, and survives a crash of
+ * the process.
+ *
+ * Writes rarely line up with blocks, so pieces of partly written
+ * blocks are remembered in memory until adjacent writes complete them.
+ *
+ * stm_range_map_mark() may be called from any thread.
+ */
+struct _StmRangeMap
+{
+	int		 fd;
+	gchar		*file;		// Sidecar file name
+	StmRangeMapHeader *header;	// Start of mapping
+	gsize		 size;		// Size of mapping
+	guint32		*bits;		// Bitmap of written blocks
+	guint64		 n_blocks;
+	GMutex		 mutex;		// Guards partial
+	GArray		*partial;	// StmRange's in blocks not marked yet
+};
+
+
+/**
+ * stm_range_map_file_name:
+ *
+ * Returns: Name of sidecar file of @file. Free with g_free().
+ */
+static gchar *
+stm_range_map_file_name (const gchar *file)
+{
+	return g_strconcat (file, STM_RANGE_MAP_SUFFIX, NULL);
+}
+
+
+/**
+ * stm_range_map_open:
+ *
+ * @file: Name of the partial file, not of the sidecar
+ * @length: Final length of @file
+ * @error: Return location for error
+ *
+ * Open range map of @file, creating it if it does not exist. A map
+ * left by a download of different length is discarded.
+ *
+ * Returns: A new #StmRangeMap, or NULL on failure. Free with
+ * stm_range_map_close().
+ */
+StmRangeMap *
+stm_range_map_open (const gchar *file, guint64 length, GError **error)
+{
+	g_return_val_if_fail (length > 0, NULL);
+
+	gchar *name = stm_range_map_file_name (file);
+	int fd = open (name, O_RDWR | O_CREAT, 0666);
+	if (fd < 0) {
+		int saved_errno = errno;
+		g_set_error (error, G_FILE_ERROR,
+		             g_file_error_from_errno (saved_errno),
+		             "Unable to open %s: %s",
+		             name, g_strerror (saved_errno));
+		g_free (name);
+		return NULL;
+	}
+
+	guint64 n_blocks = (length + STM_RANGE_MAP_BLOCK_SIZE - 1) / STM_RANGE_MAP_BLOCK_SIZE;
+	gsize size = sizeof (StmRangeMapHeader) + (n_blocks + 31) / 32 * sizeof (guint32);
+
+	/* Reuse existing map only if it describes the same download */
+	StmRangeMapHeader header;
+	gboolean valid = pread (fd, &header, sizeof (header), 0) == sizeof (header)
+	                 && memcmp (header.magic, STM_RANGE_MAP_MAGIC, sizeof (STM_RANGE_MAP_MAGIC)) == 0
+	                 && header.version == STM_RANGE_MAP_VERSION
+	                 && header.block_size == STM_RANGE_MAP_BLOCK_SIZE
+	                 && header.length == length;
+
+	if (! valid) {
+		memset (&header, 0, sizeof (header));
+		memcpy (header.magic, STM_RANGE_MAP_MAGIC, sizeof (STM_RANGE_MAP_MAGIC));
+		header.version = STM_RANGE_MAP_VERSION;
+		header.block_size = STM_RANGE_MAP_BLOCK_SIZE;
+		header.length = length;
+
+		/* Truncating first clears the bitmap */
+		if (ftruncate (fd, 0) < 0 || ftruncate (fd, size) < 0
+		    || pwrite (fd, &header, sizeof (header), 0) != sizeof (header))
+			goto fail;
+	}
+
+	void *mem = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (mem == MAP_FAILED)
+		goto fail;
+
+	StmRangeMap *map = g_new0 (StmRangeMap, 1);
+	map->fd = fd;
+	map->file = name;
+	map->header = mem;
+	map->size = size;
+	map->bits = (guint32 *) (map->header + 1);
+	map->n_blocks = n_blocks;
+	g_mutex_init (&map->mutex);
+	map->partial = g_array_new (FALSE, FALSE, sizeof (StmRange));
+	return map;
+
+fail: {
+		int saved_errno = errno;
+		g_set_error (error, G_FILE_ERROR,
+		             g_file_error_from_errno (saved_errno),
+		             "Unable to set up %s: %s",
+		             name, g_strerror (saved_errno));
+		close (fd);
+		g_free (name);
+		return NULL;
+	}
+}
+
+
+/**
+ * stm_range_map_close:
+ *
+ * @map: A #StmRangeMap
+ *
+ * Write out and free a range map. Sidecar file is kept.
+ */
+void
+stm_range_map_close (StmRangeMap *map)
+{
+	msync (map->header, map->size, MS_ASYNC);
+	munmap (map->header, map->size);
+	close (map->fd);
+	g_mutex_clear (&map->mutex);
+	g_array_free (map->partial, TRUE);
+	g_free (map->file);
+	g_free (map);
+}
+
+
+/**
+ * stm_range_map_exists:
+ *
+ * @file: Name of the partial file
+ *
+ * Returns: TRUE if @file has a sidecar range map.
+ */
+gboolean
+stm_range_map_exists (const gchar *file)
+{
+	gchar *name = stm_range_map_file_name (file);
+	gboolean exists = g_file_test (name, G_FILE_TEST_IS_REGULAR);
+	g_free (name);
+	return exists;
+}
+
+
+/**
+ * stm_range_map_remove:
+ *
+ * @file: Name of the partial file
+ *
+ * Delete sidecar range map of @file, if there is one.
+ */
+void
+stm_range_map_remove (const gchar *file)
+{
+	gchar *name = stm_range_map_file_name (file);
+	if (unlink (name) < 0 && errno != ENOENT)
+		g_printerr ("Unable to remove %s: %s\n", name, g_strerror (errno));
+	g_free (name);
+}
+
+
+/**
+ * stm_range_map_get_length:
+ *
+ * @map: A #StmRangeMap
+ *
+ * Returns: Length of file described by @map.
+ */
+guint64
+stm_range_map_get_length (StmRangeMap *map)
+{
+	return map->header->length;
+}
+
+
+/**
+ * stm_range_map_mark:
+ *
+ * @map: A #StmRangeMap
+ * @offset: Start of written range
+ * @len: Length of written range
+ *
+ * Record that a range has been written. The range is joined with
+ * pieces of earlier ranges it touches, and blocks covered completely
+ * are marked, the last block of the file being complete at its end.
+ * Pieces of blocks left uncovered are kept for later calls.
+ */
+void
+stm_range_map_mark (StmRangeMap *map, guint64 offset, guint64 len)
+{
+	guint64 length = map->header->length;
+	guint64 end = MIN (offset + len, length);
+
+	if (offset >= end)
+		return;
+
+	g_mutex_lock (&map->mutex);
+
+	/* Growing range may reach pieces passed over already, start again */
+	guint i = 0;
+	while (i < map->partial->len) {
+		StmRange *piece = &g_array_index (map->partial, StmRange, i);
+		if (piece->start <= end && piece->end >= offset) {
+			offset = MIN (offset, piece->start);
+			end = MAX (end, piece->end);
+			g_array_remove_index_fast (map->partial, i);
+			i = 0;
+		} else {
+			i++;
+		}
+	}
+
+	guint64 first = (offset + STM_RANGE_MAP_BLOCK_SIZE - 1) / STM_RANGE_MAP_BLOCK_SIZE;
+	guint64 last = (end == length) ? map->n_blocks : end / STM_RANGE_MAP_BLOCK_SIZE;
+
+	guint64 block;
+	for (block = first; block < last; block++) {
+		g_atomic_int_or (&map->bits[block / 32], 1u << (block % 32));
+	}
+
+	/* Remember what is left of partly written blocks at both ends */
+	StmRange head = { offset, MIN (first * STM_RANGE_MAP_BLOCK_SIZE, end) };
+	StmRange tail = { MAX (last * STM_RANGE_MAP_BLOCK_SIZE, offset), end };
+	if (first >= last) {
+		/* Range lies within one block */
+		head.end = end;
+		tail.start = end;
+	}
+	if (head.start < head.end)
+		g_array_append_val (map->partial, head);
+	if (tail.start < tail.end)
+		g_array_append_val (map->partial, tail);
+
+	g_mutex_unlock (&map->mutex);
+}
+
+
+/**
+ * stm_range_map_is_set:
+ *
+ * Returns: TRUE if block has been written.
+ */
+static gboolean
+stm_range_map_is_set (StmRangeMap *map, guint64 block)
+{
+	guint32 word = g_atomic_int_get ((gint *) &map->bits[block / 32]);
+	return (word >> (block % 32)) & 1;
+}
+
+
+/**
+ * stm_range_map_block_size:
+ *
+ * Returns: Size of given block; last block may be shorter.
+ */
+static guint64
+stm_range_map_block_size (StmRangeMap *map, guint64 block)
+{
+	guint64 start = block * STM_RANGE_MAP_BLOCK_SIZE;
+	return MIN (STM_RANGE_MAP_BLOCK_SIZE, map->header->length - start);
+}
+
+
+/**
+ * stm_range_map_unmark:
+ *
+ * @map: A #StmRangeMap
+ * @offset: Start of range
+ * @len: Length of range
+ *
+ * Record that a range has to be written again. Every block touching
+ * the range is cleared. Parts of those blocks outside the range stay
+ * on disk, so they are kept as pieces to be joined with the rewrite.
+ */
+void
+stm_range_map_unmark (StmRangeMap *map, guint64 offset, guint64 len)
+{
+	guint64 length = map->header->length;
+	guint64 end = MIN (offset + len, length);
+
+	if (offset >= end)
+		return;
+
+	guint64 first = offset / STM_RANGE_MAP_BLOCK_SIZE;
+	guint64 last = (end + STM_RANGE_MAP_BLOCK_SIZE - 1) / STM_RANGE_MAP_BLOCK_SIZE;
+
+	g_mutex_lock (&map->mutex);
+
+	/* Cut range out of pieces */
+	guint i = 0;
+	while (i < map->partial->len) {
+		StmRange piece = g_array_index (map->partial, StmRange, i);
+		if (piece.start >= end || piece.end <= offset) {
+			i++;
+			continue;
+		}
+		g_array_remove_index_fast (map->partial, i);
+		if (piece.start < offset) {
+			StmRange left = { piece.start, offset };
+			g_array_append_val (map->partial, left);
+		}
+		if (piece.end > end) {
+			StmRange right = { end, piece.end };
+			g_array_append_val (map->partial, right);
+		}
+	}
+
+	guint64 start = first * STM_RANGE_MAP_BLOCK_SIZE;
+	if (start < offset && stm_range_map_is_set (map, first)) {
+		StmRange left = { start, offset };
+		g_array_append_val (map->partial, left);
+	}
+	guint64 stop = MIN (last * STM_RANGE_MAP_BLOCK_SIZE, length);
+	if (stop > end && stm_range_map_is_set (map, last - 1)) {
+		StmRange right = { end, stop };
+		g_array_append_val (map->partial, right);
+	}
+
+	guint64 block;
+	for (block = first; block < last; block++) {
+		g_atomic_int_and (&map->bits[block / 32], ~(1u << (block % 32)));
+	}
+
+	g_mutex_unlock (&map->mutex);
+}
+
+
+/**
+ * stm_range_map_is_marked:
+ *
+ * @map: A #StmRangeMap
+ * @offset: Start of range
+ * @len: Length of range
+ *
+ * Returns: TRUE if every block touching the range has been written.
+ */
+gboolean
+stm_range_map_is_marked (StmRangeMap *map, guint64 offset, guint64 len)
+{
+	guint64 length = map->header->length;
+	guint64 end = MIN (offset + len, length);
+
+	if (offset >= end)
+		return TRUE;
+
+	guint64 block = offset / STM_RANGE_MAP_BLOCK_SIZE;
+	guint64 last = (end + STM_RANGE_MAP_BLOCK_SIZE - 1) / STM_RANGE_MAP_BLOCK_SIZE;
+
+	for (; block < last; block++) {
+		if (! stm_range_map_is_set (map, block))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+
+/**
+ * stm_range_map_count:
+ *
+ * @map: A #StmRangeMap
+ *
+ * Returns: Number of bytes recorded as written.
+ */
+guint64
+stm_range_map_count (StmRangeMap *map)
+{
+	guint64 count = 0;
+	guint64 block;
+	for (block = 0; block < map->n_blocks; block++) {
+		if (stm_range_map_is_set (map, block))
+			count += stm_range_map_block_size (map, block);
+	}
+	return count;
+}
+
+
+/**
+ * stm_range_map_get_missing:
+ *
+ * @map: A #StmRangeMap
+ *
+ * Find ranges of file which have not been written yet. Ranges are
+ * aligned to blocks and sorted.
+ *
+ * Returns: A #GArray of #StmRange. Free with g_array_free().
+ */
+GArray *
+stm_range_map_get_missing (StmRangeMap *map)
+{
+	GArray *ranges = g_array_new (FALSE, FALSE, sizeof (StmRange));
+
+	guint64 block = 0;
+	while (block < map->n_blocks) {
+		if (stm_range_map_is_set (map, block)) {
+			block++;
+			continue;
+		}
+
+		StmRange range;
+		range.start = block * STM_RANGE_MAP_BLOCK_SIZE;
+		while (block < map->n_blocks && ! stm_range_map_is_set (map, block))
+			block++;
+		range.end = MIN (block * STM_RANGE_MAP_BLOCK_SIZE, map->header->length);
+		g_array_append_val (ranges, range);
+	}
+	return ranges;
+}
@@ -0,0 +1,92 @@
+/*
+ * Simple Transfer Manager
+ * -----------------------
+ *
+ * Copyright (C) 2008 Przemysław Sitek
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __STM_RANGE_MAP_H__
+#define __STM_RANGE_MAP_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Granularity of range map, in bytes */
+#define STM_RANGE_MAP_BLOCK_SIZE	(64 * 1024)
+
+/* Suffix appended to file name to get range map file name */
+#define STM_RANGE_MAP_SUFFIX		".stm"
+
+
+typedef struct _StmRangeMap		StmRangeMap;
+
+/**
+ * StmRange:
+ *
+ * A byte range, @end is exclusive.
+ */
+typedef struct _StmRange		StmRange;
+struct _StmRange
+{
+	guint64		 start;
+	guint64		 end;
+};
+
+
+StmRangeMap *
+stm_range_map_open				(const gchar *file,
+						 guint64 length,
+						 GError **error);
+
+void
+stm_range_map_close				(StmRangeMap *map);
+
+gboolean
+stm_range_map_exists				(const gchar *file);
+
+void
+stm_range_map_remove				(const gchar *file);
+
+guint64
+stm_range_map_get_length			(StmRangeMap *map);
+
+void
+stm_range_map_mark				(StmRangeMap *map,
+						 guint64 offset,
+						 guint64 len);
+
+void
+stm_range_map_unmark				(StmRangeMap *map,
+						 guint64 offset,
+						 guint64 len);
+
+gboolean
+stm_range_map_is_marked				(StmRangeMap *map,
+						 guint64 offset,
+						 guint64 len);
+
+guint64
+stm_range_map_count				(StmRangeMap *map);
+
+GArray *
+stm_range_map_get_missing			(StmRangeMap *map);
+
+G_END_DECLS
+
+#endif
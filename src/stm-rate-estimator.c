@@ -0,0 +1,294 @@
+/*
+ * Simple Transfer Manager
+ * -----------------------
+ *
+ * Copyright (C) 2008 Przemysław Sitek
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <glib.h>
+#include <math.h>
+#include "stm-rate-estimator.h"
+
+
+typedef struct _StmRateSample StmRateSample;
+struct _StmRateSample
+{
+	gdouble		 time;		// Seconds
+	guint64		 total;		// Bytes received up to time
+};
+
+
+/**
+ * StmRateEstimator:
+ *
+ * Measures transfer rate from a ring buffer of timestamped byte
+ * counters. Samples are merged into slots of
+ * #STM_RATE_ESTIMATOR_SLOT seconds, so adding data costs the same
+ * however often it arrives. Rates are measured up to the moment of
+ * query, so they fall to zero when data stops arriving.
+ *
+ * Data added to an estimator is also added to its parent, which lets
+ * one estimator cover many transfers.
+ */
+struct _StmRateEstimator
+{
+	StmRateSample	 samples[STM_RATE_ESTIMATOR_SLOTS];
+	guint		 head;		// Index of newest sample
+	guint		 n_samples;
+	guint64		 total;		// Bytes added so far
+	gdouble		 start;		// Time of first sample
+	gdouble		 window;	// Window of windowed rate, seconds
+	gdouble		 ewma;		// Average rate as of newest sample
+	StmRateEstimator *parent;
+};
+
+
+/**
+ * stm_rate_estimator_now:
+ *
+ * Returns: Monotonic time in seconds.
+ */
+static gdouble
+stm_rate_estimator_now (void)
+{
+	return g_get_monotonic_time () / 1e6;
+}
+
+
+/**
+ * stm_rate_estimator_new:
+ *
+ * Returns: A new #StmRateEstimator. Free with
+ * stm_rate_estimator_free().
+ */
+StmRateEstimator *
+stm_rate_estimator_new (void)
+{
+	StmRateEstimator *est = g_new0 (StmRateEstimator, 1);
+	est->window = STM_RATE_ESTIMATOR_DEFAULT_WINDOW;
+	return est;
+}
+
+
+/**
+ * stm_rate_estimator_free:
+ *
+ * @est: A #StmRateEstimator
+ */
+void
+stm_rate_estimator_free (StmRateEstimator *est)
+{
+	g_free (est);
+}
+
+
+/**
+ * stm_rate_estimator_reset:
+ *
+ * @est: A #StmRateEstimator
+ *
+ * Forget all samples, for example when a transfer is restarted.
+ */
+void
+stm_rate_estimator_reset (StmRateEstimator *est)
+{
+	est->head = 0;
+	est->n_samples = 0;
+	est->total = 0;
+	est->ewma = 0.0;
+}
+
+
+/**
+ * stm_rate_estimator_set_parent:
+ *
+ * @est: A #StmRateEstimator
+ * @parent: Estimator to forward data to, or NULL
+ */
+void
+stm_rate_estimator_set_parent (StmRateEstimator *est, StmRateEstimator *parent)
+{
+	est->parent = parent;
+}
+
+
+/**
+ * stm_rate_estimator_set_window:
+ *
+ * @est: A #StmRateEstimator
+ * @window: Length of window in seconds
+ *
+ * Set window of stm_rate_estimator_get_windowed(). It can't be longer
+ * than the ring buffer covers.
+ */
+void
+stm_rate_estimator_set_window (StmRateEstimator *est, gdouble window)
+{
+	est->window = CLAMP (window, STM_RATE_ESTIMATOR_SLOT,
+	                     STM_RATE_ESTIMATOR_SLOT * (STM_RATE_ESTIMATOR_SLOTS - 1));
+}
+
+
+/**
+ * stm_rate_estimator_add:
+ *
+ * @est: A #StmRateEstimator
+ * @bytes: Number of bytes received just now
+ */
+void
+stm_rate_estimator_add (StmRateEstimator *est, guint64 bytes)
+{
+	gdouble now = stm_rate_estimator_now ();
+	StmRateSample *newest = &est->samples[est->head];
+
+	if (est->n_samples == 0) {
+		/* Rate is measured from the first data on */
+		newest->time = now;
+		newest->total = est->total;
+		est->n_samples = 1;
+		est->start = now;
+	} else if (now - newest->time >= STM_RATE_ESTIMATOR_SLOT) {
+		/* Close current slot and fold its rate into the average */
+		gdouble dt = now - newest->time;
+		gdouble rate = (est->total - newest->total) / dt;
+		est->ewma += (1.0 - exp (-dt / STM_RATE_ESTIMATOR_EWMA_TAU)) * (rate - est->ewma);
+
+		est->head = (est->head + 1) % STM_RATE_ESTIMATOR_SLOTS;
+		est->n_samples = MIN (est->n_samples + 1, STM_RATE_ESTIMATOR_SLOTS);
+		newest = &est->samples[est->head];
+		newest->time = now;
+		newest->total = est->total;
+	}
+	est->total += bytes;
+
+	if (est->parent)
+		stm_rate_estimator_add (est->parent, bytes);
+}
+
+
+/**
+ * stm_rate_estimator_get_rate:
+ *
+ * Measure rate over last @span seconds.
+ */
+static gdouble
+stm_rate_estimator_get_rate (StmRateEstimator *est, gdouble span)
+{
+	if (est->n_samples == 0)
+		return 0.0;
+
+	gdouble now = stm_rate_estimator_now ();
+
+	/* Find oldest sample within span */
+	StmRateSample *base = NULL;
+	guint i;
+	for (i = 0; i < est->n_samples; i++) {
+		guint index = (est->head + STM_RATE_ESTIMATOR_SLOTS - i) % STM_RATE_ESTIMATOR_SLOTS;
+		StmRateSample *sample = &est->samples[index];
+		if (now - sample->time > span)
+			break;
+		base = sample;
+	}
+	if (base == NULL)
+		return 0.0;
+
+	/* Avoid spikes right after the first sample */
+	gdouble dt = MAX (now - base->time, STM_RATE_ESTIMATOR_SLOT);
+	return (est->total - base->total) / dt;
+}
+
+
+/**
+ * stm_rate_estimator_get_instant:
+ *
+ * @est: A #StmRateEstimator
+ *
+ * Returns: Rate over last second, in bytes per second.
+ */
+gdouble
+stm_rate_estimator_get_instant (StmRateEstimator *est)
+{
+	return stm_rate_estimator_get_rate (est, STM_RATE_ESTIMATOR_INSTANT_WINDOW);
+}
+
+
+/**
+ * stm_rate_estimator_get_windowed:
+ *
+ * @est: A #StmRateEstimator
+ *
+ * Returns: Rate over the window set with
+ * stm_rate_estimator_set_window(), in bytes per second.
+ */
+gdouble
+stm_rate_estimator_get_windowed (StmRateEstimator *est)
+{
+	return stm_rate_estimator_get_rate (est, est->window);
+}
+
+
+/**
+ * stm_rate_estimator_get_ewma:
+ *
+ * @est: A #StmRateEstimator
+ *
+ * Get exponentially weighted moving average of rate. If no data has
+ * arrived recently, the average decays as if zero samples were added.
+ *
+ * Returns: Average rate, in bytes per second.
+ */
+gdouble
+stm_rate_estimator_get_ewma (StmRateEstimator *est)
+{
+	if (est->n_samples == 0)
+		return 0.0;
+
+	gdouble idle = stm_rate_estimator_now () - est->samples[est->head].time;
+	if (idle <= STM_RATE_ESTIMATOR_SLOT)
+		return est->ewma;
+	return est->ewma * exp (-idle / STM_RATE_ESTIMATOR_EWMA_TAU);
+}
+
+
+/**
+ * stm_rate_estimator_get_eta:
+ *
+ * @est: A #StmRateEstimator
+ * @remaining: Number of bytes left
+ *
+ * Estimate time needed to receive @remaining bytes at average rate.
+ *
+ * Returns: Number of seconds, or -1 if rate is unknown.
+ */
+gint64
+stm_rate_estimator_get_eta (StmRateEstimator *est, guint64 remaining)
+{
+	if (est->n_samples == 0)
+		return -1;
+
+	/* Average needs a few time constants to warm up */
+	gdouble rate;
+	if (stm_rate_estimator_now () - est->start < STM_RATE_ESTIMATOR_EWMA_TAU)
+		rate = stm_rate_estimator_get_windowed (est);
+	else
+		rate = stm_rate_estimator_get_ewma (est);
+	if (rate < 1.0)
+		return -1;
+
+	return (gint64) (remaining / rate);
+}
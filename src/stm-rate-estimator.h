@@ -0,0 +1,85 @@
+/*
+ * Simple Transfer Manager
+ * -----------------------
+ *
+ * Copyright (C) 2008 Przemysław Sitek
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __STM_RATE_ESTIMATOR_H__
+#define __STM_RATE_ESTIMATOR_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Samples closer than this are merged, in seconds */
+#define STM_RATE_ESTIMATOR_SLOT		0.25
+
+/* Number of samples kept; limits longest window */
+#define STM_RATE_ESTIMATOR_SLOTS	128
+
+/* Default window of stm_rate_estimator_get_windowed(), in seconds */
+#define STM_RATE_ESTIMATOR_DEFAULT_WINDOW	10.0
+
+/* Window of stm_rate_estimator_get_instant(), in seconds */
+#define STM_RATE_ESTIMATOR_INSTANT_WINDOW	1.0
+
+/* Time constant of exponentially weighted average, in seconds */
+#define STM_RATE_ESTIMATOR_EWMA_TAU	5.0
+
+
+typedef struct _StmRateEstimator		StmRateEstimator;
+
+
+StmRateEstimator *
+stm_rate_estimator_new				(void);
+
+void
+stm_rate_estimator_free				(StmRateEstimator *est);
+
+void
+stm_rate_estimator_reset			(StmRateEstimator *est);
+
+void
+stm_rate_estimator_set_parent			(StmRateEstimator *est,
+						 StmRateEstimator *parent);
+
+void
+stm_rate_estimator_set_window			(StmRateEstimator *est,
+						 gdouble window);
+
+void
+stm_rate_estimator_add				(StmRateEstimator *est,
+						 guint64 bytes);
+
+gdouble
+stm_rate_estimator_get_instant			(StmRateEstimator *est);
+
+gdouble
+stm_rate_estimator_get_windowed			(StmRateEstimator *est);
+
+gdouble
+stm_rate_estimator_get_ewma			(StmRateEstimator *est);
+
+gint64
+stm_rate_estimator_get_eta			(StmRateEstimator *est,
+						 guint64 remaining);
+
+G_END_DECLS
+
+#endif
@@ -28,16 +28,76 @@
 #include <time.h>
 #include <string.h>
 #include "stm-transfer.h"
-#include "glibcurl.h"
+#include "stm-digest.h"
+#include "stm-engine.h"
+#include "stm-handle-pool.h"
+#include "stm-host.h"
+#include "stm-limiter.h"
+#include "stm-progress-scheduler.h"
+#include "stm-rate-estimator.h"
+#include "stm-writer.h"
 
-#ifdef HAVE_CRYPTO
-#include <openssl/md5.h>
-#endif
+/* Ranges smaller than this are never split any further */
+#define STM_SEGMENT_MIN_SIZE	(1024 * 1024)
+
+/* Segment boundaries are rounded down to a multiple of this */
+#define STM_SEGMENT_ALIGN	(64 * 1024)
 
 gint n_updates = 0;
 
 G_DEFINE_TYPE (StmTransfer, stm_transfer, G_TYPE_OBJECT)
 
+
+/**
+ * StmSegment:
+ *
+ * A byte range of a transfer downloaded over its own connection.
+ * Each segment writes its data at its own offset of destination file.
+ */
+typedef struct _StmSegment StmSegment;
+struct _StmSegment
+{
+	StmTransfer	*transfer;	// Owning transfer
+	CURL		*curl;		// Curl handle, NULL when not running
+	StmWriterStream	*stream;	// Writes data at segment's offset
+	guint64		 start;		// Offset at which current request started
+	guint64		 pos;		// Offset of next byte to be written
+	guint64		 end;		// Offset past last byte, 0 if unbounded
+	gboolean	 checked;	// Server response has been verified
+	gboolean	 done;		// Whole range has been received
+	gboolean	 paused;	// Waiting for disk writes to catch up
+	gboolean	 throttled;	// Waiting for bandwidth limiter
+	guint64		 verified;	// Blocks below this offset were checked
+};
+
+
+/**
+ * StmBlockState:
+ *
+ * Verification state of a block with known checksum.
+ */
+typedef enum {
+	STM_BLOCK_UNCHECKED,
+	STM_BLOCK_CHECKING,
+	STM_BLOCK_FETCHING,	// Failed, being downloaded again
+	STM_BLOCK_GOOD
+} StmBlockState;
+
+
+/**
+ * StmBlockCheck:
+ *
+ * Checksum of a single block being computed in background.
+ */
+typedef struct _StmBlockCheck StmBlockCheck;
+struct _StmBlockCheck
+{
+	StmTransfer	*transfer;
+	guint		 block;
+	StmDigest	*digest;
+};
+
+
 struct _StmTransferPrivate
 {
 	/* Private members go here */
@@ -50,24 +110,41 @@ struct _StmTransferPrivate
 	gchar		*tmpfile;	// Destination temporary download file name
 	gboolean	output_is_dir;
 	
-	CURL		*curl;		// Curl handle
+	GList		*segments;	// Byte ranges being downloaded
+	guint		 connections;	// Maximum number of parallel connections
+	gboolean	 accept_ranges;	// Server has announced byte range support
+	guint		 split_id;	// ID of idle function splitting transfer
+	gboolean	 draining;	// Waiting for queued writes before finishing
 //	GIOChannel 	*io;		// I/O Channel
-	FILE 		*out;		// Output file
+	StmWriter	*writer;	// Output file
+	gboolean	 allocated;	// Disk space has been reserved
 	
 	guint64		 length; 	// transfer length
 	guint64 	 completed;	// successfully transferred bytes
-	gfloat		 speed;		// dl speed
-	
-	guint64		 last_bytes;// last progress callback
-	time_t		 last_time;	// last progress callback
+	StmRateEstimator *rate;		// Download rate
+	StmLimiterClient *limiter;	// Share of bandwidth
+	StmHandlePool	*handles;	// Source of CURL handles, may be NULL
+	StmHost		*host;		// Origin shared with other transfers, may be NULL
+	time_t		 open_time;	// when transfer was last opened
+	guint64		 elapsed;	// seconds spent in previous sessions
+	gint		 priority;	// Queued transfers with higher priority start first
 	
 	gchar		*error_buffer;	// buffer for error msg
 	gchar		*error_msg;		// last error message
 
-#ifdef HAVE_CRYPTO
-	MD5_CTX		*md5_ctx;	// md5 computation context
-	gchar		*md5;		// computed md5 chcecksum
-#endif
+	StmDigestType	 digests;	// checksums to compute
+	StmDigest	*digest;	// checksums of current session
+	gboolean	 hashing;	// Waiting for checksums before finishing
+	gchar		*expected[STM_DIGEST_N_TYPES];	// expected checksums, by type
+	StmTransferVerification verification;
+
+	StmDigestType	 block_type;	// algorithm of block checksums
+	guint64		 block_size;	// size of verified blocks
+	GPtrArray	*block_digests;	// expected checksum of each block
+	guint8		*block_state;	// StmBlockState of each block
+	GList		*block_checks;	// running StmBlockCheck's
+	gboolean	 verifying;	// Waiting for block checks before hashing
+	gboolean	 refetched;	// Some blocks were downloaded again
 
 	gboolean 	 disposed;
 	int i;
@@ -87,7 +164,11 @@ enum {
 	PROP_FILE,
 	
 	PROP_CONTENT_LENGTH,
-	PROP_COMPLETED
+	PROP_COMPLETED,
+	PROP_CONNECTIONS,
+	PROP_MAX_SPEED,
+	PROP_WEIGHT,
+	PROP_PRIORITY
 };
 
 
@@ -96,6 +177,7 @@ enum {
 	PROGRESS,
 	FINISHED,
 	STARTED,
+	STATE_CHANGED,
 	
 	LAST_SIGNAL
 };
@@ -103,11 +185,18 @@ enum {
 static guint signals[LAST_SIGNAL];
 
 
-static GHashTable *all_transfers = NULL;
+static GHashTable *all_segments = NULL;
+
 
+/* Segments paused because disk writes are lagging behind */
+static GList *paused_segments = NULL;
+
+
+static size_t
+stm_transfer_write_data (char *buffer, size_t size, size_t nmemb, void *userp);
 
 static size_t
-stm_transfer_write_data (void *buffer, size_t size, size_t nmemb, void *userp);
+stm_transfer_header_callback (char *buffer, size_t size, size_t nmemb, void *userp);
 
 static int
 stm_transfer_progress_callback (void *clientp,
@@ -119,6 +208,21 @@ static void
 _stm_transfer_set_state                            (StmTransfer *self,
                                                     StmTransferState state);
 
+static void
+stm_transfer_finish (StmTransfer *self, int return_code);
+
+static void
+stm_transfer_verify (StmTransfer *self);
+
+static guint
+stm_transfer_open_segments (StmTransfer *self);
+
+static void
+stm_transfer_host_ready (StmTransfer *self);
+
+static void
+stm_transfer_cancel_block_checks (StmTransfer *self);
+
 
 
 /**
@@ -144,6 +248,7 @@ stm_transfer_new (const gchar* uri, const gchar *file)
 	priv->completed = 0;
 	priv->state = STM_TRANSFER_STATE_STOPPED;
 	priv->output_is_dir = FALSE;
+	priv->connections = 1;
 
 	if (g_file_test (file, G_FILE_TEST_IS_DIR)) {
 		priv->output_is_dir = TRUE;
@@ -169,6 +274,445 @@ stm_transfer_new (const gchar* uri, const gchar *file)
 }
 
 
+/**
+ * stm_segment_new:
+ *
+ * @self: A #StmTransfer
+ * @pos: Offset of first byte of the range
+ * @end: Offset past last byte of the range, or 0 if range extends
+ *       to the end of file
+ *
+ * Create a new segment and append it to transfer's list of segments.
+ * Segment is not started.
+ *
+ * Returns: A newly created #StmSegment owned by @self.
+ */
+static StmSegment *
+stm_segment_new (StmTransfer *self, guint64 pos, guint64 end)
+{
+	StmTransferPrivate *priv = self->priv;
+
+	StmSegment *seg = g_new0 (StmSegment, 1);
+	seg->transfer = self;
+	seg->start = pos;
+	seg->pos = pos;
+	seg->end = end;
+
+	priv->segments = g_list_append (priv->segments, seg);
+	return seg;
+}
+
+
+/**
+ * stm_segment_open:
+ *
+ * @seg: A #StmSegment
+ *
+ * Set up a CURL handle requesting remaining part of segment's range
+ * and register it in global message dispatcher.
+ */
+static void
+stm_segment_open (StmSegment *seg)
+{
+	StmTransfer *self = seg->transfer;
+	StmTransferPrivate *priv = self->priv;
+
+	seg->start = seg->pos;
+	seg->checked = FALSE;
+	if (priv->block_size > 0)
+		seg->verified = (seg->pos + priv->block_size - 1) / priv->block_size * priv->block_size;
+
+	seg->stream = stm_writer_stream_new (priv->writer, seg->pos);
+
+	seg->curl = priv->handles ? stm_handle_pool_acquire (priv->handles) : curl_easy_init ();
+	if (priv->host)
+		stm_host_add_connection (priv->host);
+	curl_easy_setopt (seg->curl, CURLOPT_URL, priv->uri);
+	curl_easy_setopt (seg->curl, CURLOPT_NOPROGRESS, FALSE);
+	curl_easy_setopt (seg->curl, CURLOPT_ERRORBUFFER, priv->error_buffer);
+	curl_easy_setopt (seg->curl, CURLOPT_USERAGENT, "Simple Transfer Manager");
+	if (seg->end != 0) {
+		gchar *range = g_strdup_printf ("%llu-%llu",
+		                                (unsigned long long) seg->pos,
+		                                (unsigned long long) seg->end - 1);
+		curl_easy_setopt (seg->curl, CURLOPT_RANGE, range);
+		g_free (range);	// libcurl keeps its own copy
+	} else if (seg->pos > 0) {	
+		curl_easy_setopt (seg->curl, CURLOPT_RESUME_FROM_LARGE, (off64_t) seg->pos); // requires off64_t
+	}
+//	curl_easy_setopt (seg->curl, CURLOPT_VERBOSE, 1);
+	
+	/* Register in global message dispatcher */
+	g_hash_table_insert (all_segments, seg->curl, seg);
+//	g_print ("Registering %p as %s\n", seg->curl, priv->file);
+	
+	stm_engine_add (seg->curl,
+	                stm_transfer_write_data,
+	                stm_transfer_header_callback,
+	                stm_transfer_progress_callback,
+	                seg);
+}
+
+
+/**
+ * stm_segment_release_handle:
+ *
+ * Give back a handle the engine has let go of. Transfer is kept alive
+ * until then, as libcurl may still write to its error buffer.
+ */
+static void
+stm_segment_release_handle (CURL *curl, StmTransfer *self)
+{
+	if (self->priv->handles)
+		stm_handle_pool_release (self->priv->handles, curl);
+	else
+		curl_easy_cleanup (curl);
+	g_object_unref (self);
+}
+
+
+/**
+ * stm_segment_close:
+ *
+ * @seg: A #StmSegment
+ *
+ * Remove segment's CURL handle from dispatcher and free it, and
+ * write out buffered data. Segment range is kept, so that it can be
+ * resumed with stm_segment_open().
+ */
+static void
+stm_segment_close (StmSegment *seg)
+{
+	if (seg->curl == NULL)
+		return;
+
+	if (seg->paused) {
+		paused_segments = g_list_remove (paused_segments, seg);
+		seg->paused = FALSE;
+	}
+	seg->throttled = FALSE;
+
+	g_hash_table_remove (all_segments, seg->curl);
+	stm_engine_remove (seg->curl, (StmEngineReleaseFunc) stm_segment_release_handle,
+	                   g_object_ref (seg->transfer));
+	seg->curl = NULL;
+	if (seg->transfer->priv->host)
+		stm_host_remove_connection (seg->transfer->priv->host);
+
+	GError *error = NULL;
+	if (! stm_writer_stream_flush (seg->stream, &error)) {
+		g_printerr ("%s\n", error->message);
+		g_error_free (error);
+	}
+	stm_writer_stream_free (seg->stream);
+	seg->stream = NULL;
+}
+
+
+/**
+ * stm_transfer_free_segments:
+ *
+ * @self: A #StmTransfer
+ *
+ * Close and free all segments of a transfer.
+ */
+static void
+stm_transfer_free_segments (StmTransfer *self)
+{
+	StmTransferPrivate *priv = self->priv;
+
+	GList *node;
+	for (node = priv->segments; node; node = node->next) {
+		StmSegment *seg = node->data;
+		stm_segment_close (seg);
+		g_free (seg);
+	}
+	g_list_free (priv->segments);
+	priv->segments = NULL;
+}
+
+
+/**
+ * stm_transfer_split:
+ *
+ * @self: A #StmTransfer
+ *
+ * Split the unbounded segment of a running transfer into as many
+ * ranges as allowed by "connections" property and start a connection
+ * for each new range. The original connection keeps downloading the
+ * first range and is cut off once it reaches its end.
+ *
+ * This function is run from idle handler, as handles may not be
+ * added to multi handle from within libcurl callbacks.
+ */
+static gboolean
+stm_transfer_split (StmTransfer *self)
+{
+	StmTransferPrivate *priv = self->priv;
+	priv->split_id = 0;
+
+	if (priv->state != STM_TRANSFER_STATE_RUNNING || priv->segments == NULL)
+		return FALSE;
+
+	StmSegment *seg = priv->segments->data;
+	if (priv->segments->next != NULL || seg->end != 0 || seg->curl == NULL)
+		return FALSE;
+
+	StmEngineInfo info;
+	if (! stm_engine_get_info (seg->curl, &info))
+		return FALSE;
+
+	/* Without range support the only option is to carry on */
+	if (! priv->accept_ranges && info.response_code != 206)
+		return FALSE;
+
+	if (info.content_length <= 0)
+		return FALSE;
+
+	guint64 end = seg->start + (guint64) info.content_length;
+	if (seg->pos >= end)
+		return FALSE;
+
+	guint64 remaining = end - seg->pos;
+	guint n = MIN (priv->connections, remaining / STM_SEGMENT_MIN_SIZE);
+	if (n < 2)
+		return FALSE;
+
+	guint64 chunk = remaining / n;
+	guint64 boundary = seg->pos + chunk;
+	boundary -= boundary % STM_SEGMENT_ALIGN;
+	seg->end = boundary;
+
+	guint i;
+	for (i = 1; i < n; i++) {
+		guint64 next = (i == n - 1) ? end : boundary + chunk;
+		if (i != n - 1)
+			next -= next % STM_SEGMENT_ALIGN;
+		stm_segment_new (self, boundary, next);
+		boundary = next;
+	}
+	stm_transfer_open_segments (self);
+
+	g_debug ("Split %s into %u segments", priv->file, n);
+	return FALSE;
+}
+
+
+/**
+ * stm_transfer_reserve_space:
+ *
+ * @self: A #StmTransfer
+ *
+ * Make sure there is room for the whole file and preallocate it, once
+ * transfer length is known.
+ *
+ * Returns: FALSE if file would not fit on disk. Error message is set.
+ */
+static gboolean
+stm_transfer_reserve_space (StmTransfer *self)
+{
+	StmTransferPrivate *priv = self->priv;
+
+	if (priv->allocated || priv->length == 0 || priv->writer == NULL)
+		return TRUE;
+
+	GError *error = NULL;
+	if (! stm_writer_check_space (priv->writer, priv->length, &error)) {
+		g_printerr ("%s\n", error->message);
+		if (priv->error_msg == NULL)
+			priv->error_msg = g_strdup (error->message);
+		g_error_free (error);
+		return FALSE;
+	}
+
+	stm_writer_allocate (priv->writer, priv->length);
+	priv->allocated = TRUE;
+	return TRUE;
+}
+
+
+/**
+ * stm_transfer_mark_written:
+ *
+ * @self: A #StmTransfer
+ * @map: A newly created #StmRangeMap
+ *
+ * Fill a new range map from saved state: everything outside ranges
+ * of unfinished segments is considered written.
+ */
+static void
+stm_transfer_mark_written (StmTransfer *self, StmRangeMap *map)
+{
+	StmTransferPrivate *priv = self->priv;
+
+	/* Plain resume from counter */
+	if (priv->segments == NULL) {
+		if (priv->completed > 0)
+			stm_range_map_mark (map, 0, priv->completed);
+		return;
+	}
+
+	/* Segments are created in file order. Data a running segment
+	 * has received so far is not marked, as it may still be queued. */
+	guint64 pos = 0;
+	GList *node;
+	for (node = priv->segments; node; node = node->next) {
+		StmSegment *seg = node->data;
+		if (seg->done)
+			continue;
+		if (seg->start > pos)
+			stm_range_map_mark (map, pos, seg->start - pos);
+		pos = seg->end ? seg->end : priv->length;
+	}
+	if (pos < priv->length)
+		stm_range_map_mark (map, pos, priv->length - pos);
+}
+
+
+/**
+ * stm_transfer_get_written_prefix:
+ *
+ * @self: A #StmTransfer
+ *
+ * Returns: Length of data at the beginning of file that is known to
+ * be on disk.
+ */
+static guint64
+stm_transfer_get_written_prefix (StmTransfer *self)
+{
+	StmTransferPrivate *priv = self->priv;
+	guint64 prefix = priv->length > 0 ? priv->length : priv->completed;
+
+	/* Range map knows only about writes that have been flushed */
+	StmRangeMap *map = priv->writer ? stm_writer_get_range_map (priv->writer) : NULL;
+	if (map) {
+		GArray *missing = stm_range_map_get_missing (map);
+		if (missing->len > 0)
+			prefix = g_array_index (missing, StmRange, 0).start;
+		g_array_free (missing, TRUE);
+	}
+
+	GList *node;
+	for (node = priv->segments; node; node = node->next) {
+		StmSegment *seg = node->data;
+		if (! seg->done && seg->pos < prefix)
+			prefix = seg->pos;
+	}
+	return prefix;
+}
+
+
+/**
+ * stm_transfer_attach_range_map:
+ *
+ * @self: A #StmTransfer
+ * @restore: Whether segments may be rebuilt from the sidecar
+ *
+ * Once transfer length is known, keep track of written ranges in a
+ * sidecar file. If the sidecar is left from previous session and
+ * @restore is set, it replaces saved segments and counter, and only
+ * ranges missing from it are downloaded.
+ *
+ * @restore must only be set while no segment is open: from inside a
+ * CURL callback, freeing segments would free the very handle that is
+ * being called back. There, the sidecar is only attached and running
+ * segments keep going.
+ *
+ * Returns: TRUE if segments have been restored from the sidecar.
+ */
+static gboolean
+stm_transfer_attach_range_map (StmTransfer *self, gboolean restore)
+{
+	StmTransferPrivate *priv = self->priv;
+
+	if (priv->length == 0 || priv->writer == NULL
+	    || stm_writer_get_range_map (priv->writer) != NULL)
+		return FALSE;
+
+	gboolean existed = stm_range_map_exists (priv->file);
+
+	GError *error = NULL;
+	StmRangeMap *map = stm_range_map_open (priv->file, priv->length, &error);
+	if (map == NULL) {
+		g_printerr ("%s\n", error->message);
+		g_error_free (error);
+		return FALSE;
+	}
+
+	if (existed && restore) {
+		stm_transfer_free_segments (self);
+
+		GArray *missing = stm_range_map_get_missing (map);
+		guint i;
+		for (i = 0; i < missing->len; i++) {
+			StmRange *range = &g_array_index (missing, StmRange, i);
+			stm_segment_new (self, range->start, range->end);
+		}
+		g_array_free (missing, TRUE);
+
+		priv->completed = stm_range_map_count (map);
+	} else {
+		/* Ranges left marked from previous session are still on disk */
+		stm_transfer_mark_written (self, map);
+	}
+
+	stm_writer_set_range_map (priv->writer, map);
+	return existed && restore;
+}
+
+
+/**
+ * stm_transfer_open_segments:
+ *
+ * @self: A #StmTransfer
+ *
+ * Start unfinished segments, keeping at most "connections" of them
+ * running at once. Beyond first one, a connection is only opened if
+ * transfer's host has room for it; otherwise transfer waits until
+ * some other connection to the host is closed.
+ *
+ * Returns: Number of running segments.
+ */
+static guint
+stm_transfer_open_segments (StmTransfer *self)
+{
+	StmTransferPrivate *priv = self->priv;
+
+	guint n = stm_transfer_get_n_segments (self);
+	GList *node;
+	for (node = priv->segments; node && n < priv->connections; node = node->next) {
+		StmSegment *seg = node->data;
+		if (! seg->done && seg->curl == NULL) {
+			/* Without any connection transfer would never end */
+			if (n > 0 && priv->host && ! stm_host_has_room (priv->host)) {
+				stm_host_wait (priv->host, (StmHostFunc) stm_transfer_host_ready, self);
+				break;
+			}
+			stm_segment_open (seg);
+			n++;
+		}
+	}
+	return n;
+}
+
+
+/**
+ * stm_transfer_host_ready:
+ *
+ * @self: A #StmTransfer
+ *
+ * Called by #StmHost when transfer may open another connection.
+ */
+static void
+stm_transfer_host_ready (StmTransfer *self)
+{
+	StmTransferPrivate *priv = self->priv;
+
+	if (priv->state == STM_TRANSFER_STATE_RUNNING && priv->writer && ! priv->draining)
+		stm_transfer_open_segments (self);
+}
+
+
 /**
  * stm_transfer_open:
  * 
@@ -182,6 +726,9 @@ stm_transfer_open (StmTransfer *self)
 {
 	StmTransferPrivate *priv = self->priv;
 	
+	g_free (priv->error_msg);
+	priv->error_msg = NULL;
+
 	/* Set up destination */
 /*	GError *error = NULL;
 	priv->io = g_io_channel_new_file (file, "w", &error);
@@ -190,49 +737,57 @@ stm_transfer_open (StmTransfer *self)
 		g_error_free (error);
 	}
 */
-	g_print ("sizeof (off_t) = %d\n", sizeof (off_t));
-	if (priv->completed > 0)
-		priv->out = fopen (priv->file, "r+");
-	else
-		priv->out = fopen (priv->file, "w");
-		
+	GError *error = NULL;
+	gboolean truncate = priv->completed == 0 && priv->segments == NULL;
+	if (truncate)
+		stm_range_map_remove (priv->file);
+	priv->writer = stm_writer_open (priv->file, truncate, &error);
 	
-	if (priv->out == NULL) {
-		g_printerr ("Unable open %s for writing\n", priv->file);
+	if (priv->writer == NULL) {
+		g_printerr ("%s\n", error->message);
+		g_free (priv->error_msg);
+		priv->error_msg = g_strdup (error->message);
+		g_error_free (error);
+		_stm_transfer_set_state (self, STM_TRANSFER_STATE_ERROR);
+		return;
 	}
-	/* Prepare for resume */
-	if (priv->completed >= 0) {
-		if (fseeko (priv->out, (off_t) priv->completed, SEEK_SET) == -1) {
-			g_printerr ("Unable to seek %s\n", priv->file);
-		}
+
+	/* Length is known when resuming, don't start what can't fit */
+	priv->allocated = FALSE;
+	if (! stm_transfer_reserve_space (self)) {
+		stm_writer_unref (priv->writer);
+		priv->writer = NULL;
+		_stm_transfer_set_state (self, STM_TRANSFER_STATE_ERROR);
+		return;
 	}
 
+	/* Set up CURL, resuming unfinished segments if there are any */
+	gboolean resumed = stm_transfer_attach_range_map (self, TRUE);
+	if (priv->segments == NULL && ! resumed)
+		stm_segment_new (self, priv->completed, 0);
 
-	/* Set up CURL */
-	priv->curl = curl_easy_init ();
-	curl_easy_setopt (priv->curl, CURLOPT_URL, priv->uri);
-	curl_easy_setopt (priv->curl, CURLOPT_WRITEFUNCTION, stm_transfer_write_data);
-	curl_easy_setopt (priv->curl, CURLOPT_WRITEDATA, self);
-	curl_easy_setopt (priv->curl, CURLOPT_NOPROGRESS, FALSE);
-	curl_easy_setopt (priv->curl, CURLOPT_PROGRESSFUNCTION, stm_transfer_progress_callback);
-	curl_easy_setopt (priv->curl, CURLOPT_PROGRESSDATA, self);
-	curl_easy_setopt (priv->curl, CURLOPT_ERRORBUFFER, priv->error_buffer);
-	curl_easy_setopt (priv->curl, CURLOPT_USERAGENT, "Simple Transfer Manager");
-//	curl_easy_setopt (priv->curl, CURLOPT_MAX_RECV_SPEED_LARGE, limit64); // behaves strangely:/
-//	curl_easy_setopt (priv->curl, CURLOPT_RESUME_FROM, 10L);	// TODO
-	if (priv->completed > 0) {	
-		curl_easy_setopt (priv->curl, CURLOPT_RESUME_FROM_LARGE, (off64_t) priv->completed); // requires off64_t
-	}
-//	curl_easy_setopt (priv->curl, CURLOPT_VERBOSE, 1);
-	
-	/* Register in global message dispatcher */
-	g_hash_table_insert (all_transfers, priv->curl, self);
-//	g_print ("Registering %p as %s\n", priv->curl, priv->file);
-	
-	glibcurl_add (priv->curl);
+	guint n = stm_transfer_open_segments (self);
+
+	priv->open_time = time (NULL);
+	stm_rate_estimator_reset (priv->rate);
 	_stm_transfer_set_state (self, STM_TRANSFER_STATE_RUNNING);
 	
 	priv->i = 0;
+
+	/* Data received in previous sessions is hashed in background
+	 * before new data */
+	if (priv->digest) {
+		stm_digest_cancel (priv->digest);
+		stm_digest_unref (priv->digest);
+	}
+	priv->digest = stm_digest_new (priv->digests);
+	stm_digest_rehash (priv->digest, priv->file, stm_transfer_get_written_prefix (self));
+	if (priv->verification != STM_TRANSFER_VERIFY_NONE)
+		priv->verification = STM_TRANSFER_VERIFY_PENDING;
+
+	/* All ranges were received in previous session */
+	if (n == 0)
+		stm_transfer_verify (self);
 }
 
 
@@ -246,11 +801,37 @@ stm_transfer_close (StmTransfer *self)
 {
 	StmTransferPrivate *priv = self->priv;
 	
-	glibcurl_remove (priv->curl);
+	if (priv->split_id) {
+		g_source_remove (priv->split_id);
+		priv->split_id = 0;
+	}
+	if (priv->draining) {
+		stm_writer_cancel_drain (priv->writer);
+		priv->draining = FALSE;
+	}
+	/* Also stops rehashing of data from previous sessions, which a
+	 * hashing thread keeps alive with its own reference */
+	if (priv->digest)
+		stm_digest_cancel (priv->digest);
+	priv->hashing = FALSE;
+	stm_transfer_cancel_block_checks (self);
+	if (priv->host)
+		stm_host_cancel_wait (priv->host, self);
+
+	GList *node;
+	for (node = priv->segments; node; node = node->next) {
+		stm_segment_close (node->data);
+	}
 	g_print ("Closing file %s", priv->file);
 	
-	fclose (priv->out);
-	priv->out = NULL;
+	if (priv->writer) {
+		stm_writer_unref (priv->writer);
+		priv->writer = NULL;
+	}
+	if (priv->open_time) {
+		priv->elapsed += time (NULL) - priv->open_time;
+		priv->open_time = 0;
+	}
 	_stm_transfer_set_state (self, STM_TRANSFER_STATE_STOPPED);
 }
 
@@ -260,8 +841,8 @@ stm_transfer_close (StmTransfer *self)
  * 
  * @self: A #StmTransfer
  * 
- * Finish transfer. This function cleans up, closes files, finishes
- * MD5 computation, and emits appropriate signals.
+ * Finish transfer. This function cleans up, closes files, and emits
+ * appropriate signals.
  * 
  * Should be called on end of transfer.
  */
@@ -272,49 +853,421 @@ stm_transfer_finish (StmTransfer *self, int return_code)
 
 	stm_transfer_close (self);
 	if (return_code == 0) {
+		stm_transfer_free_segments (self);
+		stm_range_map_remove (priv->file);
 		_stm_transfer_set_state (self, STM_TRANSFER_STATE_FINISHED);
 	} else {
 		_stm_transfer_set_state (self, STM_TRANSFER_STATE_ERROR);
-		priv->error_msg = g_strdup (priv->error_buffer);
+		/* Our own message, if any, explains the failure better */
+		if (priv->error_msg == NULL)
+			priv->error_msg = g_strdup (priv->error_buffer);
 		g_print ("Error code %d: %s\n", return_code, priv->error_msg);
 	}
 
-#ifdef HAVE_CRYPTO
-	guchar md5[16];
-	MD5_Final (md5, priv->md5_ctx);
-	
-	/* Get textual representation of MD5 checksum */
-	gchar *buffer = g_new (gchar, 33);
-	int i;
-	for (i = 0; i < 16; i++) {
-		snprintf (buffer+2*i, 3, "%02x", (int) md5[i]);
-	}
-	priv->md5 = buffer;
-	g_print ("Finished, md5=%s\n", priv->md5);
-#endif
-	
 	g_print ("finished, code=%d\n", return_code); // TODO
-	g_signal_emit (self, signals[PROGRESS], 0);
+	stm_progress_scheduler_mark_dirty (stm_progress_scheduler_get_default (), self);
 	g_signal_emit (self, signals[FINISHED], 0);
 }
 
 
 /**
- * stm_transfer_start:
- * 
- * @self a #StmTransfer
- * 
- * Start a transfer. If transfer is already running this function
- * does nothing.
- * 
+ * stm_transfer_get_block_length:
+ *
+ * Returns: Length of given block; last block may be shorter.
  */
-void
-stm_transfer_start (StmTransfer *self)
+static guint64
+stm_transfer_get_block_length (StmTransfer *self, guint block)
 {
 	StmTransferPrivate *priv = self->priv;
+	guint64 start = (guint64) block * priv->block_size;
+	guint64 length = priv->length > 0 ? priv->length : priv->completed;
 
-	if (priv->state == STM_TRANSFER_STATE_STOPPED || priv->state == STM_TRANSFER_STATE_ERROR) {
-		_stm_transfer_set_state (self, STM_TRANSFER_STATE_RUNNING);
+	return start < length ? MIN (priv->block_size, length - start) : 0;
+}
+
+
+/**
+ * stm_transfer_cancel_block_checks:
+ *
+ * Stop all running block checks; their blocks are checked again
+ * later.
+ */
+static void
+stm_transfer_cancel_block_checks (StmTransfer *self)
+{
+	StmTransferPrivate *priv = self->priv;
+
+	GList *node;
+	for (node = priv->block_checks; node; node = node->next) {
+		StmBlockCheck *check = node->data;
+		stm_digest_cancel (check->digest);
+		stm_digest_unref (check->digest);
+		priv->block_state[check->block] = STM_BLOCK_UNCHECKED;
+		g_free (check);
+	}
+	g_list_free (priv->block_checks);
+	priv->block_checks = NULL;
+	priv->verifying = FALSE;
+}
+
+
+/**
+ * stm_transfer_refetch_block:
+ *
+ * @self: A #StmTransfer
+ * @block: Index of a corrupted block
+ *
+ * Download a block that failed verification again, over a connection
+ * of its own. Without range support the only option is to give up.
+ */
+static void
+stm_transfer_refetch_block (StmTransfer *self, guint block)
+{
+	StmTransferPrivate *priv = self->priv;
+	guint64 start = (guint64) block * priv->block_size;
+	guint64 len = stm_transfer_get_block_length (self, block);
+
+	if (! priv->accept_ranges) {
+		g_free (priv->error_msg);
+		priv->error_msg = g_strdup_printf ("Block %u of %s failed verification",
+		                                   block, priv->file);
+		priv->verification = STM_TRANSFER_VERIFY_FAILED;
+		stm_transfer_finish (self, CURLE_ABORTED_BY_CALLBACK);
+		return;
+	}
+
+	g_debug ("Block %u of %s is corrupted, downloading it again", block, priv->file);
+
+	StmRangeMap *map = stm_writer_get_range_map (priv->writer);
+	if (map)
+		stm_range_map_unmark (map, start, len);
+	priv->completed -= MIN (priv->completed, len);
+	priv->block_state[block] = STM_BLOCK_FETCHING;
+	priv->refetched = TRUE;
+
+	/* Keep segments in file order */
+	StmSegment *seg = stm_segment_new (self, start, start + len);
+	priv->segments = g_list_remove (priv->segments, seg);
+	GList *node = priv->segments;
+	while (node && ((StmSegment *) node->data)->start < start)
+		node = node->next;
+	priv->segments = g_list_insert_before (priv->segments, node, seg);
+
+	stm_transfer_open_segments (self);
+}
+
+
+/**
+ * stm_transfer_block_checked:
+ *
+ * Called once checksum of a block is known.
+ */
+static void
+stm_transfer_block_checked (StmDigest *digest, const GError *error, StmBlockCheck *check)
+{
+	StmTransfer *self = check->transfer;
+	StmTransferPrivate *priv = self->priv;
+	guint block = check->block;
+
+	priv->block_checks = g_list_remove (priv->block_checks, check);
+	stm_digest_unref (check->digest);
+	g_free (check);
+
+	const gchar *result = stm_digest_get_result (digest, priv->block_type);
+	const gchar *expected = g_ptr_array_index (priv->block_digests, block);
+
+	if (error != NULL) {
+		priv->block_state[block] = STM_BLOCK_UNCHECKED;
+		if (priv->error_msg == NULL)
+			priv->error_msg = g_strdup (error->message);
+		stm_transfer_finish (self, CURLE_READ_ERROR);
+		return;
+	}
+
+	if (result && g_ascii_strcasecmp (result, expected) == 0) {
+		priv->block_state[block] = STM_BLOCK_GOOD;
+	} else {
+		stm_transfer_refetch_block (self, block);
+		if (priv->state != STM_TRANSFER_STATE_RUNNING)
+			return;
+	}
+
+	if (priv->verifying && priv->block_checks == NULL) {
+		priv->verifying = FALSE;
+		stm_transfer_verify (self);
+	}
+}
+
+
+/**
+ * stm_transfer_check_block:
+ *
+ * @self: A #StmTransfer
+ * @block: Index of a block that is completely on disk
+ *
+ * Start computing checksum of a block in background.
+ */
+static void
+stm_transfer_check_block (StmTransfer *self, guint block)
+{
+	StmTransferPrivate *priv = self->priv;
+
+	StmBlockCheck *check = g_new (StmBlockCheck, 1);
+	check->transfer = self;
+	check->block = block;
+	priv->block_state[block] = STM_BLOCK_CHECKING;
+	priv->block_checks = g_list_prepend (priv->block_checks, check);
+	check->digest = stm_digest_hash_range (priv->block_type, priv->file,
+	                                       (guint64) block * priv->block_size,
+	                                       stm_transfer_get_block_length (self, block),
+	                                       (StmDigestFunc) stm_transfer_block_checked,
+	                                       check);
+}
+
+
+/**
+ * stm_segment_check_blocks:
+ *
+ * @seg: A #StmSegment
+ *
+ * Check blocks a segment has received completely, as soon as they
+ * reach the disk, so that corrupted ones are downloaded again before
+ * the transfer ends. Blocks shared with other segments are left for
+ * final verification.
+ */
+static void
+stm_segment_check_blocks (StmSegment *seg)
+{
+	StmTransfer *self = seg->transfer;
+	StmTransferPrivate *priv = self->priv;
+
+	if (priv->block_state == NULL || priv->length == 0 || priv->writer == NULL)
+		return;
+
+	StmRangeMap *map = stm_writer_get_range_map (priv->writer);
+	if (map == NULL)
+		return;
+
+	while (seg->verified < priv->length) {
+		guint block = seg->verified / priv->block_size;
+		guint64 len = stm_transfer_get_block_length (self, block);
+
+		if (block >= priv->block_digests->len || seg->verified + len > seg->pos)
+			break;
+		if (priv->block_state[block] == STM_BLOCK_UNCHECKED
+		    || priv->block_state[block] == STM_BLOCK_FETCHING) {
+			/* Data may still be waiting for I/O threads or a flush */
+			if (! stm_range_map_is_marked (map, seg->verified, len))
+				break;
+			stm_transfer_check_block (self, block);
+		}
+		seg->verified += len;
+	}
+}
+
+
+/**
+ * stm_transfer_compare_digests:
+ *
+ * Compare computed checksums with expected ones.
+ *
+ * Returns: FALSE on mismatch. Error message is set.
+ */
+static gboolean
+stm_transfer_compare_digests (StmTransfer *self, StmDigest *digest)
+{
+	StmTransferPrivate *priv = self->priv;
+
+	guint i;
+	for (i = 0; i < STM_DIGEST_N_TYPES; i++) {
+		StmDigestType type = 1 << i;
+		const gchar *result = stm_digest_get_result (digest, type);
+		if (result)
+			g_debug ("Finished, %s=%s", stm_digest_type_get_name (type), result);
+
+		if (priv->expected[i] == NULL || result == NULL)
+			continue;
+		if (g_ascii_strcasecmp (priv->expected[i], result) != 0) {
+			g_free (priv->error_msg);
+			priv->error_msg = g_strdup_printf ("%s checksum mismatch: expected %s, got %s",
+			                                   stm_digest_type_get_name (type),
+			                                   priv->expected[i], result);
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+
+/**
+ * stm_transfer_hashed:
+ *
+ * Called once checksums of a complete transfer are known.
+ */
+static void
+stm_transfer_hashed (StmDigest *digest, const GError *error, StmTransfer *self)
+{
+	StmTransferPrivate *priv = self->priv;
+	priv->hashing = FALSE;
+
+	if (error != NULL) {
+		if (priv->error_msg == NULL)
+			priv->error_msg = g_strdup (error->message);
+		stm_transfer_finish (self, CURLE_READ_ERROR);
+		return;
+	}
+
+	if (! stm_transfer_compare_digests (self, digest)) {
+		priv->verification = STM_TRANSFER_VERIFY_FAILED;
+		stm_transfer_finish (self, CURLE_ABORTED_BY_CALLBACK);
+		return;
+	}
+
+	if (priv->verification == STM_TRANSFER_VERIFY_PENDING)
+		priv->verification = STM_TRANSFER_VERIFY_PASSED;
+	stm_transfer_finish (self, CURLE_OK);
+}
+
+
+/**
+ * stm_transfer_verify:
+ *
+ * Check blocks that have not been checked yet, and compute checksums
+ * of a complete transfer in background, then finish it. Corrupted
+ * blocks are downloaded again before the whole file is hashed.
+ */
+static void
+stm_transfer_verify (StmTransfer *self)
+{
+	StmTransferPrivate *priv = self->priv;
+
+	/* Blocks being downloaded again are finished through another
+	 * sync */
+	GList *node;
+	for (node = priv->segments; node; node = node->next) {
+		if (! ((StmSegment *) node->data)->done)
+			return;
+	}
+
+	if (priv->block_state) {
+		guint block;
+		for (block = 0; block < priv->block_digests->len; block++) {
+			if ((priv->block_state[block] == STM_BLOCK_UNCHECKED
+			     || priv->block_state[block] == STM_BLOCK_FETCHING)
+			    && stm_transfer_get_block_length (self, block) > 0)
+				stm_transfer_check_block (self, block);
+		}
+		if (priv->block_checks) {
+			priv->verifying = TRUE;
+			return;
+		}
+	}
+
+	if (priv->digest == NULL || stm_digest_get_types (priv->digest) == STM_DIGEST_NONE) {
+		if (priv->verification == STM_TRANSFER_VERIFY_PENDING)
+			priv->verification = STM_TRANSFER_VERIFY_PASSED;
+		stm_transfer_finish (self, CURLE_OK);
+		return;
+	}
+
+	/* Data hashed on the fly included corrupted blocks */
+	if (priv->refetched) {
+		stm_digest_cancel (priv->digest);
+		stm_digest_unref (priv->digest);
+		priv->digest = stm_digest_new (priv->digests);
+		priv->refetched = FALSE;
+	}
+
+	guint64 length = priv->length > 0 ? priv->length : priv->completed;
+	priv->hashing = TRUE;
+	stm_digest_finish (priv->digest, priv->file, length,
+			   (StmDigestFunc) stm_transfer_hashed, self);
+}
+
+
+/**
+ * stm_transfer_drained:
+ *
+ * Called once all data of a transfer has been written and flushed
+ * to disk.
+ */
+static void
+stm_transfer_drained (StmWriter *writer, const GError *error, StmTransfer *self)
+{
+	StmTransferPrivate *priv = self->priv;
+	priv->draining = FALSE;
+
+	if (error != NULL) {
+		if (priv->error_msg == NULL)
+			priv->error_msg = g_strdup (error->message);
+		stm_transfer_finish (self, CURLE_WRITE_ERROR);
+	} else {
+		stm_transfer_verify (self);
+	}
+}
+
+
+/**
+ * stm_transfer_segment_done:
+ *
+ * @seg: A #StmSegment
+ * @return_code: CURL result code for the segment
+ *
+ * Called when a segment's connection terminates. Transfer is finished
+ * once all its segments are done, or as soon as one of them fails.
+ */
+static void
+stm_transfer_segment_done (StmSegment *seg, int return_code)
+{
+	StmTransfer *self = seg->transfer;
+	StmTransferPrivate *priv = self->priv;
+
+	/* Segment was cut off on purpose once it reached its end */
+	if (return_code == CURLE_WRITE_ERROR && seg->done)
+		return_code = CURLE_OK;
+
+	stm_segment_close (seg);
+
+	if (return_code != CURLE_OK) {
+		stm_transfer_finish (self, return_code);
+		return;
+	}
+	seg->done = TRUE;
+
+	/* Start next range waiting for a connection */
+	stm_transfer_open_segments (self);
+
+	GList *node;
+	for (node = priv->segments; node; node = node->next) {
+		StmSegment *s = node->data;
+		if (! s->done)
+			return;
+	}
+
+	/* Transfer is complete only when writes queued by all
+	 * segments have reached the disk */
+	priv->draining = TRUE;
+	stm_writer_sync (priv->writer, (StmWriterFunc) stm_transfer_drained, self);
+}
+
+
+/**
+ * stm_transfer_start:
+ * 
+ * @self a #StmTransfer
+ * 
+ * Start a transfer right away, even if it is waiting in a queue. If
+ * transfer is already running this function does nothing.
+ * 
+ */
+void
+stm_transfer_start (StmTransfer *self)
+{
+	StmTransferPrivate *priv = self->priv;
+
+	if (priv->state == STM_TRANSFER_STATE_STOPPED || priv->state == STM_TRANSFER_STATE_ERROR
+	    || priv->state == STM_TRANSFER_STATE_QUEUED) {
+		_stm_transfer_set_state (self, STM_TRANSFER_STATE_RUNNING);
 		stm_transfer_open (self);
 	}
 }
@@ -339,7 +1292,275 @@ stm_transfer_stop (StmTransfer *self)
 			? STM_TRANSFER_STATE_FINISHED : STM_TRANSFER_STATE_STOPPED; 
 		_stm_transfer_set_state (self, state);
 		stm_transfer_close (self);
+	} else if (priv->state == STM_TRANSFER_STATE_QUEUED) {
+		_stm_transfer_set_state (self, STM_TRANSFER_STATE_STOPPED);
+	}
+}
+
+
+/**
+ * stm_transfer_queue:
+ * 
+ * @self a #StmTransfer
+ * 
+ * Mark a stopped transfer as waiting to be started. Queued transfers
+ * are started by #StmManager as soon as it has a free slot.
+ */
+void
+stm_transfer_queue (StmTransfer *self)
+{
+	StmTransferPrivate *priv = self->priv;
+
+	if (priv->state == STM_TRANSFER_STATE_STOPPED || priv->state == STM_TRANSFER_STATE_ERROR)
+		_stm_transfer_set_state (self, STM_TRANSFER_STATE_QUEUED);
+}
+
+
+/**
+ * stm_transfer_set_connections:
+ *
+ * @self: A #StmTransfer
+ * @connections: Maximum number of parallel connections
+ *
+ * Set how many connections may be used to download this transfer.
+ * When more than one connection is allowed and server supports byte
+ * ranges, remaining content is split into segments downloaded in
+ * parallel as soon as its length is known. Change takes effect next
+ * time transfer is started.
+ */
+void
+stm_transfer_set_connections (StmTransfer *self, guint connections)
+{
+	StmTransferPrivate *priv = self->priv;
+
+	priv->connections = CLAMP (connections, 1, STM_TRANSFER_MAX_CONNECTIONS);
+}
+
+
+/**
+ * stm_transfer_get_connections:
+ *
+ * @self: A #StmTransfer
+ *
+ * Get maximum number of parallel connections for this transfer.
+ *
+ * Returns: Number of connections.
+ */
+guint
+stm_transfer_get_connections (StmTransfer *self)
+{
+	StmTransferPrivate *priv = self->priv;
+
+	return priv->connections;
+}
+
+
+/**
+ * stm_transfer_is_multiplexed:
+ *
+ * @self: A #StmTransfer
+ *
+ * Returns: TRUE if any connection of this transfer is a stream of a
+ * multiplexed HTTP/2 (or newer) connection.
+ */
+gboolean
+stm_transfer_is_multiplexed (StmTransfer *self)
+{
+#if LIBCURL_VERSION_NUM >= 0x073200
+	StmTransferPrivate *priv = self->priv;
+
+	GList *node;
+	for (node = priv->segments; node; node = node->next) {
+		StmSegment *seg = node->data;
+		StmEngineInfo info;
+		if (seg->curl == NULL)
+			continue;
+		if (stm_engine_get_info (seg->curl, &info)
+		    && info.http_version >= CURL_HTTP_VERSION_2_0)
+			return TRUE;
+	}
+#endif
+	return FALSE;
+}
+
+
+/**
+ * stm_transfer_get_n_segments:
+ *
+ * @self: A #StmTransfer
+ *
+ * Get number of connections currently open for this transfer.
+ *
+ * Returns: Number of active segments.
+ */
+guint
+stm_transfer_get_n_segments (StmTransfer *self)
+{
+	StmTransferPrivate *priv = self->priv;
+
+	guint n = 0;
+	GList *node;
+	for (node = priv->segments; node; node = node->next) {
+		StmSegment *seg = node->data;
+		if (seg->curl != NULL)
+			n++;
+	}
+	return n;
+}
+
+
+/**
+ * stm_transfer_set_max_speed:
+ *
+ * @self: A #StmTransfer
+ * @speed: Limit in bytes per second, 0 for no limit
+ *
+ * Limit download speed of this transfer. Transfer is also subject to
+ * global limit set with stm_manager_set_max_speed().
+ */
+void
+stm_transfer_set_max_speed (StmTransfer *self, guint64 speed)
+{
+	stm_limiter_client_set_max_speed (self->priv->limiter, speed);
+	g_object_notify (G_OBJECT (self), "max-speed");
+}
+
+
+/**
+ * stm_transfer_get_max_speed:
+ *
+ * @self: A #StmTransfer
+ *
+ * Returns: Speed limit in bytes per second, 0 if unlimited.
+ */
+guint64
+stm_transfer_get_max_speed (StmTransfer *self)
+{
+	return stm_limiter_client_get_max_speed (self->priv->limiter);
+}
+
+
+/**
+ * stm_transfer_set_weight:
+ *
+ * @self: A #StmTransfer
+ * @weight: Relative share of global speed limit
+ *
+ * When global speed limit is in effect, transfers share it in
+ * proportion to their weights.
+ */
+void
+stm_transfer_set_weight (StmTransfer *self, guint weight)
+{
+	stm_limiter_client_set_weight (self->priv->limiter, weight);
+	g_object_notify (G_OBJECT (self), "weight");
+}
+
+
+/**
+ * stm_transfer_get_weight:
+ *
+ * @self: A #StmTransfer
+ *
+ * Returns: Weight of transfer.
+ */
+guint
+stm_transfer_get_weight (StmTransfer *self)
+{
+	return stm_limiter_client_get_weight (self->priv->limiter);
+}
+
+
+/**
+ * stm_transfer_set_priority:
+ *
+ * @self: A #StmTransfer
+ * @priority: Queue priority
+ *
+ * Queued transfers with higher priority are started before others.
+ */
+void
+stm_transfer_set_priority (StmTransfer *self, gint priority)
+{
+	self->priv->priority = priority;
+	g_object_notify (G_OBJECT (self), "priority");
+
+	/* Schedule progress to update views */
+	stm_progress_scheduler_mark_dirty (stm_progress_scheduler_get_default (), self);
+}
+
+
+/**
+ * stm_transfer_get_priority:
+ *
+ * @self: A #StmTransfer
+ *
+ * Returns: Queue priority of transfer.
+ */
+gint
+stm_transfer_get_priority (StmTransfer *self)
+{
+	return self->priv->priority;
+}
+
+
+/**
+ * _stm_transfer_set_handle_pool:
+ * 
+ * @self: A #StmTransfer
+ * @pool: Pool of CURL handles of the owning manager, or NULL
+ * 
+ * Make segments started from now on take their handles from @pool,
+ * so they reuse connections and caches of other transfers.
+ */
+void
+_stm_transfer_set_handle_pool (StmTransfer *self, StmHandlePool *pool)
+{
+	StmTransferPrivate *priv = self->priv;
+
+	/* Handles of running segments are reset on release, so they
+	 * may safely join the new pool */
+	if (pool)
+		stm_handle_pool_ref (pool);
+	if (priv->handles)
+		stm_handle_pool_unref (priv->handles);
+	priv->handles = pool;
+}
+
+
+/**
+ * _stm_transfer_set_host:
+ * 
+ * @self: A #StmTransfer
+ * @host: Host shared with other transfers to the same origin, or NULL
+ * 
+ * Make connections of transfer count against limit of @host.
+ */
+void
+_stm_transfer_set_host (StmTransfer *self, StmHost *host)
+{
+	StmTransferPrivate *priv = self->priv;
+
+	if (host)
+		stm_host_ref (host);
+
+	/* Move open connections over to the new host */
+	GList *node;
+	for (node = priv->segments; node; node = node->next) {
+		StmSegment *seg = node->data;
+		if (seg->curl == NULL)
+			continue;
+		if (priv->host)
+			stm_host_remove_connection (priv->host);
+		if (host)
+			stm_host_add_connection (host);
 	}
+
+	if (priv->host) {
+		stm_host_cancel_wait (priv->host, self);
+		stm_host_unref (priv->host);
+	}
+	priv->host = host;
 }
 
 
@@ -356,16 +1577,152 @@ _stm_transfer_to_xml (StmTransfer *self)
 {
 	StmTransferPrivate *priv = self->priv;
 
-	return g_markup_printf_escaped ("    <transfer uri='%s'\n"
+	/* Unfinished byte ranges, as "pos-end" pairs */
+	GString *segments = g_string_new ("");
+	GList *node;
+	for (node = priv->segments; node; node = node->next) {
+		StmSegment *seg = node->data;
+		if (seg->done)
+			continue;
+		if (segments->len > 0)
+			g_string_append_c (segments, ',');
+		g_string_append_printf (segments, "%llu-%llu",
+		                        (unsigned long long) seg->pos,
+		                        (unsigned long long) seg->end);
+	}
+
+	gchar *digests = stm_digest_types_to_string (priv->digests);
+
+	/* Expected checksums, as "type:checksum" pairs */
+	GString *expected = g_string_new ("");
+	guint i;
+	for (i = 0; i < STM_DIGEST_N_TYPES; i++) {
+		if (priv->expected[i] == NULL)
+			continue;
+		if (expected->len > 0)
+			g_string_append_c (expected, ',');
+		g_string_append_printf (expected, "%s:%s",
+		                        stm_digest_type_get_name (1 << i),
+		                        priv->expected[i]);
+	}
+
+	/* Block checksums, as "type:size:checksum,checksum,..." */
+	GString *blocks = g_string_new ("");
+	if (priv->block_digests) {
+		g_string_append_printf (blocks, "%s:%llu:",
+		                        stm_digest_type_get_name (priv->block_type),
+		                        (unsigned long long) priv->block_size);
+		for (i = 0; i < priv->block_digests->len; i++) {
+			if (i > 0)
+				g_string_append_c (blocks, ',');
+			g_string_append (blocks, g_ptr_array_index (priv->block_digests, i));
+		}
+	}
+
+	gchar *xml = g_markup_printf_escaped ("    <transfer uri='%s'\n"
 	                                "              file='%s'\n"
 	                                "              downloaded='%llu'\n"
 	                                "              total='%llu'\n"
+	                                "              connections='%u'\n"
+	                                "              max_speed='%llu'\n"
+	                                "              weight='%u'\n"
+	                                "              priority='%d'\n"
+	                                "              digests='%s'\n"
+	                                "              expected='%s'\n"
+	                                "              blocks='%s'\n"
+	                                "              verification='%d'\n"
+	                                "              segments='%s'\n"
 	                                "              state='%d' />",
 	                                priv->uri,
 	                                priv->file,
 	                                priv->completed,
 	                                priv->length,
+	                                priv->connections,
+	                                stm_transfer_get_max_speed (self),
+	                                stm_transfer_get_weight (self),
+	                                priv->priority,
+	                                digests,
+	                                expected->str,
+	                                blocks->str,
+	                                priv->verification,
+	                                segments->str,
 	                                priv->state);
+	g_string_free (segments, TRUE);
+	g_free (digests);
+	g_string_free (expected, TRUE);
+	g_string_free (blocks, TRUE);
+	return xml;
+}
+
+
+/**
+ * _stm_transfer_parse_segments:
+ *
+ * @self: A #StmTransfer
+ * @str: Comma separated list of "pos-end" pairs
+ *
+ * Restore unfinished segments saved by _stm_transfer_to_xml().
+ */
+static void
+_stm_transfer_parse_segments (StmTransfer *self, const gchar *str)
+{
+	gchar **ranges = g_strsplit (str, ",", -1);
+	int i;
+	for (i = 0; ranges[i]; i++) {
+		gchar *end;
+		guint64 pos = g_ascii_strtoull (ranges[i], &end, 10);
+		if (end == ranges[i] || *end != '-')
+			continue;
+		stm_segment_new (self, pos, g_ascii_strtoull (end + 1, NULL, 10));
+	}
+	g_strfreev (ranges);
+}
+
+
+/**
+ * _stm_transfer_parse_expected:
+ *
+ * @self: A #StmTransfer
+ * @str: Comma separated list of "type:checksum" pairs
+ *
+ * Restore expected checksums saved by _stm_transfer_to_xml().
+ */
+static void
+_stm_transfer_parse_expected (StmTransfer *self, const gchar *str)
+{
+	gchar **pairs = g_strsplit (str, ",", -1);
+	guint i;
+	for (i = 0; pairs[i]; i++) {
+		gchar *sep = strchr (pairs[i], ':');
+		if (sep == NULL)
+			continue;
+		*sep = '\0';
+		stm_transfer_set_expected_digest (self, stm_digest_type_from_name (pairs[i]), sep + 1);
+	}
+	g_strfreev (pairs);
+}
+
+
+/**
+ * _stm_transfer_parse_blocks:
+ *
+ * @self: A #StmTransfer
+ * @str: Block checksums as "type:size:checksum,checksum,..."
+ *
+ * Restore block checksums saved by _stm_transfer_to_xml().
+ */
+static void
+_stm_transfer_parse_blocks (StmTransfer *self, const gchar *str)
+{
+	gchar **parts = g_strsplit (str, ":", 3);
+	if (g_strv_length (parts) == 3) {
+		gchar **digests = g_strsplit (parts[2], ",", -1);
+		stm_transfer_set_block_digests (self, stm_digest_type_from_name (parts[0]),
+		                                g_ascii_strtoull (parts[1], NULL, 10),
+		                                digests);
+		g_strfreev (digests);
+	}
+	g_strfreev (parts);
 }
 
 
@@ -385,6 +1742,15 @@ _stm_transfer_from_xml (const gchar         *element_name,
 	const gchar *file = NULL;
 	guint64 downloaded = 0;
 	guint64 total = 0;
+	guint connections = 1;
+	guint64 max_speed = 0;
+	guint weight = STM_LIMITER_DEFAULT_WEIGHT;
+	gint priority = 0;
+	const gchar *segments = NULL;
+	const gchar *digests = NULL;
+	const gchar *expected = NULL;
+	const gchar *blocks = NULL;
+	int verification = STM_TRANSFER_VERIFY_NONE;
 	int state = STM_TRANSFER_STATE_STOPPED;
 	
 	int i;
@@ -397,6 +1763,24 @@ _stm_transfer_from_xml (const gchar         *element_name,
 			downloaded =  g_ascii_strtoull(attribute_values[i], NULL, 10);
 		} else if (strcmp (attribute_names[i], "total") == 0) {
 			total = g_ascii_strtoull (attribute_values[i], NULL, 10);
+		} else if (strcmp (attribute_names[i], "connections") == 0) {
+			connections = atoi (attribute_values[i]);
+		} else if (strcmp (attribute_names[i], "max_speed") == 0) {
+			max_speed = g_ascii_strtoull (attribute_values[i], NULL, 10);
+		} else if (strcmp (attribute_names[i], "weight") == 0) {
+			weight = atoi (attribute_values[i]);
+		} else if (strcmp (attribute_names[i], "priority") == 0) {
+			priority = atoi (attribute_values[i]);
+		} else if (strcmp (attribute_names[i], "digests") == 0) {
+			digests = attribute_values[i];
+		} else if (strcmp (attribute_names[i], "expected") == 0) {
+			expected = attribute_values[i];
+		} else if (strcmp (attribute_names[i], "blocks") == 0) {
+			blocks = attribute_values[i];
+		} else if (strcmp (attribute_names[i], "verification") == 0) {
+			verification = atoi (attribute_values[i]);
+		} else if (strcmp (attribute_names[i], "segments") == 0) {
+			segments = attribute_values[i];
 		} else if (strcmp (attribute_names[i], "state") == 0) {
 			state = atoi (attribute_values[i]);
 		}
@@ -410,13 +1794,26 @@ _stm_transfer_from_xml (const gchar         *element_name,
 		
 		priv->completed = downloaded;
 		priv->length = total;
+		stm_transfer_set_connections (self, connections);
+		stm_transfer_set_max_speed (self, max_speed);
+		stm_transfer_set_weight (self, weight);
+		stm_transfer_set_priority (self, priority);
+		if (digests)
+			stm_transfer_set_digests (self, stm_digest_types_from_string (digests));
+		if (expected)
+			_stm_transfer_parse_expected (self, expected);
+		if (blocks && *blocks)
+			_stm_transfer_parse_blocks (self, blocks);
+		if (verification > STM_TRANSFER_VERIFY_NONE && verification <= STM_TRANSFER_VERIFY_FAILED)
+			priv->verification = verification;
+		if (segments && state != STM_TRANSFER_STATE_FINISHED)
+			_stm_transfer_parse_segments (self, segments);
 		
-		if (state > STM_TRANSFER_STATE_NONE && state <= STM_TRANSFER_STATE_ERROR) {
-			if (state == STM_TRANSFER_STATE_RUNNING)
-				stm_transfer_start (self);
-			else
-				_stm_transfer_set_state (self, state);
-		}
+		/* Running transfers go through manager's queue again */
+		if (state == STM_TRANSFER_STATE_RUNNING)
+			state = STM_TRANSFER_STATE_QUEUED;
+		if (state > STM_TRANSFER_STATE_NONE && state <= STM_TRANSFER_STATE_QUEUED)
+			_stm_transfer_set_state (self, state);
 		
 		return self;
 	} else {
@@ -517,10 +1914,13 @@ _stm_transfer_set_state                            (StmTransfer *self,
 {
 	StmTransferPrivate *priv = self->priv;
 
-	priv->state = state;
+	if (priv->state != state) {
+		priv->state = state;
+		g_signal_emit (self, signals[STATE_CHANGED], 0);
+	}
 
-	/* Fire progress to update views */
-	g_signal_emit (self, signals[PROGRESS], 0);
+	/* Schedule progress to update views */
+	stm_progress_scheduler_mark_dirty (stm_progress_scheduler_get_default (), self);
 }
 
 
@@ -635,7 +2035,8 @@ stm_transfer_get_downloaded                        (StmTransfer *self)
  * 
  * @self: A #StmTransfer
  * 
- * Get transfer speed measured in bytes per second (b/s).
+ * Get current transfer speed measured in bytes per second (b/s),
+ * averaged over last few seconds.
  * 
  * Returns: Speed in b/s.
  */
@@ -644,15 +2045,26 @@ stm_transfer_get_speed                             (StmTransfer *self)
 {
 	StmTransferPrivate *priv = self->priv;
 
-	if (priv->curl == NULL)
-		return 0;
-	
-	double ret;
-	if (curl_easy_getinfo (priv->curl, CURLINFO_SPEED_DOWNLOAD, &ret) == CURLE_OK) {
-		return (guint64) ret;
-	} else {
+	if (priv->state != STM_TRANSFER_STATE_RUNNING)
 		return 0;
-	}
+	return (guint64) stm_rate_estimator_get_windowed (priv->rate);
+}
+
+
+/**
+ * stm_transfer_get_rate_estimator:
+ *
+ * @self: A #StmTransfer
+ *
+ * Get estimator measuring download rate of this transfer, for
+ * callers interested in instantaneous or average rates.
+ *
+ * Returns: A #StmRateEstimator owned by @self.
+ */
+StmRateEstimator *
+stm_transfer_get_rate_estimator (StmTransfer *self)
+{
+	return self->priv->rate;
 }
 
 
@@ -668,15 +2080,10 @@ stm_transfer_get_total_time                        (StmTransfer *self)
 {
 	StmTransferPrivate *priv = self->priv;
 
-	if (priv->curl == NULL)
-		return 0;
+	if (priv->open_time == 0)
+		return priv->elapsed;
 
-	double ret;
-	if (curl_easy_getinfo (priv->curl, CURLINFO_TOTAL_TIME, &ret) == CURLE_OK) {
-		return (guint64) ret;
-	} else {
-		return 0;
-	}
+	return priv->elapsed + (time (NULL) - priv->open_time);
 }
 
 
@@ -687,21 +2094,21 @@ stm_transfer_get_total_time                        (StmTransfer *self)
  * 
  * Get estimated time left for this transger to complete (in seconds)
  * 
- * Returns: A number of seconds.
+ * Returns: A number of seconds, 0 if unknown.
  */
 guint64
 stm_transfer_get_eta                               (StmTransfer *self)
 {
-//	StmTransferPrivate *priv = self->priv;
+	StmTransferPrivate *priv = self->priv;
 
 	guint64 size = stm_transfer_get_content_length (self);
 	guint64 completed = stm_transfer_get_downloaded (self);
-	guint64 speed = stm_transfer_get_speed (self);
 	
-	if (speed != 0)
-		return (size - completed) / speed;
-	else
+	if (priv->state != STM_TRANSFER_STATE_RUNNING || size <= completed)
 		return 0;
+
+	gint64 eta = stm_rate_estimator_get_eta (priv->rate, size - completed);
+	return eta > 0 ? (guint64) eta : 0;
 }
 
 
@@ -712,7 +2119,7 @@ stm_transfer_get_eta                               (StmTransfer *self)
  * 
  * Return computed MD5 checksum for this transfer, or NULL. NULL will
  * be returned when transfer hasn't completed or STM was compiled
- * without OpenSSL support. This checksum is computed on-the-fly.
+ * without OpenSSL support.
  * 
  * Return: A 32-character string representation of MD5 checksum, or
  * NULL if checksum is not available or STM was compiled without MD5
@@ -721,12 +2128,165 @@ stm_transfer_get_eta                               (StmTransfer *self)
 const gchar *
 stm_transfer_get_md5 (StmTransfer *self)
 {
-#ifdef HAVE_CRYPTO
+	return stm_transfer_get_digest (self, STM_DIGEST_MD5);
+}
+
+
+/**
+ * stm_transfer_set_digests:
+ * 
+ * @self A #StmTransfer
+ * @digests: Checksums to compute
+ * 
+ * Select checksums computed while downloading. Takes effect next
+ * time the transfer is started.
+ */
+void
+stm_transfer_set_digests (StmTransfer *self, StmDigestType digests)
+{
 	StmTransferPrivate *priv = self->priv;
-	return priv->md5;	
-#else
-	return NULL;
-#endif
+	priv->digests = digests & stm_digest_get_supported ();
+}
+
+
+StmDigestType
+stm_transfer_get_digests (StmTransfer *self)
+{
+	StmTransferPrivate *priv = self->priv;
+	return priv->digests;
+}
+
+
+/**
+ * stm_transfer_get_digest:
+ * 
+ * @self A #StmTransfer
+ * @type: A single checksum algorithm
+ * 
+ * Return: Lowercase hexadecimal checksum of finished transfer, or
+ * NULL if it is not available
+ */
+const gchar *
+stm_transfer_get_digest (StmTransfer *self, StmDigestType type)
+{
+	StmTransferPrivate *priv = self->priv;
+	if (priv->digest == NULL || priv->state != STM_TRANSFER_STATE_FINISHED)
+		return NULL;
+	return stm_digest_get_result (priv->digest, type);
+}
+
+
+/**
+ * stm_transfer_set_expected_digest:
+ * 
+ * @self A #StmTransfer
+ * @type: A single checksum algorithm
+ * @digest: Hexadecimal checksum, or NULL to remove it
+ * 
+ * Verify the file against a known checksum once it is downloaded.
+ * The algorithm is added to checksums computed by the transfer.
+ * Transfer ends with an error if checksums don't match.
+ * 
+ * Return: FALSE if algorithm is not supported or @digest is not a
+ * valid checksum
+ */
+gboolean
+stm_transfer_set_expected_digest (StmTransfer *self,
+                                  StmDigestType type,
+                                  const gchar *digest)
+{
+	StmTransferPrivate *priv = self->priv;
+	gint i = g_bit_nth_lsf (type, -1);
+
+	if (! (type & stm_digest_get_supported ()) || (type & (type - 1)))
+		return FALSE;
+	if (digest && ! stm_digest_type_is_valid (type, digest))
+		return FALSE;
+
+	g_free (priv->expected[i]);
+	priv->expected[i] = digest ? g_ascii_strdown (digest, -1) : NULL;
+	if (digest) {
+		priv->digests |= type;
+		priv->verification = STM_TRANSFER_VERIFY_PENDING;
+	}
+	return TRUE;
+}
+
+
+const gchar *
+stm_transfer_get_expected_digest (StmTransfer *self, StmDigestType type)
+{
+	StmTransferPrivate *priv = self->priv;
+	gint i = g_bit_nth_lsf (type, -1);
+	return i >= 0 && i < STM_DIGEST_N_TYPES ? priv->expected[i] : NULL;
+}
+
+
+/**
+ * stm_transfer_set_block_digests:
+ * 
+ * @self A #StmTransfer
+ * @type: A single checksum algorithm
+ * @block_size: Size of each block; last one may be shorter
+ * @digests: NULL-terminated array of hexadecimal checksums, one per
+ *           block
+ * 
+ * Verify the file block by block while it is downloaded. A block
+ * that does not match its checksum is downloaded again, instead of
+ * the whole file.
+ * 
+ * Return: FALSE if algorithm is not supported or any of @digests is
+ * not a valid checksum
+ */
+gboolean
+stm_transfer_set_block_digests (StmTransfer *self,
+                                StmDigestType type,
+                                guint64 block_size,
+                                gchar **digests)
+{
+	StmTransferPrivate *priv = self->priv;
+
+	if (! (type & stm_digest_get_supported ()) || (type & (type - 1))
+	    || block_size == 0 || digests == NULL || digests[0] == NULL)
+		return FALSE;
+
+	gchar **p;
+	for (p = digests; *p; p++) {
+		if (! stm_digest_type_is_valid (type, *p))
+			return FALSE;
+	}
+
+	stm_transfer_cancel_block_checks (self);
+	if (priv->block_digests) {
+		g_ptr_array_foreach (priv->block_digests, (GFunc) g_free, NULL);
+		g_ptr_array_free (priv->block_digests, TRUE);
+	}
+
+	priv->block_type = type;
+	priv->block_size = block_size;
+	priv->block_digests = g_ptr_array_new ();
+	for (p = digests; *p; p++)
+		g_ptr_array_add (priv->block_digests, g_ascii_strdown (*p, -1));
+
+	g_free (priv->block_state);
+	priv->block_state = g_new0 (guint8, priv->block_digests->len);
+	priv->verification = STM_TRANSFER_VERIFY_PENDING;
+	return TRUE;
+}
+
+
+/**
+ * stm_transfer_get_verification:
+ * 
+ * @self A #StmTransfer
+ * 
+ * Return: Result of checking the file against expected checksums
+ */
+StmTransferVerification
+stm_transfer_get_verification (StmTransfer *self)
+{
+	StmTransferPrivate *priv = self->priv;
+	return priv->verification;
 }
 
 
@@ -735,16 +2295,56 @@ stm_transfer_get_md5 (StmTransfer *self)
  * 
  * @self: A #StmTransfer
  * 
- * Return pointer to CURL easy handle.
+ * Return pointer to CURL easy handle of first open connection.
  * 
- * Returns: A <structname>CURL<structname>
+ * Returns: A <structname>CURL<structname>, or NULL if transfer
+ * is not running.
  */
 void *
 stm_transfer_get_handle (StmTransfer *self)
 {
 	StmTransferPrivate *priv = self->priv;
 	
-	return priv->curl;
+	GList *node;
+	for (node = priv->segments; node; node = node->next) {
+		StmSegment *seg = node->data;
+		if (seg->curl != NULL)
+			return seg->curl;
+	}
+	return NULL;
+}
+
+
+/**
+ * stm_segment_check_response:
+ *
+ * @seg: A #StmSegment
+ *
+ * Make sure server honoured requested range. A HTTP server which
+ * ignores Range header replies with whole content, which must not
+ * be written at segment's offset.
+ *
+ * Returns: TRUE if data may be written at segment's offset.
+ */
+static gboolean
+stm_segment_check_response (StmSegment *seg)
+{
+	StmTransferPrivate *priv = seg->transfer->priv;
+
+	seg->checked = TRUE;
+	if (seg->start == 0 || ! g_str_has_prefix (priv->uri, "http"))
+		return TRUE;
+
+	StmEngineInfo info;
+	info.response_code = 0;
+	stm_engine_get_info (seg->curl, &info);
+	if (info.response_code == 206)
+		return TRUE;
+
+	if (priv->error_msg == NULL)
+		priv->error_msg = g_strdup_printf ("Server does not support resuming (HTTP %ld)",
+		                                   info.response_code);
+	return FALSE;
 }
 
 
@@ -752,14 +2352,41 @@ stm_transfer_get_handle (StmTransfer *self)
  * stm_transfer_write_data:
  * 
  * Callback used to write received data to disk. Arguments ar the 
- * same as to <function>fwrite</function>
+ * same as to <function>fwrite</function>. Data is written at current
+ * offset of the segment passed in @userp.
  */
 static size_t
-stm_transfer_write_data (void *buffer, size_t size, size_t nmemb, void *userp)
+stm_transfer_write_data (char *buffer, size_t size, size_t nmemb, void *userp)
 {
-	StmTransfer *self = STM_TRANSFER (userp);
+	StmSegment *seg = userp;
+	StmTransfer *self = seg->transfer;
 	StmTransferPrivate *priv = self->priv;
 	
+	if (! seg->checked && ! stm_segment_check_response (seg))
+		return 0;
+
+	/* Hold off until I/O threads catch up, libcurl will deliver the
+	 * same data again after the handle is unpaused */
+	if (stm_writer_is_congested ()) {
+		seg->paused = TRUE;
+		paused_segments = g_list_prepend (paused_segments, seg);
+		return CURL_WRITEFUNC_PAUSE;
+	}
+
+	/* Same for bandwidth limit */
+	if (! stm_limiter_client_consume (priv->limiter, size * nmemb)) {
+		seg->throttled = TRUE;
+		return CURL_WRITEFUNC_PAUSE;
+	}
+
+	/* Never write past the end of segment's range */
+	size_t len = size * nmemb;
+	if (seg->end != 0 && seg->pos + len > seg->end) {
+		len = seg->end - seg->pos;
+		seg->done = TRUE;
+	}
+
+	
 /*
  	gsize bytes_written;
 	GError *error = NULL;
@@ -770,17 +2397,99 @@ stm_transfer_write_data (void *buffer, size_t size, size_t nmemb, void *userp)
 	                          &error);
 	return bytes_written;
 */
-	gsize bytes_written = fwrite (buffer, size, nmemb, priv->out);
+	GError *error = NULL;
+	if (! stm_writer_stream_write (seg->stream, buffer, len, &error)) {
+		if (priv->error_msg == NULL)
+			priv->error_msg = g_strdup (error->message);
+		g_error_free (error);
+		seg->done = FALSE;
+		return 0;
+	}
+	gsize bytes_written = len;
 	priv->completed += bytes_written;
+	stm_rate_estimator_add (priv->rate, bytes_written);
 
-#ifdef HAVE_CRYPTO
-	MD5_Update (priv->md5_ctx, buffer, (unsigned long) size*nmemb);
-#endif	
+	/* Only data that arrives in order is checksummed on-the-fly */
+	if (priv->digest)
+		stm_digest_update (priv->digest, seg->pos, buffer, bytes_written);
+	seg->pos += bytes_written;
 	
+	/* Returning less than size*nmemb makes libcurl drop connection
+	 * of a segment that reached its end */
 	return bytes_written;
 }
 
 
+/**
+ * stm_transfer_resume_paused:
+ *
+ * Unpause all segments paused in stm_transfer_write_data(). Called
+ * when disk writes have caught up.
+ */
+static gboolean
+stm_transfer_resume_paused (gpointer data)
+{
+	/* Unpausing delivers pending data immediately, which may pause
+	 * segments again */
+	GList *paused = paused_segments;
+	paused_segments = NULL;
+
+	GList *node;
+	for (node = paused; node; node = node->next) {
+		StmSegment *seg = node->data;
+		seg->paused = FALSE;
+		stm_engine_unpause (seg->curl);
+	}
+	g_list_free (paused);
+	return FALSE;
+}
+
+
+/**
+ * stm_transfer_unthrottle:
+ *
+ * Called by bandwidth limiter when transfer may receive data again.
+ */
+static void
+stm_transfer_unthrottle (StmTransfer *self)
+{
+	StmTransferPrivate *priv = self->priv;
+
+	GList *node;
+	for (node = priv->segments; node; node = node->next) {
+		StmSegment *seg = node->data;
+		if (seg->throttled) {
+			seg->throttled = FALSE;
+			stm_engine_unpause (seg->curl);
+		}
+	}
+}
+
+
+/**
+ * stm_transfer_header_callback:
+ *
+ * Callback receiving response headers. Used to find out whether
+ * server supports byte ranges.
+ */
+static size_t
+stm_transfer_header_callback (char *buffer, size_t size, size_t nmemb, void *userp)
+{
+	StmSegment *seg = userp;
+	StmTransferPrivate *priv = seg->transfer->priv;
+	size_t len = size * nmemb;
+
+	static const gchar header[] = "Accept-Ranges:";
+	if (len > sizeof (header) && g_ascii_strncasecmp (buffer, header, sizeof (header) - 1) == 0) {
+		gchar *value = g_strndup ((gchar *) buffer + sizeof (header) - 1,
+		                          len - sizeof (header) + 1);
+		priv->accept_ranges = strstr (value, "bytes") != NULL;
+		g_free (value);
+	}
+	return len;
+}
+
+
 /**
  * stm_transfer_progress_callback:
  * 
@@ -794,68 +2503,52 @@ stm_transfer_progress_callback (void *clientp,
                                 double ultotal,
                                 double ulnow)
 {
-	StmTransfer *self = STM_TRANSFER (clientp);
+	StmSegment *seg = clientp;
+	StmTransfer *self = seg->transfer;
 	StmTransferPrivate *priv = self->priv;
 
-	if (priv->length == 0)
-		priv->length = (guint64) dltotal;
+	if (priv->length == 0 && dltotal > 0)
+		priv->length = seg->start + (guint64) dltotal;
 //	priv->completed = (guint64) dlnow;
 
+	/* Aborts the transfer if it does not fit */
+	if (! stm_transfer_reserve_space (self))
+		return 1;
+	stm_transfer_attach_range_map (self, FALSE);
+	stm_segment_check_blocks (seg);
+
+	/* Length is known now, download rest of file in parallel */
+	if (dltotal > 0 && priv->connections > 1 && priv->split_id == 0
+	    && seg->end == 0 && priv->segments->next == NULL) {
+		priv->split_id = g_idle_add ((GSourceFunc) stm_transfer_split, self);
+	}
+
 	n_updates++;
 	
-	g_signal_emit (self, signals[PROGRESS], 0);
+	stm_progress_scheduler_mark_dirty (stm_progress_scheduler_get_default (), self);
 	return 0;
 }
 
 
 /**
- * stm_transfer_dispatch_message:
+ * stm_transfer_curl_done:
  * 
- * @self A #StmTransfer
- * @msg A CURL Message to be dispatched
- * 
- * Dispatch a CURL message.
- * 
- */
-static void
-stm_transfer_dispatch_message (StmTransfer *self, CURLMsg *msg)
-{
-	StmTransferPrivate *priv = self->priv;
-	g_print ("[%s]: got msg %d\n", priv->file, msg->msg);
-	switch (msg->msg) {
-		case CURLMSG_DONE: { // transfer finished
-			stm_transfer_finish (self, msg->data.result);
-		} break;
-		
-		default:
-			g_printerr ("Unrecognized message %d\n", msg->msg);
-	}
-}
-
-
-/**
- * stm_transfer_curl_callback:
- * 
- * Callback to CURL events.
- * 
- * Find relevant transfer and deliver message to that transfer.
+ * @curl: Finished CURL handle
+ * @result: Result of transfer
  * 
- * @see_also stm_transfer_dispatch_message()
+ * Callback called by network engine when a CURL handle is done.
+ * Find relevant segment and deliver result to it.
  */
 static void
-stm_transfer_curl_callback (void *data)
+stm_transfer_curl_done (CURL *curl, CURLcode result, gpointer data)
 {
-	int msgs;
-	CURLMsg *msg;
-	
-	while ((msg = curl_multi_info_read(glibcurl_handle(), &msgs)) != NULL) {
-		StmTransfer *transfer = (StmTransfer *) g_hash_table_lookup (all_transfers, msg->easy_handle);
-		if (transfer == NULL) {
-			g_printerr ("Unregistered handle %p!\n", msg->easy_handle);
-		} else {
-			stm_transfer_dispatch_message (transfer, msg);
-		}
+	StmSegment *seg = (StmSegment *) g_hash_table_lookup (all_segments, curl);
+	if (seg == NULL) {
+		g_printerr ("Unregistered handle %p!\n", curl);
+		return;
 	}
+	g_debug ("%s: segment done with %d", seg->transfer->priv->file, result);
+	stm_transfer_segment_done (seg, result);
 }
 
 /* GObject implementation */
@@ -871,19 +2564,35 @@ stm_transfer_init (StmTransfer *self)
 	priv->file = NULL;
 	priv->uri = NULL;
 	
-	priv->out = NULL;
-	priv->curl = NULL;
+	priv->writer = NULL;
+	priv->allocated = FALSE;
+	priv->segments = NULL;
+	priv->connections = 1;
+	priv->accept_ranges = FALSE;
+	priv->split_id = 0;
+	priv->draining = FALSE;
 	priv->state = STM_TRANSFER_STATE_STOPPED;
-	priv->last_time = 0;
-	priv->speed = 0.0f;
+	priv->rate = stm_rate_estimator_new ();
+	priv->limiter = stm_limiter_client_new ((StmLimiterFunc) stm_transfer_unthrottle, self);
 	
 	priv->error_buffer = g_new (gchar, CURL_ERROR_SIZE);
 	
 #ifdef HAVE_CRYPTO
-	priv->md5_ctx = g_new (MD5_CTX, 1);
-	MD5_Init (priv->md5_ctx);
-	priv->md5 = NULL;
+	priv->digests = STM_DIGEST_MD5;
+#else
+	priv->digests = STM_DIGEST_NONE;
 #endif
+	priv->digest = NULL;
+	priv->hashing = FALSE;
+	memset (priv->expected, 0, sizeof (priv->expected));
+	priv->verification = STM_TRANSFER_VERIFY_NONE;
+	priv->block_type = STM_DIGEST_NONE;
+	priv->block_size = 0;
+	priv->block_digests = NULL;
+	priv->block_state = NULL;
+	priv->block_checks = NULL;
+	priv->verifying = FALSE;
+	priv->refetched = FALSE;
 	
 //	g_print ("stm_transfer_init ()\n");
 }
@@ -902,25 +2611,46 @@ stm_transfer_dispose (GObject *object)
 	}
 	priv->disposed = TRUE;
 	
-	if (priv->out) {
+	if (priv->writer) {
 		stm_transfer_close (self);
 	}
+	stm_transfer_free_segments (self);
 	
 	g_free (priv->uri);
 	g_free (priv->file);
 	g_free (priv->error_buffer);
 	g_free (priv->error_msg);
+	stm_rate_estimator_free (priv->rate);
+	priv->rate = NULL;
+	stm_limiter_client_free (priv->limiter);
+	if (priv->handles) {
+		stm_handle_pool_unref (priv->handles);
+		priv->handles = NULL;
+	}
+	if (priv->host) {
+		stm_host_cancel_wait (priv->host, self);
+		stm_host_unref (priv->host);
+		priv->host = NULL;
+	}
+	priv->limiter = NULL;
 
-#ifdef HAVE_CRYPTO
-	g_free (priv->md5);
-	g_free (priv->md5_ctx);
-#endif
-
-	/* Unregister global message handler */
-	g_hash_table_remove (all_transfers, priv->curl);
-
-	/* Clean up */
-	curl_easy_cleanup (priv->curl);
+	if (priv->digest) {
+		stm_digest_cancel (priv->digest);
+		stm_digest_unref (priv->digest);
+		priv->digest = NULL;
+	}
+	guint i;
+	for (i = 0; i < STM_DIGEST_N_TYPES; i++) {
+		g_free (priv->expected[i]);
+		priv->expected[i] = NULL;
+	}
+	if (priv->block_digests) {
+		g_ptr_array_foreach (priv->block_digests, (GFunc) g_free, NULL);
+		g_ptr_array_free (priv->block_digests, TRUE);
+		priv->block_digests = NULL;
+	}
+	g_free (priv->block_state);
+	priv->block_state = NULL;
 
 	/* Chain up to the parent class */
 	G_OBJECT_CLASS (stm_transfer_parent_class)->dispose (object);
@@ -958,6 +2688,22 @@ stm_transfer_get_property (GObject *object, guint property_id,
 			g_value_set_uint64 (value, priv->length);
 			break;
 			
+		case PROP_CONNECTIONS:
+			g_value_set_uint (value, priv->connections);
+			break;
+			
+		case PROP_MAX_SPEED:
+			g_value_set_uint64 (value, stm_transfer_get_max_speed (self));
+			break;
+			
+		case PROP_WEIGHT:
+			g_value_set_uint (value, stm_transfer_get_weight (self));
+			break;
+			
+		case PROP_PRIORITY:
+			g_value_set_int (value, priv->priority);
+			break;
+			
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
 	}
@@ -984,6 +2730,22 @@ stm_transfer_set_property (GObject *object, guint property_id,
 			STM_DEBUG_PROP("file", priv->file);
 			break;
 			
+		case PROP_CONNECTIONS:
+			stm_transfer_set_connections (self, g_value_get_uint (value));
+			break;
+			
+		case PROP_MAX_SPEED:
+			stm_transfer_set_max_speed (self, g_value_get_uint64 (value));
+			break;
+			
+		case PROP_WEIGHT:
+			stm_transfer_set_weight (self, g_value_get_uint (value));
+			break;
+			
+		case PROP_PRIORITY:
+			stm_transfer_set_priority (self, g_value_get_int (value));
+			break;
+			
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
 	}
@@ -1027,6 +2789,14 @@ stm_transfer_class_init (StmTransferClass *klass)
 	                                  g_cclosure_marshal_VOID__VOID,
 	                                  G_TYPE_NONE, 0);
 	                                  
+	signals[STATE_CHANGED] = g_signal_new ("state-changed",
+	                                  G_TYPE_FROM_CLASS (klass),
+	                                  G_SIGNAL_RUN_LAST,
+	                                  G_STRUCT_OFFSET (StmTransferClass, state_changed),
+	                                  NULL, NULL,
+	                                  g_cclosure_marshal_VOID__VOID,
+	                                  G_TYPE_NONE, 0);
+	                                  
 	                                  
 	                                  
 	
@@ -1072,8 +2842,53 @@ stm_transfer_class_init (StmTransferClass *klass)
 	                                 0,				/* default */
 	                                 G_PARAM_READABLE));
 	                                 
+	g_object_class_install_property (gobject_class,
+	                                 PROP_CONNECTIONS,
+	                                 g_param_spec_uint (
+	                                 "connections",
+	                                 "Connections",
+	                                 "Maximum number of parallel connections",
+	                                 1,				/* min */
+	                                 STM_TRANSFER_MAX_CONNECTIONS,	/* max */
+	                                 1,				/* default */
+	                                 G_PARAM_READWRITE));
+	                                 
+	g_object_class_install_property (gobject_class,
+	                                 PROP_MAX_SPEED,
+	                                 g_param_spec_uint64 (
+	                                 "max-speed",
+	                                 "Maximum speed",
+	                                 "Download speed limit in bytes per second, 0 if unlimited",
+	                                 0,				/* min */
+	                                 G_MAXUINT64,	/* max */
+	                                 0,				/* default */
+	                                 G_PARAM_READWRITE));
+	                                 
+	g_object_class_install_property (gobject_class,
+	                                 PROP_WEIGHT,
+	                                 g_param_spec_uint (
+	                                 "weight",
+	                                 "Weight",
+	                                 "Share of global speed limit relative to other transfers",
+	                                 1,				/* min */
+	                                 G_MAXUINT,		/* max */
+	                                 STM_LIMITER_DEFAULT_WEIGHT,	/* default */
+	                                 G_PARAM_READWRITE));
+
+	g_object_class_install_property (gobject_class,
+	                                 PROP_PRIORITY,
+	                                 g_param_spec_int (
+	                                 "priority",
+	                                 "Priority",
+	                                 "Queued transfers with higher priority start first",
+	                                 G_MININT,			/* min */
+	                                 G_MAXINT,		/* max */
+	                                 0,				/* default */
+	                                 G_PARAM_READWRITE));
+	                                 
 	/* Global message dispatcher, ugly */
-	all_transfers = g_hash_table_new (g_direct_hash, g_direct_equal);
-	glibcurl_set_callback (stm_transfer_curl_callback, NULL);
+	all_segments = g_hash_table_new (g_direct_hash, g_direct_equal);
+	stm_engine_set_done_func (stm_transfer_curl_done, NULL);
+	stm_writer_set_resume_func (stm_transfer_resume_paused, NULL);
 }
 
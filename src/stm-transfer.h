@@ -27,6 +27,8 @@
 #include <gtk/gtkwidget.h>
 #include <gtk/gtkwindow.h>
 #include "stm.h"
+#include "stm-digest.h"
+#include "stm-rate-estimator.h"
 
 
 G_BEGIN_DECLS
@@ -60,6 +62,7 @@ struct _StmTransferClass
 	void				(*progress) (StmTransfer *self);
 	void				(*started)	(StmTransfer *self);
 	void				(*finished)	(StmTransfer *self);
+	void				(*state_changed) (StmTransfer *self);
 };
 
 typedef enum {
@@ -67,9 +70,28 @@ typedef enum {
 	STM_TRANSFER_STATE_STOPPED,
 	STM_TRANSFER_STATE_RUNNING,
 	STM_TRANSFER_STATE_FINISHED,
-	STM_TRANSFER_STATE_ERROR
+	STM_TRANSFER_STATE_ERROR,
+	STM_TRANSFER_STATE_QUEUED
 } StmTransferState;
 
+/* Upper limit for number of parallel connections per transfer */
+#define STM_TRANSFER_MAX_CONNECTIONS	16
+
+/**
+ * StmTransferVerification:
+ *
+ * @STM_TRANSFER_VERIFY_NONE: No checksum is known in advance
+ * @STM_TRANSFER_VERIFY_PENDING: File has not been verified yet
+ * @STM_TRANSFER_VERIFY_PASSED: File matches expected checksums
+ * @STM_TRANSFER_VERIFY_FAILED: File is corrupted
+ */
+typedef enum {
+	STM_TRANSFER_VERIFY_NONE,
+	STM_TRANSFER_VERIFY_PENDING,
+	STM_TRANSFER_VERIFY_PASSED,
+	STM_TRANSFER_VERIFY_FAILED
+} StmTransferVerification;
+
 GType
 stm_transfer_get_type				(void);
 
@@ -83,6 +105,9 @@ stm_transfer_start (StmTransfer *self);
 void
 stm_transfer_stop (StmTransfer *self);
 
+void
+stm_transfer_queue (StmTransfer *self);
+
 /*
 void
 stm_transfer_open (StmTransfer *self);
@@ -93,6 +118,32 @@ stm_transfer_get_handle (StmTransfer *self);
 const gchar *
 stm_transfer_get_md5 (StmTransfer *self);
 
+void
+stm_transfer_set_digests (StmTransfer *self, StmDigestType digests);
+
+StmDigestType
+stm_transfer_get_digests (StmTransfer *self);
+
+const gchar *
+stm_transfer_get_digest (StmTransfer *self, StmDigestType type);
+
+gboolean
+stm_transfer_set_expected_digest (StmTransfer *self,
+                                  StmDigestType type,
+                                  const gchar *digest);
+
+const gchar *
+stm_transfer_get_expected_digest (StmTransfer *self, StmDigestType type);
+
+gboolean
+stm_transfer_set_block_digests (StmTransfer *self,
+                                StmDigestType type,
+                                guint64 block_size,
+                                gchar **digests);
+
+StmTransferVerification
+stm_transfer_get_verification (StmTransfer *self);
+
 void
 stm_transfer_open_file (StmTransfer *self);
 
@@ -121,12 +172,49 @@ stm_transfer_get_downloaded                        (StmTransfer *self);
 guint64
 stm_transfer_get_speed                             (StmTransfer *self);
 
+StmRateEstimator *
+stm_transfer_get_rate_estimator                    (StmTransfer *self);
+
 guint64
 stm_transfer_get_total_time                        (StmTransfer *self);
 
 guint64
 stm_transfer_get_eta                               (StmTransfer *self);
 
+void
+stm_transfer_set_connections                       (StmTransfer *self,
+                                                    guint connections);
+
+guint
+stm_transfer_get_connections                       (StmTransfer *self);
+
+guint
+stm_transfer_get_n_segments                        (StmTransfer *self);
+
+gboolean
+stm_transfer_is_multiplexed                        (StmTransfer *self);
+
+void
+stm_transfer_set_max_speed                         (StmTransfer *self,
+                                                    guint64 speed);
+
+guint64
+stm_transfer_get_max_speed                         (StmTransfer *self);
+
+void
+stm_transfer_set_weight                            (StmTransfer *self,
+                                                    guint weight);
+
+guint
+stm_transfer_get_weight                            (StmTransfer *self);
+
+void
+stm_transfer_set_priority                          (StmTransfer *self,
+                                                    gint priority);
+
+gint
+stm_transfer_get_priority                          (StmTransfer *self);
+
 
 G_END_DECLS
 
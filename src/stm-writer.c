@@ -0,0 +1,1312 @@
+/*
+ * Simple Transfer Manager
+ * -----------------------
+ *
+ * Copyright (C) 2008 Przemysław Sitek
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef HAVE_LIBURING
+#  include <liburing.h>
+#  include <sys/eventfd.h>
+#endif
+#include "stm-range-map.h"
+#include "stm-writer.h"
+
+
+/* Buffers of default size are recycled instead of being freed */
+#define STM_WRITER_MAX_FREE_BUFFERS	64
+
+/* Number of submission queue entries of io_uring backend */
+#define STM_WRITER_URING_DEPTH		128
+
+/* Written data is flushed after this many bytes, to mark it in range map */
+#define STM_WRITER_SYNC_BYTES		(16 * 1024 * 1024)
+
+
+/**
+ * StmWriter:
+ *
+ * Destination file shared by all streams writing to it. Every write
+ * carries its own offset, so streams never disturb each other.
+ */
+struct _StmWriter
+{
+	gint		 ref_count;
+	int		 fd;		// File descriptor
+	gchar		*file;		// File name, for error messages
+	gsize		 buffer_size;	// Buffer size for new streams
+	StmRangeMap	*map;		// Record of written ranges, may be NULL
+
+	/* Protected by pool.mutex */
+	guint		 pending;	// Number of queued or running jobs
+	GArray		*unsynced;	// StmRange's written, but not flushed yet
+	guint64		 unsynced_bytes;
+	gboolean	 syncing;	// Flush for range map is queued
+	GError		*error;		// First failure of a background write
+	StmWriterFunc	 drain_func;	// Called when pending drops to zero
+	gpointer	 drain_data;
+	gboolean	 drain_sync;	// Flush file to disk before calling drain_func
+};
+
+
+/**
+ * StmWriterStream:
+ *
+ * Sequential writer starting at given offset of a #StmWriter.
+ * Small writes are collected in an aligned buffer, and every full
+ * buffer is handed over to I/O threads.
+ */
+struct _StmWriterStream
+{
+	StmWriter	*writer;
+	guint64		 offset;	// File offset of first buffered byte
+	guchar		*buffer;	// Aligned buffer, NULL until first write
+	gsize		 size;		// Buffer capacity
+	gsize		 fill;		// Number of buffered bytes
+};
+
+
+/**
+ * StmWriterJob:
+ *
+ * A buffer waiting to be written by one of I/O threads.
+ */
+typedef enum {
+	STM_WRITER_JOB_WRITE,
+	STM_WRITER_JOB_FSYNC,
+	STM_WRITER_JOB_ALLOCATE
+} StmWriterJobType;
+
+typedef struct _StmWriterJob StmWriterJob;
+struct _StmWriterJob
+{
+	StmWriterJobType type;
+	StmWriter	*writer;
+	guint64		 offset;
+	guint64		 length;	// Length of range to allocate
+	guchar		*buffer;
+	gsize		 size;		// Buffer capacity
+	gsize		 len;		// Number of bytes to write
+	gsize		 done;		// Number of bytes already written
+	GArray		*ranges;	// Ranges a flush makes durable
+};
+
+
+/**
+ * Write-behind state shared by all writers. Network callbacks only
+ * queue buffers, actual writes happen in a thread pool. Amount of
+ * queued data is bounded; callers are expected to check
+ * stm_writer_is_congested() and hold off until resume function is
+ * called.
+ */
+static struct {
+	StmWriterBackend backend;
+	GThreadPool	*threads;
+	GMutex		 mutex;
+	gboolean	 initialized;	// Backend has been started
+	guint		 n_threads;
+	gsize		 max_queued;	// Congestion threshold, in bytes
+	gsize		 queued;	// Bytes queued or being written
+	gboolean	 congested;	// Somebody is waiting for room
+	GSourceFunc	 resume_func;
+	gpointer	 resume_data;
+	GSList		*free_buffers;	// Recycled default-sized buffers
+	guint		 n_free_buffers;
+} pool = {
+	STM_WRITER_BACKEND_THREADS,
+	NULL, { NULL }, FALSE,
+	STM_WRITER_DEFAULT_THREADS,
+	STM_WRITER_DEFAULT_MAX_QUEUED,
+	0, FALSE, NULL, NULL, NULL, 0
+};
+
+
+#ifdef HAVE_LIBURING
+/**
+ * io_uring backend. All writers share one ring, serviced by a single
+ * thread which submits every job queued since its last wakeup with
+ * one system call. A read of an eventfd is kept in the ring, so that
+ * new jobs wake the thread while it waits for completions.
+ */
+static struct {
+	struct io_uring	 ring;
+	GAsyncQueue	*queue;		// Jobs waiting for submission
+	GThread		*thread;
+	int		 wakeup_fd;	// eventfd signalled when jobs are queued
+	gint		 kicked;	// wakeup_fd has been signalled
+	guint64		 wakeup_value;	// Buffer for read of wakeup_fd
+} uring;
+
+static gboolean
+stm_writer_uring_init (void);
+#endif
+
+
+static void
+stm_writer_job_run (StmWriterJob *job, gpointer data);
+
+
+/**
+ * stm_writer_pool_init:
+ *
+ * Create I/O threads. Must be called from main thread.
+ *
+ * Backend set with stm_writer_set_backend() may be overriden with
+ * STM_IO_BACKEND environment variable, set to "threads" or "uring".
+ */
+static void
+stm_writer_pool_init (void)
+{
+	if (pool.initialized)
+		return;
+	pool.initialized = TRUE;
+
+	const gchar *env = g_getenv ("STM_IO_BACKEND");
+	if (env != NULL) {
+		if (strcmp (env, "uring") == 0)
+			pool.backend = STM_WRITER_BACKEND_URING;
+		else if (strcmp (env, "threads") == 0)
+			pool.backend = STM_WRITER_BACKEND_THREADS;
+		else
+			g_printerr ("Unknown I/O backend %s\n", env);
+	}
+
+	if (pool.backend == STM_WRITER_BACKEND_URING) {
+#ifdef HAVE_LIBURING
+		if (! stm_writer_uring_init ())
+			pool.backend = STM_WRITER_BACKEND_THREADS;
+#else
+		g_printerr ("io_uring support not compiled in\n");
+		pool.backend = STM_WRITER_BACKEND_THREADS;
+#endif
+	}
+
+	if (pool.backend == STM_WRITER_BACKEND_THREADS)
+		pool.threads = g_thread_pool_new ((GFunc) stm_writer_job_run, NULL,
+		                                  pool.n_threads, FALSE, NULL);
+}
+
+
+/**
+ * stm_writer_set_backend:
+ *
+ * @backend: A #StmWriterBackend
+ *
+ * Choose how data is written to disk. Must be called before first
+ * writer is opened.
+ */
+void
+stm_writer_set_backend (StmWriterBackend backend)
+{
+	if (pool.initialized) {
+		g_printerr ("I/O backend can't be changed after first file is opened\n");
+		return;
+	}
+	pool.backend = backend;
+}
+
+
+/**
+ * stm_writer_get_backend:
+ *
+ * Returns: Backend writing data to disk.
+ */
+StmWriterBackend
+stm_writer_get_backend (void)
+{
+	return pool.backend;
+}
+
+
+/**
+ * stm_writer_set_threads:
+ *
+ * @threads: Number of I/O threads
+ *
+ * Set how many threads write data to disk in parallel.
+ */
+void
+stm_writer_set_threads (guint threads)
+{
+	pool.n_threads = MAX (threads, 1);
+	if (pool.threads != NULL)
+		g_thread_pool_set_max_threads (pool.threads, pool.n_threads, NULL);
+}
+
+
+/**
+ * stm_writer_set_max_queued:
+ *
+ * @bytes: Amount of data
+ *
+ * Set how much data may be waiting for I/O threads before writers
+ * are considered congested.
+ */
+void
+stm_writer_set_max_queued (gsize bytes)
+{
+	pool.max_queued = MAX (bytes, STM_WRITER_DEFAULT_BUFFER_SIZE);
+}
+
+
+/**
+ * stm_writer_set_resume_func:
+ *
+ * @func: Function to call
+ * @data: Data passed to @func
+ *
+ * Set function called from main loop when queue has drained below
+ * half of its limit, after stm_writer_is_congested() has returned
+ * TRUE.
+ */
+void
+stm_writer_set_resume_func (GSourceFunc func, gpointer data)
+{
+	pool.resume_func = func;
+	pool.resume_data = data;
+}
+
+
+/**
+ * stm_writer_is_congested:
+ *
+ * Check whether I/O threads are lagging behind. Callers should stop
+ * producing data until resume function is called.
+ *
+ * Returns: TRUE if queue is full.
+ */
+gboolean
+stm_writer_is_congested (void)
+{
+	if (! pool.initialized)
+		return FALSE;
+
+	g_mutex_lock (&pool.mutex);
+	gboolean congested = pool.queued >= pool.max_queued;
+	if (congested)
+		pool.congested = TRUE;
+	g_mutex_unlock (&pool.mutex);
+
+	return congested;
+}
+
+
+/**
+ * stm_writer_buffer_new:
+ *
+ * Get an aligned buffer of given size, recycled if possible.
+ */
+static guchar *
+stm_writer_buffer_new (gsize size)
+{
+	guchar *buffer = NULL;
+
+	if (size == STM_WRITER_DEFAULT_BUFFER_SIZE && pool.initialized) {
+		g_mutex_lock (&pool.mutex);
+		if (pool.free_buffers != NULL) {
+			buffer = pool.free_buffers->data;
+			pool.free_buffers = g_slist_delete_link (pool.free_buffers,
+			                                         pool.free_buffers);
+			pool.n_free_buffers--;
+		}
+		g_mutex_unlock (&pool.mutex);
+	}
+
+	if (buffer == NULL) {
+		void *mem;
+		if (posix_memalign (&mem, STM_WRITER_ALIGNMENT, size) != 0)
+			g_error ("Unable to allocate %lu bytes", (unsigned long) size);
+		buffer = mem;
+	}
+	return buffer;
+}
+
+
+/**
+ * stm_writer_buffer_free:
+ *
+ * Return buffer obtained with stm_writer_buffer_new().
+ */
+static void
+stm_writer_buffer_free (guchar *buffer, gsize size)
+{
+	if (size == STM_WRITER_DEFAULT_BUFFER_SIZE && pool.initialized) {
+		g_mutex_lock (&pool.mutex);
+		if (pool.n_free_buffers < STM_WRITER_MAX_FREE_BUFFERS) {
+			pool.free_buffers = g_slist_prepend (pool.free_buffers, buffer);
+			pool.n_free_buffers++;
+			buffer = NULL;
+		}
+		g_mutex_unlock (&pool.mutex);
+	}
+	free (buffer);
+}
+
+
+/**
+ * stm_writer_set_error:
+ *
+ * Fill @error from errno.
+ */
+static void
+stm_writer_set_error (StmWriter *writer, GError **error, const gchar *what)
+{
+	int saved_errno = errno;
+	g_set_error (error, G_FILE_ERROR,
+	             g_file_error_from_errno (saved_errno),
+	             "Unable to %s %s: %s",
+	             what, writer->file, g_strerror (saved_errno));
+}
+
+
+/**
+ * stm_writer_open:
+ *
+ * @file: File name
+ * @truncate: Whether existing file contents should be discarded
+ * @error: Return location for error
+ *
+ * Open a file for positional writing. File is created if it does not
+ * exist.
+ *
+ * Returns: A new #StmWriter, or NULL on failure. Free with
+ * stm_writer_unref().
+ */
+StmWriter *
+stm_writer_open (const gchar *file, gboolean truncate, GError **error)
+{
+	int flags = O_RDWR | O_CREAT;
+	if (truncate)
+		flags |= O_TRUNC;
+
+	int fd = open (file, flags, 0666);
+	if (fd < 0) {
+		int saved_errno = errno;
+		g_set_error (error, G_FILE_ERROR,
+		             g_file_error_from_errno (saved_errno),
+		             "Unable to open %s for writing: %s",
+		             file, g_strerror (saved_errno));
+		return NULL;
+	}
+
+	stm_writer_pool_init ();
+
+	StmWriter *writer = g_new0 (StmWriter, 1);
+	writer->ref_count = 1;
+	writer->fd = fd;
+	writer->file = g_strdup (file);
+	writer->buffer_size = STM_WRITER_DEFAULT_BUFFER_SIZE;
+	writer->unsynced = g_array_new (FALSE, FALSE, sizeof (StmRange));
+
+	return writer;
+}
+
+
+/**
+ * stm_writer_ref:
+ *
+ * @writer: A #StmWriter
+ *
+ * Returns: @writer
+ */
+StmWriter *
+stm_writer_ref (StmWriter *writer)
+{
+	g_atomic_int_inc (&writer->ref_count);
+	return writer;
+}
+
+
+/**
+ * stm_writer_unref:
+ *
+ * @writer: A #StmWriter
+ *
+ * Drop a reference. File is closed when last reference is dropped,
+ * which may be in an I/O thread after last queued write.
+ */
+void
+stm_writer_unref (StmWriter *writer)
+{
+	if (! g_atomic_int_dec_and_test (&writer->ref_count))
+		return;
+
+	if (close (writer->fd) < 0)
+		g_printerr ("Unable to close %s: %s\n", writer->file, g_strerror (errno));
+	if (writer->error)
+		g_error_free (writer->error);
+	if (writer->map)
+		stm_range_map_close (writer->map);
+	g_array_free (writer->unsynced, TRUE);
+	g_free (writer->file);
+	g_free (writer);
+}
+
+
+/**
+ * stm_writer_get_fd:
+ *
+ * @writer: A #StmWriter
+ *
+ * Returns: File descriptor owned by @writer.
+ */
+int
+stm_writer_get_fd (StmWriter *writer)
+{
+	return writer->fd;
+}
+
+
+/**
+ * stm_writer_set_buffer_size:
+ *
+ * @writer: A #StmWriter
+ * @size: Size of write batches, in bytes
+ *
+ * Set buffer size of streams created afterwards. Size is rounded up
+ * to a multiple of #STM_WRITER_ALIGNMENT.
+ */
+void
+stm_writer_set_buffer_size (StmWriter *writer, gsize size)
+{
+	size = MAX (size, STM_WRITER_ALIGNMENT);
+	writer->buffer_size = (size + STM_WRITER_ALIGNMENT - 1)
+	                      / STM_WRITER_ALIGNMENT * STM_WRITER_ALIGNMENT;
+}
+
+
+/**
+ * stm_writer_get_buffer_size:
+ *
+ * @writer: A #StmWriter
+ *
+ * Returns: Buffer size of new streams, in bytes.
+ */
+gsize
+stm_writer_get_buffer_size (StmWriter *writer)
+{
+	return writer->buffer_size;
+}
+
+
+/**
+ * stm_writer_set_range_map:
+ *
+ * @writer: A #StmWriter
+ * @map: A #StmRangeMap, ownership is taken
+ *
+ * Record every range written from now on in @map. A range is only
+ * marked once a flush following the write has completed, so that
+ * the map never claims data which could be lost on a crash. Map is
+ * closed together with @writer.
+ */
+void
+stm_writer_set_range_map (StmWriter *writer, StmRangeMap *map)
+{
+	g_mutex_lock (&pool.mutex);
+	StmRangeMap *old = writer->map;
+	writer->map = map;
+	g_mutex_unlock (&pool.mutex);
+
+	if (old != NULL)
+		stm_range_map_close (old);
+}
+
+
+/**
+ * stm_writer_get_range_map:
+ *
+ * @writer: A #StmWriter
+ *
+ * Returns: Range map set with stm_writer_set_range_map(), or NULL.
+ */
+StmRangeMap *
+stm_writer_get_range_map (StmWriter *writer)
+{
+	return writer->map;
+}
+
+
+/**
+ * stm_writer_check_error:
+ *
+ * @writer: A #StmWriter
+ * @error: Return location for error
+ *
+ * Report failure of a background write, if there was any.
+ *
+ * Returns: FALSE if a write has failed.
+ */
+static gboolean
+stm_writer_check_error (StmWriter *writer, GError **error)
+{
+	if (! pool.initialized)
+		return TRUE;
+
+	g_mutex_lock (&pool.mutex);
+	gboolean ok = writer->error == NULL;
+	if (! ok && error != NULL)
+		*error = g_error_copy (writer->error);
+	g_mutex_unlock (&pool.mutex);
+
+	return ok;
+}
+
+
+/**
+ * stm_writer_drain_dispatch:
+ *
+ * Idle callback delivering drain notification in main loop.
+ */
+static gboolean
+stm_writer_drain_dispatch (StmWriter *writer)
+{
+	g_mutex_lock (&pool.mutex);
+	StmWriterFunc func = writer->drain_func;
+	gpointer data = writer->drain_data;
+	GError *error = writer->error ? g_error_copy (writer->error) : NULL;
+	writer->drain_func = NULL;
+	writer->drain_data = NULL;
+	g_mutex_unlock (&pool.mutex);
+
+	if (func != NULL)
+		func (writer, error, data);
+	if (error != NULL)
+		g_error_free (error);
+
+	stm_writer_unref (writer);
+	return FALSE;
+}
+
+
+/**
+ * stm_writer_drain:
+ *
+ * @writer: A #StmWriter
+ * @func: Function to call
+ * @data: Data passed to @func
+ *
+ * Call @func from main loop once all data submitted so far has been
+ * written. First write error, if any, is passed to @func.
+ */
+void
+stm_writer_drain (StmWriter *writer, StmWriterFunc func, gpointer data)
+{
+	g_mutex_lock (&pool.mutex);
+	writer->drain_func = func;
+	writer->drain_data = data;
+	writer->drain_sync = FALSE;
+	gboolean idle = writer->pending == 0;
+	g_mutex_unlock (&pool.mutex);
+
+	if (idle)
+		g_idle_add ((GSourceFunc) stm_writer_drain_dispatch, stm_writer_ref (writer));
+}
+
+
+static void
+stm_writer_job_push (StmWriterJob *job);
+
+
+/**
+ * stm_writer_job_new:
+ *
+ * Create a job and account for it. Must be called with pool.mutex
+ * held. A flush takes over ranges written so far, as it acts as a
+ * barrier for them.
+ */
+static StmWriterJob *
+stm_writer_job_new (StmWriter *writer, StmWriterJobType type)
+{
+	StmWriterJob *job = g_new0 (StmWriterJob, 1);
+	job->type = type;
+	job->writer = stm_writer_ref (writer);
+	writer->pending++;
+
+	if (type == STM_WRITER_JOB_FSYNC) {
+		job->ranges = writer->unsynced;
+		writer->unsynced = g_array_new (FALSE, FALSE, sizeof (StmRange));
+		writer->unsynced_bytes = 0;
+	}
+
+	return job;
+}
+
+
+/**
+ * stm_writer_sync:
+ *
+ * @writer: A #StmWriter
+ * @func: Function to call
+ * @data: Data passed to @func
+ *
+ * Like stm_writer_drain(), but also flush file contents to stable
+ * storage before calling @func.
+ */
+void
+stm_writer_sync (StmWriter *writer, StmWriterFunc func, gpointer data)
+{
+	StmWriterJob *job = NULL;
+
+	g_mutex_lock (&pool.mutex);
+	writer->drain_func = func;
+	writer->drain_data = data;
+	writer->drain_sync = TRUE;
+	if (writer->pending == 0) {
+		writer->drain_sync = FALSE;
+		job = stm_writer_job_new (writer, STM_WRITER_JOB_FSYNC);
+	}
+	g_mutex_unlock (&pool.mutex);
+
+	if (job != NULL)
+		stm_writer_job_push (job);
+}
+
+
+/**
+ * stm_writer_cancel_drain:
+ *
+ * @writer: A #StmWriter
+ *
+ * Cancel notification requested with stm_writer_drain() or
+ * stm_writer_sync().
+ */
+void
+stm_writer_cancel_drain (StmWriter *writer)
+{
+	g_mutex_lock (&pool.mutex);
+	writer->drain_func = NULL;
+	writer->drain_data = NULL;
+	writer->drain_sync = FALSE;
+	g_mutex_unlock (&pool.mutex);
+}
+
+
+/**
+ * stm_writer_job_complete:
+ *
+ * @job: A finished #StmWriterJob
+ * @error: Failure of @job, or NULL. Ownership is taken.
+ *
+ * Account for a finished job and free it. May be called from any
+ * thread.
+ */
+static void
+stm_writer_job_complete (StmWriterJob *job, GError *error)
+{
+	StmWriter *writer = job->writer;
+	StmWriterJob *sync = NULL;
+
+	if (job->buffer != NULL)
+		stm_writer_buffer_free (job->buffer, job->size);
+
+	gboolean failed = error != NULL;
+
+	g_mutex_lock (&pool.mutex);
+	if (error != NULL && writer->error == NULL) {
+		writer->error = error;
+		error = NULL;
+	}
+
+	/* Written ranges wait for the next flush */
+	if (job->type == STM_WRITER_JOB_WRITE && job->done == job->len && writer->map) {
+		StmRange range = { job->offset, job->offset + job->len };
+		g_array_append_val (writer->unsynced, range);
+		writer->unsynced_bytes += job->len;
+		if (writer->unsynced_bytes >= STM_WRITER_SYNC_BYTES && ! writer->syncing) {
+			writer->syncing = TRUE;
+			sync = stm_writer_job_new (writer, STM_WRITER_JOB_FSYNC);
+		}
+	}
+
+	/* Bits are atomic, map is only guarded against replacement */
+	if (job->type == STM_WRITER_JOB_FSYNC) {
+		guint i;
+		for (i = 0; ! failed && writer->map && i < job->ranges->len; i++) {
+			StmRange *range = &g_array_index (job->ranges, StmRange, i);
+			stm_range_map_mark (writer->map, range->start, range->end - range->start);
+		}
+		g_array_free (job->ranges, TRUE);
+		writer->syncing = FALSE;
+	}
+
+	gboolean drained = --writer->pending == 0 && writer->drain_func != NULL;
+	if (drained && writer->drain_sync && writer->error == NULL) {
+		/* Data has been written, now make it durable */
+		writer->drain_sync = FALSE;
+		sync = stm_writer_job_new (writer, STM_WRITER_JOB_FSYNC);
+		drained = FALSE;
+	}
+
+	pool.queued -= job->len;
+	gboolean resume = pool.congested && pool.queued <= pool.max_queued / 2;
+	if (resume)
+		pool.congested = FALSE;
+	g_mutex_unlock (&pool.mutex);
+
+	if (error != NULL)
+		g_error_free (error);
+	if (sync != NULL)
+		stm_writer_job_push (sync);
+	if (drained)
+		g_idle_add ((GSourceFunc) stm_writer_drain_dispatch, stm_writer_ref (writer));
+	if (resume && pool.resume_func != NULL)
+		g_idle_add (pool.resume_func, pool.resume_data);
+
+	stm_writer_unref (writer);
+	g_free (job);
+}
+
+
+/**
+ * stm_writer_job_run:
+ *
+ * Body of I/O threads of the default backend. Perform a job with
+ * blocking system calls.
+ */
+static void
+stm_writer_job_run (StmWriterJob *job, gpointer data)
+{
+	StmWriter *writer = job->writer;
+	GError *error = NULL;
+
+	switch (job->type) {
+		case STM_WRITER_JOB_WRITE:
+			while (job->done < job->len) {
+				ssize_t n = pwrite (writer->fd, job->buffer + job->done,
+				                    job->len - job->done,
+				                    (off_t) (job->offset + job->done));
+				if (n < 0 && errno == EINTR)
+					continue;
+				if (n <= 0) {
+					/* No progress would otherwise loop forever */
+					if (n == 0)
+						errno = EIO;
+					stm_writer_set_error (writer, &error, "write");
+					break;
+				}
+				job->done += n;
+			}
+			break;
+
+		case STM_WRITER_JOB_FSYNC:
+			if (fsync (writer->fd) < 0)
+				stm_writer_set_error (writer, &error, "flush");
+			break;
+
+		case STM_WRITER_JOB_ALLOCATE:
+			if (fallocate (writer->fd, 0, (off_t) job->offset, (off_t) job->length) < 0
+			    && errno != EOPNOTSUPP)
+				stm_writer_set_error (writer, &error, "allocate space for");
+			break;
+	}
+
+	stm_writer_job_complete (job, error);
+}
+
+
+#ifdef HAVE_LIBURING
+/**
+ * stm_writer_uring_prep:
+ *
+ * Fill a submission queue entry for a job.
+ *
+ * Returns: FALSE if submission queue is full.
+ */
+static gboolean
+stm_writer_uring_prep (StmWriterJob *job)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe (&uring.ring);
+	if (sqe == NULL)
+		return FALSE;
+
+	StmWriter *writer = job->writer;
+	switch (job->type) {
+		case STM_WRITER_JOB_WRITE:
+			io_uring_prep_write (sqe, writer->fd, job->buffer + job->done,
+			                     job->len - job->done, job->offset + job->done);
+			break;
+
+		case STM_WRITER_JOB_FSYNC:
+			io_uring_prep_fsync (sqe, writer->fd, 0);
+			break;
+
+		case STM_WRITER_JOB_ALLOCATE:
+			io_uring_prep_fallocate (sqe, writer->fd, 0, job->offset, job->length);
+			break;
+	}
+	io_uring_sqe_set_data (sqe, job);
+	return TRUE;
+}
+
+
+/* Failed operations, by job type */
+static const gchar *stm_writer_uring_what[] = { "write", "flush", "allocate space for" };
+
+
+/**
+ * stm_writer_uring_arm:
+ *
+ * Put a read of wakeup eventfd in the ring.
+ *
+ * Returns: FALSE if submission queue is full.
+ */
+static gboolean
+stm_writer_uring_arm (void)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe (&uring.ring);
+	if (sqe == NULL)
+		return FALSE;
+
+	io_uring_prep_read (sqe, uring.wakeup_fd, &uring.wakeup_value,
+	                    sizeof (uring.wakeup_value), 0);
+	io_uring_sqe_set_data (sqe, &uring);
+	return TRUE;
+}
+
+
+/**
+ * stm_writer_uring_resubmit:
+ *
+ * Submit rest of @job again, or put it on @deferred if submission
+ * queue is full, so that it is retried once there is room.
+ *
+ * Returns: TRUE if job has been resubmitted.
+ */
+static gboolean
+stm_writer_uring_resubmit (StmWriterJob *job, GQueue *deferred)
+{
+	if (stm_writer_uring_prep (job))
+		return TRUE;
+
+	g_queue_push_tail (deferred, job);
+	return FALSE;
+}
+
+
+/**
+ * stm_writer_uring_reap:
+ *
+ * Process a completion. Interrupted jobs and short writes are
+ * resubmitted; those which do not fit in the ring go to @deferred.
+ *
+ * Returns: TRUE if job is still in flight.
+ */
+static gboolean
+stm_writer_uring_reap (StmWriterJob *job, int res, GQueue *deferred)
+{
+	GError *error = NULL;
+
+	if (res == -EINTR || res == -EAGAIN)
+		return stm_writer_uring_resubmit (job, deferred);
+
+	/* Preallocation is only a hint on file systems without support */
+	if (res == -EOPNOTSUPP && job->type == STM_WRITER_JOB_ALLOCATE)
+		res = 0;
+
+	/* No progress would otherwise be resubmitted forever */
+	if (res == 0 && job->type == STM_WRITER_JOB_WRITE && job->done < job->len)
+		res = -EIO;
+
+	if (res < 0) {
+		errno = -res;
+		stm_writer_set_error (job->writer, &error, stm_writer_uring_what[job->type]);
+	} else if (job->type == STM_WRITER_JOB_WRITE) {
+		job->done += res;
+		if (job->done < job->len)
+			return stm_writer_uring_resubmit (job, deferred);
+	}
+
+	stm_writer_job_complete (job, error);
+	return FALSE;
+}
+
+
+/**
+ * stm_writer_uring_thread:
+ *
+ * Body of io_uring thread. Sleeps on job queue when nothing is in
+ * flight, otherwise collects all queued jobs, submits them together
+ * and waits for completions or for more jobs, whichever comes first.
+ *
+ * If the ring stops accepting submissions, jobs it holds are failed
+ * and the thread goes on with blocking writes.
+ */
+static gpointer
+stm_writer_uring_thread (gpointer data)
+{
+	GHashTable *in_flight = g_hash_table_new (NULL, NULL);	// Jobs owned by the ring
+	GQueue *deferred = g_queue_new ();	// Jobs which did not fit in the ring
+	gboolean armed = FALSE;			// Read of wakeup_fd is in the ring
+	int ret;
+
+	for (;;) {
+		if (g_hash_table_size (in_flight) == 0 && g_queue_is_empty (deferred))
+			g_queue_push_tail (deferred, g_async_queue_pop (uring.queue));
+
+		/* Deferred jobs go first, new ones only once all of them fit */
+		while (! g_queue_is_empty (deferred)
+		       && stm_writer_uring_prep (g_queue_peek_head (deferred)))
+			g_hash_table_add (in_flight, g_queue_pop_head (deferred));
+		while (g_queue_is_empty (deferred)) {
+			StmWriterJob *job = g_async_queue_try_pop (uring.queue);
+			if (job == NULL)
+				break;
+			if (stm_writer_uring_prep (job))
+				g_hash_table_add (in_flight, job);
+			else
+				g_queue_push_tail (deferred, job);
+		}
+
+		if (! armed)
+			armed = stm_writer_uring_arm ();
+
+		/* Unsubmitted entries stay in the ring for next attempt */
+		ret = io_uring_submit_and_wait (&uring.ring, 1);
+		if (ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY)
+			break;
+
+		struct io_uring_cqe *cqe;
+		while (io_uring_peek_cqe (&uring.ring, &cqe) == 0) {
+			gpointer tag = io_uring_cqe_get_data (cqe);
+			int res = cqe->res;
+			io_uring_cqe_seen (&uring.ring, cqe);
+
+			/* Jobs queued from now on signal wakeup_fd again */
+			if (tag == &uring) {
+				armed = FALSE;
+				g_atomic_int_set (&uring.kicked, 0);
+				continue;
+			}
+
+			/* Resubmitted job stays in flight, deferred one does not */
+			if (! stm_writer_uring_reap (tag, res, deferred))
+				g_hash_table_remove (in_flight, tag);
+		}
+	}
+
+	g_printerr ("io_uring submission failed, writing without it: %s\n",
+	            g_strerror (-ret));
+
+	/* Whatever the ring holds can't be relied on to complete */
+	GHashTableIter iter;
+	gpointer tag;
+	g_hash_table_iter_init (&iter, in_flight);
+	while (g_hash_table_iter_next (&iter, &tag, NULL)) {
+		StmWriterJob *job = tag;
+		GError *error = NULL;
+		errno = -ret;
+		stm_writer_set_error (job->writer, &error, stm_writer_uring_what[job->type]);
+		stm_writer_job_complete (job, error);
+	}
+	g_hash_table_destroy (in_flight);
+
+	StmWriterJob *job;
+	while ((job = g_queue_pop_head (deferred)) != NULL)
+		stm_writer_job_run (job, NULL);
+	g_queue_free (deferred);
+
+	for (;;)
+		stm_writer_job_run (g_async_queue_pop (uring.queue), NULL);
+	return NULL;
+}
+
+
+/**
+ * stm_writer_uring_init:
+ *
+ * Set up the ring and its thread.
+ *
+ * Returns: FALSE if io_uring is not available, for example on an old
+ * kernel.
+ */
+static gboolean
+stm_writer_uring_init (void)
+{
+	int ret = io_uring_queue_init (STM_WRITER_URING_DEPTH, &uring.ring, 0);
+	if (ret < 0) {
+		g_printerr ("Unable to set up io_uring, using I/O threads: %s\n",
+		            g_strerror (-ret));
+		return FALSE;
+	}
+
+	uring.wakeup_fd = eventfd (0, EFD_CLOEXEC);
+	if (uring.wakeup_fd < 0) {
+		g_printerr ("Unable to set up io_uring, using I/O threads: %s\n",
+		            g_strerror (errno));
+		io_uring_queue_exit (&uring.ring);
+		return FALSE;
+	}
+
+	uring.queue = g_async_queue_new ();
+	GError *error = NULL;
+	uring.thread = g_thread_try_new ("stm-uring", stm_writer_uring_thread, NULL, &error);
+	if (uring.thread == NULL) {
+		g_printerr ("Unable to start io_uring thread, using I/O threads: %s\n",
+		            error->message);
+		g_error_free (error);
+		g_async_queue_unref (uring.queue);
+		close (uring.wakeup_fd);
+		io_uring_queue_exit (&uring.ring);
+		return FALSE;
+	}
+	return TRUE;
+}
+#endif
+
+
+/**
+ * stm_writer_job_push:
+ *
+ * Hand over a job to the backend.
+ */
+static void
+stm_writer_job_push (StmWriterJob *job)
+{
+#ifdef HAVE_LIBURING
+	if (pool.backend == STM_WRITER_BACKEND_URING) {
+		g_async_queue_push (uring.queue, job);
+
+		/* Thread may be waiting for completions rather than jobs */
+		if (g_atomic_int_compare_and_exchange (&uring.kicked, 0, 1)) {
+			guint64 one = 1;
+			if (write (uring.wakeup_fd, &one, sizeof (one)) < 0)
+				g_printerr ("Unable to wake up I/O thread: %s\n", g_strerror (errno));
+		}
+		return;
+	}
+#endif
+	g_thread_pool_push (pool.threads, job, NULL);
+}
+
+
+/**
+ * stm_writer_allocate:
+ *
+ * @writer: A #StmWriter
+ * @length: Final size of file
+ *
+ * Reserve disk space for the whole file, so that it is not extended
+ * piece by piece as data arrives. Allocation happens in background;
+ * running out of space is reported like a failed write.
+ */
+void
+stm_writer_allocate (StmWriter *writer, guint64 length)
+{
+	g_mutex_lock (&pool.mutex);
+	StmWriterJob *job = stm_writer_job_new (writer, STM_WRITER_JOB_ALLOCATE);
+	job->offset = 0;
+	job->length = length;
+	g_mutex_unlock (&pool.mutex);
+
+	stm_writer_job_push (job);
+}
+
+
+/**
+ * stm_writer_check_space:
+ *
+ * @writer: A #StmWriter
+ * @length: Final size of file
+ * @error: Return location for error
+ *
+ * Check whether file system holding @writer's file has enough free
+ * space for the file to grow to @length bytes. Blocks that are
+ * already allocated to the file are taken into account.
+ *
+ * Returns: FALSE if file would not fit, or if file system could not
+ * be queried.
+ */
+gboolean
+stm_writer_check_space (StmWriter *writer, guint64 length, GError **error)
+{
+	struct stat st;
+	struct statvfs vfs;
+
+	if (fstat (writer->fd, &st) < 0 || fstatvfs (writer->fd, &vfs) < 0) {
+		stm_writer_set_error (writer, error, "query file system of");
+		return FALSE;
+	}
+
+	guint64 allocated = (guint64) st.st_blocks * 512;
+	guint64 available = (guint64) vfs.f_bavail * vfs.f_frsize;
+	guint64 needed = length > allocated ? length - allocated : 0;
+
+	if (needed > available) {
+		g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_NOSPC,
+		             "Not enough free space for %s: %llu MiB needed, %llu MiB available",
+		             writer->file,
+		             (unsigned long long) (needed >> 20),
+		             (unsigned long long) (available >> 20));
+		return FALSE;
+	}
+	return TRUE;
+}
+
+
+/**
+ * stm_writer_stream_submit:
+ *
+ * Hand over stream's buffer to I/O threads.
+ */
+static void
+stm_writer_stream_submit (StmWriterStream *stream)
+{
+	StmWriter *writer = stream->writer;
+
+	g_mutex_lock (&pool.mutex);
+	StmWriterJob *job = stm_writer_job_new (writer, STM_WRITER_JOB_WRITE);
+	job->offset = stream->offset;
+	job->buffer = stream->buffer;
+	job->size = stream->size;
+	job->len = stream->fill;
+	pool.queued += job->len;
+	g_mutex_unlock (&pool.mutex);
+
+	stm_writer_job_push (job);
+
+	stream->offset += stream->fill;
+	stream->buffer = NULL;
+	stream->fill = 0;
+}
+
+
+/**
+ * stm_writer_stream_new:
+ *
+ * @writer: A #StmWriter
+ * @offset: File offset at which stream starts
+ *
+ * Create a stream writing sequentially from @offset.
+ *
+ * Returns: A new #StmWriterStream. Free with stm_writer_stream_free().
+ */
+StmWriterStream *
+stm_writer_stream_new (StmWriter *writer, guint64 offset)
+{
+	StmWriterStream *stream = g_new0 (StmWriterStream, 1);
+	stream->writer = stm_writer_ref (writer);
+	stream->offset = offset;
+	stream->size = writer->buffer_size;
+
+	return stream;
+}
+
+
+/**
+ * stm_writer_stream_write:
+ *
+ * @stream: A #StmWriterStream
+ * @data: Data to write
+ * @len: Length of @data
+ * @error: Return location for error
+ *
+ * Append data to stream. Data is copied to stream's buffer, and
+ * every buffer that fills up is queued for writing by I/O threads.
+ * This function never blocks on disk.
+ *
+ * Returns: FALSE if an earlier background write has failed.
+ */
+gboolean
+stm_writer_stream_write (StmWriterStream *stream, const void *data,
+                         gsize len, GError **error)
+{
+	if (! stm_writer_check_error (stream->writer, error))
+		return FALSE;
+
+	const guchar *p = data;
+	while (len > 0) {
+		if (stream->buffer == NULL)
+			stream->buffer = stm_writer_buffer_new (stream->size);
+
+		gsize n = MIN (len, stream->size - stream->fill);
+		memcpy (stream->buffer + stream->fill, p, n);
+		stream->fill += n;
+		p += n;
+		len -= n;
+
+		if (stream->fill == stream->size)
+			stm_writer_stream_submit (stream);
+	}
+	return TRUE;
+}
+
+
+/**
+ * stm_writer_stream_flush:
+ *
+ * @stream: A #StmWriterStream
+ * @error: Return location for error
+ *
+ * Queue buffered data for writing. Use stm_writer_drain() to find out
+ * when it has reached the disk.
+ *
+ * Returns: FALSE if an earlier background write has failed.
+ */
+gboolean
+stm_writer_stream_flush (StmWriterStream *stream, GError **error)
+{
+	if (stream->fill > 0)
+		stm_writer_stream_submit (stream);
+
+	return stm_writer_check_error (stream->writer, error);
+}
+
+
+/**
+ * stm_writer_stream_get_offset:
+ *
+ * @stream: A #StmWriterStream
+ *
+ * Returns: File offset at which next byte written to @stream will
+ * land.
+ */
+guint64
+stm_writer_stream_get_offset (StmWriterStream *stream)
+{
+	return stream->offset + stream->fill;
+}
+
+
+/**
+ * stm_writer_stream_free:
+ *
+ * @stream: A #StmWriterStream
+ *
+ * Free a stream. Buffered data is discarded, call
+ * stm_writer_stream_flush() first to keep it.
+ */
+void
+stm_writer_stream_free (StmWriterStream *stream)
+{
+	if (stream->buffer != NULL)
+		stm_writer_buffer_free (stream->buffer, stream->size);
+	stm_writer_unref (stream->writer);
+	g_free (stream);
+}
@@ -0,0 +1,159 @@
+/*
+ * Simple Transfer Manager
+ * -----------------------
+ *
+ * Copyright (C) 2008 Przemysław Sitek
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __STM_WRITER_H__
+#define __STM_WRITER_H__
+
+#include <glib.h>
+#include "stm-range-map.h"
+
+G_BEGIN_DECLS
+
+/* Default size of a write batch, in bytes */
+#define STM_WRITER_DEFAULT_BUFFER_SIZE	(256 * 1024)
+
+/* Alignment of write buffers, in bytes */
+#define STM_WRITER_ALIGNMENT		4096
+
+/* Default number of I/O threads */
+#define STM_WRITER_DEFAULT_THREADS	2
+
+/* Default limit of data waiting for I/O threads, in bytes */
+#define STM_WRITER_DEFAULT_MAX_QUEUED	(64 * 1024 * 1024)
+
+
+/**
+ * StmWriterBackend:
+ *
+ * @STM_WRITER_BACKEND_THREADS: Blocking writes in a thread pool
+ * @STM_WRITER_BACKEND_URING: Batched submissions to a shared io_uring
+ *
+ * Method of writing data to disk.
+ */
+typedef enum {
+	STM_WRITER_BACKEND_THREADS,
+	STM_WRITER_BACKEND_URING
+} StmWriterBackend;
+
+
+typedef struct _StmWriter		StmWriter;
+typedef struct _StmWriterStream		StmWriterStream;
+
+typedef void (*StmWriterFunc)			(StmWriter *writer,
+						 const GError *error,
+						 gpointer data);
+
+
+void
+stm_writer_set_backend				(StmWriterBackend backend);
+
+StmWriterBackend
+stm_writer_get_backend				(void);
+
+void
+stm_writer_set_threads				(guint threads);
+
+void
+stm_writer_set_max_queued			(gsize bytes);
+
+void
+stm_writer_set_resume_func			(GSourceFunc func,
+						 gpointer data);
+
+gboolean
+stm_writer_is_congested				(void);
+
+
+StmWriter *
+stm_writer_open					(const gchar *file,
+						 gboolean truncate,
+						 GError **error);
+
+StmWriter *
+stm_writer_ref					(StmWriter *writer);
+
+void
+stm_writer_unref				(StmWriter *writer);
+
+int
+stm_writer_get_fd				(StmWriter *writer);
+
+void
+stm_writer_set_buffer_size			(StmWriter *writer,
+						 gsize size);
+
+gsize
+stm_writer_get_buffer_size			(StmWriter *writer);
+
+void
+stm_writer_set_range_map			(StmWriter *writer,
+						 StmRangeMap *map);
+
+StmRangeMap *
+stm_writer_get_range_map			(StmWriter *writer);
+
+void
+stm_writer_allocate				(StmWriter *writer,
+						 guint64 length);
+
+gboolean
+stm_writer_check_space				(StmWriter *writer,
+						 guint64 length,
+						 GError **error);
+
+void
+stm_writer_drain				(StmWriter *writer,
+						 StmWriterFunc func,
+						 gpointer data);
+
+void
+stm_writer_sync					(StmWriter *writer,
+						 StmWriterFunc func,
+						 gpointer data);
+
+void
+stm_writer_cancel_drain				(StmWriter *writer);
+
+
+StmWriterStream *
+stm_writer_stream_new				(StmWriter *writer,
+						 guint64 offset);
+
+gboolean
+stm_writer_stream_write				(StmWriterStream *stream,
+						 const void *data,
+						 gsize len,
+						 GError **error);
+
+gboolean
+stm_writer_stream_flush				(StmWriterStream *stream,
+						 GError **error);
+
+guint64
+stm_writer_stream_get_offset			(StmWriterStream *stream);
+
+void
+stm_writer_stream_free				(StmWriterStream *stream);
+
+G_END_DECLS
+
+#endif
@@ -151,3 +151,39 @@ stm_find_user_file (const gchar *file)
 				 file,
 				 NULL);
 }
+
+
+/**
+ * stm_uri_get_origin:
+ *
+ * @uri: An URI
+ *
+ * Find origin of @uri: scheme, host and port, without user name
+ * and path. Host name is converted to lower case.
+ *
+ * Returns: Newly allocated string, like "http://example.com:8080",
+ * or NULL if @uri is NULL.
+ **/
+gchar *
+stm_uri_get_origin (const gchar *uri)
+{
+	if (uri == NULL)
+		return NULL;
+
+	const gchar *sep = strstr (uri, "://");
+	if (sep == NULL)
+		return g_strdup (uri);
+
+	const gchar *host = sep + 3;
+	const gchar *end = host + strcspn (host, "/?#");
+	const gchar *at = memchr (host, '@', end - host);
+	if (at != NULL)
+		host = at + 1;
+
+	gchar *scheme = g_ascii_strdown (uri, sep + 3 - uri);
+	gchar *name = g_ascii_strdown (host, end - host);
+	gchar *origin = g_strconcat (scheme, name, NULL);
+	g_free (scheme);
+	g_free (name);
+	return origin;
+}
@@ -49,4 +49,8 @@ stm_basename (const gchar *file);
 gchar *
 stm_find_user_file (const gchar *file);
 
+
+gchar *
+stm_uri_get_origin (const gchar *uri);
+
 #endif
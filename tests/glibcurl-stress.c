@@ -0,0 +1,340 @@
+/*
+ * Simple Transfer Manager
+ * -----------------------
+ *
+ * Copyright (C) 2008 Przemysław Sitek
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+/*
+ * Stress test of glibcurl: a local HTTP server holds back all
+ * responses until every request has arrived, so that all handles have
+ * a connection open at the same time. Far more sockets than the old
+ * fixed-size descriptor table could take are watched at once.
+ *
+ * Usage: glibcurl-stress [number of handles]
+ */
+
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <curl/curl.h>
+#include "glibcurl.h"
+
+#define STRESS_DEFAULT_HANDLES	512
+#define STRESS_TIMEOUT		60	// Seconds
+
+#define STRESS_BODY		"stm"
+#define STRESS_RESPONSE		"HTTP/1.1 200 OK\r\n" \
+				"Content-Length: 3\r\n" \
+				"Connection: close\r\n" \
+				"\r\n" STRESS_BODY
+
+
+/**
+ * StressClient:
+ *
+ * Connection accepted by the server.
+ */
+typedef struct {
+	int		 fd;
+	GIOChannel	*channel;
+	guint		 watch_id;
+	GString		*request;	// Received so far
+	gboolean	 complete;	// Whole request header has arrived
+} StressClient;
+
+
+static struct {
+	guint		 n_handles;
+	GMainLoop	*loop;
+	int		 listen_fd;
+	GPtrArray	*clients;	// StressClient's
+	guint		 n_requests;	// Complete requests received
+	guint		 max_sockets;	// Most sockets glibcurl watched at once
+	guint		 n_done;
+	guint		 n_failed;
+	gboolean	 timed_out;
+} stress;
+
+
+/**
+ * stress_client_free:
+ *
+ * Close connection to a client.
+ */
+static void
+stress_client_free (StressClient *client)
+{
+	if (client->watch_id != 0)
+		g_source_remove (client->watch_id);
+	g_io_channel_unref (client->channel);
+	close (client->fd);
+	g_string_free (client->request, TRUE);
+	g_free (client);
+}
+
+
+/**
+ * stress_respond_all:
+ *
+ * Every request has arrived: answer them all and close connections.
+ */
+static void
+stress_respond_all (void)
+{
+	g_print ("%u requests held at once, glibcurl watched %u sockets\n",
+	         stress.n_requests, stress.max_sockets);
+
+	guint i;
+	for (i = 0; i < stress.clients->len; i++) {
+		StressClient *client = stress.clients->pdata[i];
+
+		/* Response is small enough for any socket buffer */
+		if (write (client->fd, STRESS_RESPONSE, strlen (STRESS_RESPONSE)) < 0)
+			g_printerr ("Unable to respond: %s\n", g_strerror (errno));
+		stress_client_free (client);
+	}
+	g_ptr_array_set_size (stress.clients, 0);
+}
+
+
+/**
+ * stress_client_readable:
+ *
+ * Collect request of a client.
+ */
+static gboolean
+stress_client_readable (GIOChannel *channel, GIOCondition condition,
+                        StressClient *client)
+{
+	gchar buffer[1024];
+	ssize_t n = read (client->fd, buffer, sizeof (buffer));
+
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return TRUE;
+	if (n <= 0) {
+		/* Client gave up, its handle reports the failure */
+		client->watch_id = 0;
+		g_ptr_array_remove (stress.clients, client);
+		stress_client_free (client);
+		return FALSE;
+	}
+
+	g_string_append_len (client->request, buffer, n);
+	if (client->complete || strstr (client->request->str, "\r\n\r\n") == NULL)
+		return TRUE;
+
+	client->complete = TRUE;
+	stress.n_requests++;
+	stress.max_sockets = MAX (stress.max_sockets, glibcurl_get_n_sockets ());
+	if (stress.n_requests == stress.n_handles)
+		stress_respond_all ();
+	return TRUE;
+}
+
+
+/**
+ * stress_accept:
+ *
+ * Accept all pending connections.
+ */
+static gboolean
+stress_accept (GIOChannel *channel, GIOCondition condition, gpointer data)
+{
+	for (;;) {
+		int fd = accept (stress.listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno != EAGAIN && errno != EINTR)
+				g_printerr ("Unable to accept: %s\n", g_strerror (errno));
+			return TRUE;
+		}
+		fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+
+		StressClient *client = g_new0 (StressClient, 1);
+		client->fd = fd;
+		client->channel = g_io_channel_unix_new (fd);
+		client->request = g_string_new (NULL);
+		client->watch_id = g_io_add_watch (client->channel, G_IO_IN | G_IO_HUP | G_IO_ERR,
+		                                   (GIOFunc) stress_client_readable, client);
+		g_ptr_array_add (stress.clients, client);
+	}
+}
+
+
+/**
+ * stress_listen:
+ *
+ * Start server on a free port of loopback interface.
+ *
+ * Returns: Port number, or 0 on failure.
+ */
+static guint
+stress_listen (void)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof (addr);
+
+	stress.listen_fd = socket (AF_INET, SOCK_STREAM, 0);
+	if (stress.listen_fd < 0)
+		return 0;
+
+	memset (&addr, 0, sizeof (addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+	addr.sin_port = 0;
+	if (bind (stress.listen_fd, (struct sockaddr *) &addr, sizeof (addr)) < 0
+	    || listen (stress.listen_fd, SOMAXCONN) < 0
+	    || getsockname (stress.listen_fd, (struct sockaddr *) &addr, &len) < 0)
+		return 0;
+	fcntl (stress.listen_fd, F_SETFL, fcntl (stress.listen_fd, F_GETFL) | O_NONBLOCK);
+
+	GIOChannel *channel = g_io_channel_unix_new (stress.listen_fd);
+	g_io_add_watch (channel, G_IO_IN, stress_accept, NULL);
+	g_io_channel_unref (channel);
+
+	return ntohs (addr.sin_port);
+}
+
+
+/**
+ * stress_write_callback:
+ *
+ * Check body of response.
+ */
+static size_t
+stress_write_callback (char *data, size_t size, size_t nmemb, GString *body)
+{
+	g_string_append_len (body, data, size * nmemb);
+	return size * nmemb;
+}
+
+
+/**
+ * stress_glibcurl_callback:
+ *
+ * Collect finished handles.
+ */
+static void
+stress_glibcurl_callback (void *data)
+{
+	CURLMsg *msg;
+	int msgs;
+
+	stress.max_sockets = MAX (stress.max_sockets, glibcurl_get_n_sockets ());
+
+	while ((msg = curl_multi_info_read (glibcurl_handle (), &msgs)) != NULL) {
+		if (msg->msg != CURLMSG_DONE)
+			continue;
+
+		CURL *curl = msg->easy_handle;
+		GString *body;
+		long code = 0;
+		curl_easy_getinfo (curl, CURLINFO_PRIVATE, (char **) &body);
+		curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &code);
+
+		if (msg->data.result != CURLE_OK || code != 200
+		    || strcmp (body->str, STRESS_BODY) != 0) {
+			g_printerr ("Handle failed: %s, response %ld\n",
+			            curl_easy_strerror (msg->data.result), code);
+			stress.n_failed++;
+		}
+
+		glibcurl_remove (curl);
+		curl_easy_cleanup (curl);
+		g_string_free (body, TRUE);
+
+		if (++stress.n_done == stress.n_handles)
+			g_main_loop_quit (stress.loop);
+	}
+}
+
+
+static gboolean
+stress_timeout (gpointer data)
+{
+	stress.timed_out = TRUE;
+	g_main_loop_quit (stress.loop);
+	return FALSE;
+}
+
+
+int
+main (int argc, char *argv[])
+{
+	stress.n_handles = argc > 1 ? (guint) atoi (argv[1]) : STRESS_DEFAULT_HANDLES;
+	if (stress.n_handles == 0) {
+		g_printerr ("Usage: %s [number of handles]\n", argv[0]);
+		return 2;
+	}
+
+	/* Each connection takes a descriptor on both ends */
+	glibcurl_raise_fd_limit ();
+	glibcurl_init ();
+	glibcurl_set_callback (stress_glibcurl_callback, NULL);
+
+	stress.loop = g_main_loop_new (NULL, FALSE);
+	stress.clients = g_ptr_array_new ();
+
+	guint port = stress_listen ();
+	if (port == 0) {
+		g_printerr ("Unable to start server: %s\n", g_strerror (errno));
+		return 1;
+	}
+
+	gchar *url = g_strdup_printf ("http://127.0.0.1:%u/", port);
+	guint i;
+	for (i = 0; i < stress.n_handles; i++) {
+		CURL *curl = curl_easy_init ();
+		GString *body = g_string_new (NULL);
+		curl_easy_setopt (curl, CURLOPT_URL, url);
+		curl_easy_setopt (curl, CURLOPT_PRIVATE, body);
+		curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, stress_write_callback);
+		curl_easy_setopt (curl, CURLOPT_WRITEDATA, body);
+		curl_easy_setopt (curl, CURLOPT_NOSIGNAL, 1L);
+		glibcurl_add (curl);
+	}
+	g_free (url);
+
+	g_timeout_add_seconds (STRESS_TIMEOUT, stress_timeout, NULL);
+	g_main_loop_run (stress.loop);
+
+	gboolean ok = ! stress.timed_out && stress.n_failed == 0
+	              && stress.n_requests == stress.n_handles
+	              && stress.max_sockets >= stress.n_handles;
+	if (stress.timed_out)
+		g_printerr ("Timed out, %u of %u requests received, %u handles done\n",
+		            stress.n_requests, stress.n_handles, stress.n_done);
+	else
+		g_print ("%u handles done, %u failed\n", stress.n_done, stress.n_failed);
+
+	/* Handles left over after a timeout are not cleaned up */
+	if (! stress.timed_out)
+		glibcurl_cleanup ();
+	close (stress.listen_fd);
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,180 @@
+/*
+ * Simple Transfer Manager
+ * -----------------------
+ *
+ * Copyright (C) 2008 Przemysław Sitek
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+/*
+ * Test of range map bookkeeping when downloads resume at offsets which
+ * are not aligned to range map blocks. Data is written through a
+ * StmWriter the way segments do, and once it has been flushed every
+ * block has to be marked, including those straddling write batches.
+ */
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <stdio.h>
+#include "stm-range-map.h"
+#include "stm-writer.h"
+
+/* Not a multiple of block size, so the last block is short */
+#define TEST_LENGTH		(3 * 1024 * 1024 + 12345)
+
+/* Where previous session stopped, in the middle of a block */
+#define TEST_RESUME		100000
+
+/* Refetched range, starting and ending in the middle of blocks */
+#define TEST_REFETCH_START	(1024 * 1024 + 777)
+#define TEST_REFETCH_LEN	(200 * 1024)
+
+/* Network delivers data in pieces of this size */
+#define TEST_CHUNK		16000
+
+
+static GMainLoop *loop;
+static gboolean failed;
+
+
+static void
+test_synced (StmWriter *writer, const GError *error, gpointer data)
+{
+	if (error != NULL) {
+		g_printerr ("%s\n", error->message);
+		failed = TRUE;
+	}
+	g_main_loop_quit (loop);
+}
+
+
+/**
+ * test_write:
+ *
+ * Write a range through a stream and wait until it has been flushed.
+ */
+static void
+test_write (StmWriter *writer, guint64 offset, guint64 len)
+{
+	StmWriterStream *stream = stm_writer_stream_new (writer, offset);
+	guchar chunk[TEST_CHUNK];
+	GError *error = NULL;
+
+	while (len > 0) {
+		gsize n = MIN (len, sizeof (chunk));
+		memset (chunk, (offset & 0xff), n);
+		if (! stm_writer_stream_write (stream, chunk, n, &error))
+			break;
+		offset += n;
+		len -= n;
+	}
+	if (error == NULL)
+		stm_writer_stream_flush (stream, &error);
+	stm_writer_stream_free (stream);
+
+	if (error != NULL) {
+		g_printerr ("%s\n", error->message);
+		g_error_free (error);
+		failed = TRUE;
+		return;
+	}
+
+	stm_writer_sync (writer, test_synced, NULL);
+	g_main_loop_run (loop);
+}
+
+
+/**
+ * test_check:
+ *
+ * Check that the whole file is marked as written.
+ */
+static void
+test_check (StmRangeMap *map, const gchar *what)
+{
+	GArray *missing = stm_range_map_get_missing (map);
+	guint64 count = stm_range_map_count (map);
+
+	if (missing->len > 0 || count != TEST_LENGTH) {
+		g_printerr ("%s: %" G_GUINT64_FORMAT " of %u bytes marked", what,
+		            count, TEST_LENGTH);
+		if (missing->len > 0)
+			g_printerr (", first missing range %" G_GUINT64_FORMAT "-%" G_GUINT64_FORMAT,
+			            g_array_index (missing, StmRange, 0).start,
+			            g_array_index (missing, StmRange, 0).end);
+		g_printerr ("\n");
+		failed = TRUE;
+	} else {
+		g_print ("%s: ok\n", what);
+	}
+	g_array_free (missing, TRUE);
+}
+
+
+int
+main (int argc, char *argv[])
+{
+	GError *error = NULL;
+
+	gchar *dir = g_dir_make_tmp ("stm-test-XXXXXX", &error);
+	if (dir == NULL) {
+		g_printerr ("%s\n", error->message);
+		return 1;
+	}
+	gchar *file = g_build_filename (dir, "partial", NULL);
+	loop = g_main_loop_new (NULL, FALSE);
+
+	StmWriter *writer = stm_writer_open (file, TRUE, &error);
+	StmRangeMap *map = writer ? stm_range_map_open (file, TEST_LENGTH, &error) : NULL;
+	if (map == NULL) {
+		g_printerr ("%s\n", error->message);
+		return 1;
+	}
+
+	/* Previous session got this far, as restored from saved counter */
+	test_write (writer, 0, TEST_RESUME);
+	stm_range_map_mark (map, 0, TEST_RESUME);
+	stm_writer_set_range_map (writer, map);
+
+	test_write (writer, TEST_RESUME, TEST_LENGTH - TEST_RESUME);
+	test_check (map, "Resume from unaligned offset");
+
+	/* A corrupted block is downloaded again from the middle of a block */
+	stm_range_map_unmark (map, TEST_REFETCH_START, TEST_REFETCH_LEN);
+	test_write (writer, TEST_REFETCH_START, TEST_REFETCH_LEN);
+	test_check (map, "Refetch of unaligned range");
+
+	/* Marks survive in the sidecar */
+	stm_writer_unref (writer);
+	map = stm_range_map_open (file, TEST_LENGTH, &error);
+	if (map == NULL) {
+		g_printerr ("%s\n", error->message);
+		return 1;
+	}
+	test_check (map, "Reopened range map");
+	stm_range_map_close (map);
+
+	stm_range_map_remove (file);
+	g_unlink (file);
+	g_rmdir (dir);
+	g_free (file);
+	g_free (dir);
+
+	return failed ? 1 : 0;
+}
@@ -283,6 +283,20 @@ sub write_makefile_inc
 	print F "UC_CFLAGS=",$self->{CFLAGS},"\n";
 	print F "UC_LDFLAGS=",$self->{LDFLAGS},"\n";
 
+	# Defines are also passed on command line, for sources which
+	# do not include config.h
+	print F "UC_DEFINES=";
+	for my $key (sort keys %{$self->{DEFINES}}) {
+		my $val = $self->{DEFINES}->{$key};
+
+		if (defined $val) {
+			print F " '-D$key=\"$val\"'";
+		} else {
+			print F " -D$key";
+		}
+	}
+	print F "\n";
+
 	close F;
 }
 